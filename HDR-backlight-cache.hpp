@@ -0,0 +1,318 @@
+/* Frame cache for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_CACHE_H
+#define HDR_BACKLIGHT_CACHE_H
+
+#include <iostream>       // std::cerr, std::endl
+#include <cstdio>         // FILE, fopen(), rename()
+#include <cstring>        // std::memcpy, std::memcmp
+#include <string>         // std::string
+#include <vector>         // std::vector
+#include <algorithm>      // std::min
+#include <unordered_map>  // std::unordered_map
+
+#include "HDR-backlight-driver.hpp"  // GSFrame
+
+// A cache file holds the entries, least recently used first, so that loading it restores the order:
+//     FrameCacheHeader
+//     count entries: 8 bytes key, FRAME_CACHE_BYTES bytes frame in wire order
+// Everything is stored in the host's byte order. hashFrame() depends on it too, so a file
+// moved to a host of the other byte order loads, but doesn't hit.
+#define FRAME_CACHE_MAGIC "HBLC"
+#define FRAME_CACHE_VERSION 1
+#define FRAME_CACHE_BYTES (TLC_FRAME_VALUE_COUNT * 2)
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// 64-bit hash of a decoded picture, four independent multiply-xor lanes, so that it runs at
+// several bytes per cycle; a 4K frame takes a few milliseconds, a fraction of analysing it.
+// Not cryptographic: with a million cached frames, the chance of any collision is below 1e-7.
+// Mix whatever else changes the result (transfer, peak, mix, ...) into the seed
+uint64_t hashFrame(const void* data, size_t size, uint64_t seed = 0);
+
+// The payload of a 'G', 'O' command: TLC_FRAME_VALUE_COUNT values, higher byte first
+void frameToWire(const GSFrame& frame, uint8_t* wire);
+void wireToFrame(const uint8_t* wire, GSFrame& frame);
+
+struct FrameCacheHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t frame_bytes;  // FRAME_CACHE_BYTES
+    uint64_t count;
+};
+
+// Finished frames, ready for TLCdriver::updateFrameWire(), by the hash of the picture they were computed from
+// (or any other 64-bit key, e.g. the decoder's frame number). Looping content computes every frame once;
+// later passes skip the analysis and the encoding.
+// The memory is allocated up front and bounded; when full, the least recently used frame is evicted.
+// Not thread-safe, like TLCdriver
+class FrameCache {
+   public:
+    // Holds as many frames as fit in max_bytes, including the bookkeeping
+    explicit FrameCache(size_t max_bytes);
+
+    size_t size() const {
+        return _index.size();
+    }
+    size_t capacity() const {
+        return _entries.size();
+    }
+
+    // The frame cached for the key, FRAME_CACHE_BYTES bytes valid until the next insert(), or nullptr.
+    // A hit makes the frame the most recently used
+    const uint8_t* find(uint64_t key);
+    // Add or replace the frame for the key
+    void insert(uint64_t key, const uint8_t* wire);
+    void insert(uint64_t key, const GSFrame& frame);
+    void clear();
+
+    // Write all the frames to path, through a temporary file renamed over it, so that a crash leaves the old file
+    bool save(const char* path) const;
+    // Add the frames of a file written by save(); if there are more than fit, the most recently used are kept
+    bool load(const char* path);
+
+    struct CacheStats {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+        double hit_rate;  // hits / (hits + misses), 0 before the first find()
+    };
+    CacheStats stats() const;
+    void resetStats();
+
+   private:
+    // Doubly linked list through the entries, most recently used at the head; free entries in a separate list
+    struct Entry {
+        uint64_t key;
+        uint32_t previous, next;
+        uint8_t wire[FRAME_CACHE_BYTES];
+    };
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    std::vector<Entry> _entries;
+    std::unordered_map<uint64_t, uint32_t> _index;
+    uint32_t _head = NONE, _tail = NONE, _free = NONE;
+    unsigned long _hits = 0, _misses = 0, _evictions = 0;
+
+    void unlink(uint32_t entry);
+    void push_front(uint32_t entry);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+uint64_t hashFrame(const void* data, size_t size, uint64_t seed) {
+    const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL, PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t lanes[4] = {seed + PRIME_1, seed ^ PRIME_2, seed - PRIME_1, ~seed};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i + 8 * lane, 8);
+            lanes[lane] = (lanes[lane] ^ word) * PRIME_1;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = size * PRIME_2;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * PRIME_2;
+        hash ^= hash >> 31;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * PRIME_1;
+    }
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    return hash ^ (hash >> 29);
+}
+
+void frameToWire(const GSFrame& frame, uint8_t* wire) {
+    const uint16_t* values = &frame.gs[0][0][0];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        wire[2 * i] = (uint8_t)(values[i] >> 8);
+        wire[2 * i + 1] = (uint8_t)values[i];
+    }
+}
+
+void wireToFrame(const uint8_t* wire, GSFrame& frame) {
+    uint16_t* values = &frame.gs[0][0][0];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        values[i] = (uint16_t)(wire[2 * i] << 8 | wire[2 * i + 1]);
+    }
+}
+
+FrameCache::FrameCache(size_t max_bytes) {
+    // An entry, and its node and bucket in the index
+    const size_t entry_bytes = sizeof(Entry) + 4 * sizeof(void*) + sizeof(uint64_t) + sizeof(uint32_t);
+    size_t count = std::min<size_t>(max_bytes / entry_bytes, NONE - 1);
+    if (count == 0) {
+        std::cerr << "FrameCache::FrameCache():\n\tError: " << max_bytes << " bytes don't hold a frame" << std::endl;
+    }
+    _entries.resize(count);
+    _index.reserve(count);
+    clear();
+}
+
+void FrameCache::clear() {
+    _index.clear();
+    _head = _tail = NONE;
+    _free = _entries.empty() ? NONE : 0;
+    for (size_t i = 0; i < _entries.size(); i++) {
+        _entries[i].next = i + 1 < _entries.size() ? (uint32_t)(i + 1) : NONE;
+    }
+}
+
+void FrameCache::unlink(uint32_t entry) {
+    Entry& e = _entries[entry];
+    (e.previous == NONE ? _head : _entries[e.previous].next) = e.next;
+    (e.next == NONE ? _tail : _entries[e.next].previous) = e.previous;
+}
+
+void FrameCache::push_front(uint32_t entry) {
+    Entry& e = _entries[entry];
+    e.previous = NONE;
+    e.next = _head;
+    (_head == NONE ? _tail : _entries[_head].previous) = entry;
+    _head = entry;
+}
+
+const uint8_t* FrameCache::find(uint64_t key) {
+    auto found = _index.find(key);
+    if (found == _index.end()) {
+        _misses++;
+        return nullptr;
+    }
+    _hits++;
+    if (found->second != _head) {
+        unlink(found->second);
+        push_front(found->second);
+    }
+    return _entries[found->second].wire;
+}
+
+void FrameCache::insert(uint64_t key, const uint8_t* wire) {
+    if (_entries.empty()) {
+        return;
+    }
+    uint32_t entry;
+    auto found = _index.find(key);
+    if (found != _index.end()) {
+        entry = found->second;
+        unlink(entry);
+    } else if (_free != NONE) {
+        entry = _free;
+        _free = _entries[entry].next;
+        _index.emplace(key, entry);
+    } else {
+        entry = _tail;
+        unlink(entry);
+        _index.erase(_entries[entry].key);
+        _index.emplace(key, entry);
+        _evictions++;
+    }
+    _entries[entry].key = key;
+    std::memcpy(_entries[entry].wire, wire, FRAME_CACHE_BYTES);
+    push_front(entry);
+}
+
+void FrameCache::insert(uint64_t key, const GSFrame& frame) {
+    uint8_t wire[FRAME_CACHE_BYTES];
+    frameToWire(frame, wire);
+    insert(key, wire);
+}
+
+bool FrameCache::save(const char* path) const {
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        perror("FrameCache::save():\n\tError");
+        return false;
+    }
+    FrameCacheHeader header = {};
+    std::memcpy(header.magic, FRAME_CACHE_MAGIC, 4);
+    header.version = FRAME_CACHE_VERSION;
+    header.frame_bytes = FRAME_CACHE_BYTES;
+    header.count = _index.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t entry = _tail; ok && entry != NONE; entry = _entries[entry].previous) {
+        ok = fwrite(&_entries[entry].key, sizeof(uint64_t), 1, file) == 1 && fwrite(_entries[entry].wire, FRAME_CACHE_BYTES, 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path) != 0) {
+        std::cerr << "FrameCache::save():\n\tError: couldn't write " << path << std::endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FrameCache::load(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        perror("FrameCache::load():\n\tError");
+        return false;
+    }
+    FrameCacheHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, FRAME_CACHE_MAGIC, 4) != 0 ||
+        header.version != FRAME_CACHE_VERSION || header.frame_bytes != FRAME_CACHE_BYTES) {
+        std::cerr << "FrameCache::load():\n\tError: " << path << " is not a frame cache, or a different version" << std::endl;
+        fclose(file);
+        return false;
+    }
+    uint64_t key;
+    uint8_t wire[FRAME_CACHE_BYTES];
+    uint64_t loaded = 0;
+    const unsigned long evictions = _evictions;  // Filling the cache from a file doesn't count
+    while (loaded < header.count && fread(&key, sizeof(key), 1, file) == 1 && fread(wire, FRAME_CACHE_BYTES, 1, file) == 1) {
+        insert(key, wire);
+        loaded++;
+    }
+    fclose(file);
+    _evictions = evictions;
+    if (loaded < header.count) {
+        std::cerr << "FrameCache::load():\n\tError: " << path << " is truncated, loaded " << loaded << " of " << header.count << " frames"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+FrameCache::CacheStats FrameCache::stats() const {
+    CacheStats result = {_hits, _misses, _evictions, 0};
+    if (_hits + _misses > 0) {
+        result.hit_rate = (double)_hits / (_hits + _misses);
+    }
+    return result;
+}
+
+void FrameCache::resetStats() {
+    _hits = _misses = _evictions = 0;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_CACHE_H
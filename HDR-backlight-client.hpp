@@ -0,0 +1,207 @@
+/* Client of backlightd, the HDR backlight daemon
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_CLIENT_H
+#define HDR_BACKLIGHT_CLIENT_H
+
+#include <iostream>  // std::cerr, std::endl
+#include <atomic>    // std::atomic
+#include <string>    // std::string
+#include <chrono>    // std::chrono::steady_clock
+#include <new>       // placement new
+#include <cstdio>    // snprintf()
+
+#include <fcntl.h>       // O_RDWR
+#include <unistd.h>      // read(), write(), close()
+#include <sys/mman.h>    // shm_open(), mmap()
+#include <sys/socket.h>  // socket(), connect()
+#include <sys/un.h>      // sockaddr_un
+
+#include "HDR-backlight-driver.hpp"  // GSFrame, TripleBuffer
+
+// backlightd keeps the Teensy's serial port open, and local processes send it frames
+// through shared memory, one lock-free mailbox per client, without copying them.
+// The control channel is a Unix socket with one text command per line:
+//     HELLO <priority>     -> OK <slot> <generation>
+//                                             Register, the slot is the client's mailbox, as long as
+//                                             the slot's generation doesn't change
+//     PRIORITY <priority>  -> OK              The highest priority client sending frames owns the LEDs
+//     BRIGHTNESS <0-127>   -> OK              TLCdriver::setGlobalBrightness()
+//     STATS                -> OK frames=<n> dropped=<n> latency_mean_us=<x> latency_max_us=<x>
+//                                             Latency from publish() to the Teensy's feedback
+// Anything else is answered with ERROR <reason>. Closing the socket unregisters the client.
+#define BACKLIGHTD_SOCKET_PATH "/tmp/backlightd.sock"
+#define BACKLIGHTD_SHM_NAME "/backlightd"
+#define BACKLIGHTD_MAX_CLIENTS 8
+#define BACKLIGHTD_MAGIC 0x424C4432  // "BLD2"
+#define BACKLIGHTD_MAX_LINE 256  // Of a command, the daemon disconnects a client sending longer ones
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+struct StampedFrame {
+    GSFrame frame;
+    int64_t publish_ns;  // steady_clock (CLOCK_MONOTONIC) time of publish(), the same in every process
+};
+
+// One client's mailbox. backlightd retires a slot when its client leaves, by counting up the generation:
+// a client that kept the slot's mapping stops publishing instead of writing into the next client's mailbox.
+// The mailbox isn't rebuilt for the next client, backlightd drains what was left in it
+struct BacklightSlot {
+    std::atomic<uint32_t> generation{0};
+    TripleBuffer<StampedFrame> mailbox;
+};
+
+// The shared memory, created by backlightd
+struct BacklightShm {
+    uint32_t magic;
+    uint32_t max_clients;
+    BacklightSlot slot[BACKLIGHTD_MAX_CLIENTS];
+};
+
+class BacklightClient {
+   public:
+    // ctor: Register with backlightd, and map its shared memory
+    BacklightClient(int priority = 0, const char* socket_path = BACKLIGHTD_SOCKET_PATH);
+
+    // dtor: Unregister and unmap the shared memory
+    ~BacklightClient();
+
+    BacklightClient(const BacklightClient&) = delete;
+    BacklightClient& operator=(const BacklightClient&) = delete;
+
+    // False also once backlightd retired the slot
+    bool connected() const {
+        return _slot != nullptr && _slot->generation.load(std::memory_order_acquire) == _generation;
+    }
+
+    // The next frame, set it in place in the shared memory, then publish() it.
+    // nullptr if not connected
+    GSFrame* frame() {
+        return connected() ? &_slot->mailbox.back().frame : nullptr;
+    }
+    // false if not connected
+    bool publish() {
+        if (!connected()) {
+            return false;
+        }
+        _slot->mailbox.back().publish_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        _slot->mailbox.publish();
+        return true;
+    }
+
+    bool setPriority(int priority);
+    bool setGlobalBrightness(uint8_t bright);
+    // The answer to STATS, empty if the daemon couldn't be reached
+    std::string stats();
+
+   private:
+    int _socket = -1;
+    BacklightShm* _shm = nullptr;
+    BacklightSlot* _slot = nullptr;
+    uint32_t _generation = 0;  // Of the slot when registering
+
+    // Send one command line and return the answer line, empty on error
+    std::string request(const std::string& command);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+BacklightClient::BacklightClient(int priority, const char* socket_path) {
+    _socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    if (_socket == -1 || connect(_socket, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        perror("BacklightClient: couldn't connect to backlightd\n\t");
+        return;
+    }
+
+    int shm_fd = shm_open(BACKLIGHTD_SHM_NAME, O_RDWR, 0);
+    if (shm_fd == -1) {
+        perror("BacklightClient: couldn't open the shared memory\n\t");
+        return;
+    }
+    void* shm = mmap(NULL, sizeof(BacklightShm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED) {
+        perror("BacklightClient: couldn't map the shared memory\n\t");
+        return;
+    }
+    _shm = (BacklightShm*)shm;
+    if (_shm->magic != BACKLIGHTD_MAGIC) {
+        std::cerr << "BacklightClient: backlightd is a different version" << std::endl;
+        return;
+    }
+
+    std::string answer = request("HELLO " + std::to_string(priority));
+    int slot;
+    unsigned generation;
+    if (sscanf(answer.c_str(), "OK %d %u", &slot, &generation) != 2 || slot < 0 || slot >= BACKLIGHTD_MAX_CLIENTS) {
+        std::cerr << "BacklightClient: backlightd refused: " << answer << std::endl;
+        return;
+    }
+    _generation = generation;
+    _slot = &_shm->slot[slot];
+}
+
+BacklightClient::~BacklightClient() {
+    if (_shm != nullptr) {
+        munmap(_shm, sizeof(BacklightShm));
+    }
+    if (_socket != -1) {
+        close(_socket);
+    }
+}
+
+bool BacklightClient::setPriority(int priority) {
+    return request("PRIORITY " + std::to_string(priority)) == "OK";
+}
+
+bool BacklightClient::setGlobalBrightness(uint8_t bright) {
+    return request("BRIGHTNESS " + std::to_string(bright)) == "OK";
+}
+
+std::string BacklightClient::stats() {
+    return request("STATS");
+}
+
+std::string BacklightClient::request(const std::string& command) {
+    std::string line = command + '\n';
+    if (_socket == -1 || write(_socket, line.data(), line.size()) != (ssize_t)line.size()) {
+        return "";
+    }
+    // The daemon answers each command with exactly one line
+    std::string answer;
+    char c;
+    while (read(_socket, &c, 1) == 1 && c != '\n') {
+        answer += c;
+    }
+    return answer;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_CLIENT_H
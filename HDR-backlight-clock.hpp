@@ -0,0 +1,119 @@
+/* Teensy clock synchronization for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_CLOCK_H
+#define HDR_BACKLIGHT_CLOCK_H
+
+#include <cstdint>    // uint32_t, int64_t
+#include <cmath>      // std::abs
+#include <vector>     // std::vector
+#include <algorithm>  // std::max, std::min
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// The offset of the Teensy's micros() from the host's clock, from the timestamps in the feedback.
+// Whatever the delays on the way, the Teensy can't start a command before the host writes it,
+// nor answer after the host reads the answer, so every command bounds the offset on both sides.
+// The estimate is the middle of the tightest bounds of the last window commands; a short window
+// follows the drift of the Teensy's crystal, tens of microseconds per second at most
+class ClockSync {
+   public:
+    explicit ClockSync(size_t window = 64);
+
+    // The Teensy's 32-bit micros() as a count that doesn't wrap every 71 minutes,
+    // for timestamps in the order they were taken
+    int64_t unwrap(uint32_t device_us);
+
+    // A command written by the host at host_sent_us and answered at host_ack_us (host clock),
+    // which the Teensy started at device_start_us and finished at device_end_us (unwrapped)
+    void addSample(double host_sent_us, double host_ack_us, int64_t device_start_us, int64_t device_end_us);
+    void reset();
+
+    // Accessor methods
+    bool valid() const {
+        return _count > 0;
+    }
+    // The Teensy's clock minus the host's, and how far off it may be at most, in microseconds
+    double offsetUs() const {
+        return _offset;
+    }
+    double uncertaintyUs() const {
+        return _uncertainty;
+    }
+    // A time of the Teensy on the host's clock
+    double toHost(int64_t device_us) const {
+        return device_us - _offset;
+    }
+
+   private:
+    std::vector<double> _lower, _upper;  // Bounds of the offset from each command in the window
+    size_t _next = 0, _count = 0;
+    double _offset = 0, _uncertainty = 0;
+    bool _unwrapStarted = false;
+    uint32_t _lastDevice = 0;
+    int64_t _wraps = 0;
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+ClockSync::ClockSync(size_t window) : _lower(std::max(window, (size_t)1)), _upper(std::max(window, (size_t)1)) {}
+
+int64_t ClockSync::unwrap(uint32_t device_us) {
+    // Timestamps go backwards by more than half the range only when the counter wraps
+    if (_unwrapStarted && device_us < _lastDevice && _lastDevice - device_us > 0x80000000u) {
+        _wraps++;
+    }
+    _unwrapStarted = true;
+    _lastDevice = device_us;
+    return (_wraps << 32) + device_us;
+}
+
+void ClockSync::addSample(double host_sent_us, double host_ack_us, int64_t device_start_us, int64_t device_end_us) {
+    _lower[_next] = device_end_us - host_ack_us;
+    _upper[_next] = device_start_us - host_sent_us;
+    _next = (_next + 1) % _lower.size();
+    _count = std::min(_count + 1, _lower.size());
+
+    double lower = _lower[0], upper = _upper[0];
+    for (size_t i = 1; i < _count; i++) {
+        lower = std::max(lower, _lower[i]);
+        upper = std::min(upper, _upper[i]);
+    }
+    // The bounds only cross if the clocks drifted apart within the window; the middle is still the best guess
+    _offset = (lower + upper) / 2;
+    _uncertainty = std::abs(upper - lower) / 2;
+}
+
+void ClockSync::reset() {
+    _next = _count = 0;
+    _offset = _uncertainty = 0;
+    _unwrapStarted = false;
+    _wraps = 0;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_CLOCK_H
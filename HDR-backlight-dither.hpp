@@ -0,0 +1,120 @@
+/* Temporal dithering for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_DITHER_H
+#define HDR_BACKLIGHT_DITHER_H
+
+#include <cstdint>  // uint8_t, uint16_t, int32_t, uint32_t
+#include <cstring>  // std::memset, std::memcpy
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "Teensy_TLC_Control/TLCprotocol.h"
+
+// The kernel is chosen when compiling, as for the YUV kernels: AVX2 with -mavx2 (8 values at a time),
+// SSE4.1 with -msse4.1 (4 values at a time), plain C++ otherwise. They all give the same values
+#if defined(__AVX2__)
+#define DITHER_KERNEL "AVX2"
+#elif defined(__SSE4_1__)
+#define DITHER_KERNEL "SSE4.1"
+#else
+#define DITHER_KERNEL "scalar"
+#endif
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// 16-bit frames over the 8-bit values of 'G', '8', without losing the shadows: every value keeps the error
+// its last 8-bit value made, and the next frame makes up for it (first-order error diffusion in time).
+// The error stays within half a step, FRAME8_STEP / 2, so the average of n frames is within FRAME8_STEP / 2 / n
+// of the 16-bit value, e.g. 8 over 16 frames, and exactly the value over FRAME8_STEP frames.
+// No random numbers: the same frames give the same values
+class TemporalDither {
+   public:
+    TemporalDither() {
+        reset();
+    }
+
+    // TLC_FRAME_VALUE_COUNT values of a frame to 8 bits, shown as FRAME8_STEP times as much
+    void quantize(const uint16_t* frame, uint8_t* values);
+    // Forget the errors, e.g. after sending a 16-bit frame
+    void reset() {
+        std::memset(_error, 0, sizeof(_error));
+    }
+
+   private:
+    int32_t _error[TLC_FRAME_VALUE_COUNT];  // In [-FRAME8_STEP / 2, FRAME8_STEP / 2]
+
+    void quantize_scalar(const uint16_t* frame, uint8_t* values, int begin);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+// x / FRAME8_STEP rounded down is x * 65281 >> 24 for x below 2^24, and x * 65281 fits in 32 bits for x up to 65791
+#define FRAME8_DIVIDE_MULTIPLIER 65281
+#define FRAME8_DIVIDE_SHIFT 24
+
+void TemporalDither::quantize(const uint16_t* frame, uint8_t* values) {
+    // Wanted: the value plus the error left, in [-128, 65663]. The nearest step is in [0, 255] without clamping,
+    // since the ends of the range are steps themselves
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i half = _mm256_set1_epi32(FRAME8_STEP / 2), multiplier = _mm256_set1_epi32(FRAME8_DIVIDE_MULTIPLIER);
+    for (; i + 8 <= TLC_FRAME_VALUE_COUNT; i += 8) {
+        __m256i wanted = _mm256_add_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(frame + i))), _mm256_loadu_si256((const __m256i*)(_error + i)));
+        __m256i step = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_add_epi32(wanted, half), multiplier), FRAME8_DIVIDE_SHIFT);
+        // step * 257 = (step << 8) + step
+        _mm256_storeu_si256((__m256i*)(_error + i), _mm256_sub_epi32(wanted, _mm256_add_epi32(_mm256_slli_epi32(step, 8), step)));
+        __m128i steps16 = _mm_packus_epi32(_mm256_castsi256_si128(step), _mm256_extracti128_si256(step, 1));
+        _mm_storel_epi64((__m128i*)(values + i), _mm_packus_epi16(steps16, steps16));
+    }
+#elif defined(__SSE4_1__)
+    const __m128i half = _mm_set1_epi32(FRAME8_STEP / 2), multiplier = _mm_set1_epi32(FRAME8_DIVIDE_MULTIPLIER);
+    for (; i + 4 <= TLC_FRAME_VALUE_COUNT; i += 4) {
+        __m128i wanted = _mm_add_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(frame + i))), _mm_loadu_si128((const __m128i*)(_error + i)));
+        __m128i step = _mm_srli_epi32(_mm_mullo_epi32(_mm_add_epi32(wanted, half), multiplier), FRAME8_DIVIDE_SHIFT);
+        _mm_storeu_si128((__m128i*)(_error + i), _mm_sub_epi32(wanted, _mm_add_epi32(_mm_slli_epi32(step, 8), step)));
+        __m128i steps16 = _mm_packus_epi32(step, step);
+        int32_t steps8 = _mm_cvtsi128_si32(_mm_packus_epi16(steps16, steps16));
+        std::memcpy(values + i, &steps8, 4);
+    }
+#endif
+    quantize_scalar(frame, values, i);
+}
+
+void TemporalDither::quantize_scalar(const uint16_t* frame, uint8_t* values, int begin) {
+    for (int i = begin; i < TLC_FRAME_VALUE_COUNT; i++) {
+        int32_t wanted = frame[i] + _error[i];
+        uint32_t step = (uint32_t)(wanted + FRAME8_STEP / 2) / FRAME8_STEP;
+        _error[i] = wanted - (int32_t)(step * FRAME8_STEP);
+        values[i] = (uint8_t)step;
+    }
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_DITHER_H
@@ -26,51 +26,133 @@ SOFTWARE.
 #define HDR_BACKLIGHT_DRIVER_H
 
 #include <iostream>  // std::cerr, std::clog, std::endl
-#include <cstdlib>   // exit()
+#include <cstdlib>   // size_t
 #include <ctime>     // clock()
+#include <algorithm>  // std::min, std::max
+#include <cmath>      // std::ceil, std::lround, std::sqrt
+#include <fstream>    // std::ifstream
+#include <sstream>    // std::istringstream
+#include <string>     // std::string, std::getline
+#include <chrono>     // std::chrono::steady_clock, for frame timing statistics
+#include <cstring>    // std::memcpy, strerror()
+#include <atomic>     // std::atomic, for ConcurrentFrame
+#include <thread>     // std::this_thread::yield()
 
-#if defined(__MINGW32__) || defined(_WIN32)
-#define USING_SERIAL_WINDOWS_LIBRARY
-// use the library for Windows
-#include "serialWindows/serialWindows.cpp"
+#if defined(__linux__)
+#include <pthread.h>   // pthread_setschedparam(), pthread_setaffinity_np()
+#include <sched.h>     // SCHED_FIFO, cpu_set_t
+#include <sys/mman.h>  // mlockall()
+#include <cerrno>      // errno
+#endif
 
-//*****************************************************
-// Change the default serial port name here (for Windows)
-// Note that if the port number is larger than 9, e.g. COM10,
-// "\\\\.\\COM10" has to be used.
-// "COM10" won't work. (Well, it's Windows)
-#define DEFAULT_SERIAL_PORT "\\\\.\\COM4"
-//*****************************************************
+// The serial port, and the other ways to reach the Teensy
+#include "HDR-backlight-transport.hpp"
 
-#else
+// The serial protocol shared with the Teensy sketch
+// It also defines SCREEN_SIZE_X, SCREEN_SIZE_Y and the PCB LED layout
+#include "Teensy_TLC_Control/TLCprotocol.h"
 
-#include "arduino-serial/arduino-serial-lib.c"
-#define INVALID_HANDLE_VALUE -1
+#define TLC_COUNT 3
+#define LED_CHANNELS_PER_CHIP 16
+#define COLOR_CHANNEL_COUNT 3
 
-//*****************************************************
-// Change the default serial port name here (for Mac OS X / Linux)
-#define DEFAULT_SERIAL_PORT "/dev/cu.usbmodem3355431"
-//*****************************************************
+// What went wrong, from error()
+#define TLC_OK 0
+#define TLC_ERROR_OPEN 1        // The serial port couldn't be opened
+#define TLC_ERROR_REBOOT 2      // The Teensy didn't come back after 'R', 'T'
+#define TLC_ERROR_CHECKSUM 3    // The conversion matrices are wrong
+#define TLC_ERROR_COORDINATE 4  // An LED or chip out of the screen, ignored
+#define TLC_ERROR_LINK 5        // The port failed, and reconnecting didn't work or wasn't enabled
+#define TLC_ERROR_GEOMETRY 6    // The sketch drives another number of chips, LEDs or colors
 
-#endif
+// How long the sketch has to answer the handshake ('H', 'I') of the constructor and reconnect(), before it is rebooted instead
+#define TLC_HANDSHAKE_TIMEOUT_MS 100
 
-#define SCREEN_SIZE_X 9
-#define SCREEN_SIZE_Y 16
+// Frame pacing for the programs driving the backlight
+#include "HDR-backlight-pacer.hpp"
+// Lock-free handoff of frames between threads
+#include "HDR-backlight-mailbox.hpp"
+// The offset of the Teensy's clock, for the timestamps in the feedback
+#include "HDR-backlight-clock.hpp"
+// Timeouts, wrong feedback and round trips of the link, and the frame rate it takes
+#include "HDR-backlight-health.hpp"
+// 16-bit frames over 8-bit values
+#include "HDR-backlight-dither.hpp"
+// Frames that look the same as the last one sent
+#include "HDR-backlight-gate.hpp"
 
-#define TLC_COUNT 3
-#define LED_CHANNELS_PER_CHIP 16
-#define COLOR_CHANNEL_COUNT 3
+static_assert(TLC_COUNT * LED_CHANNELS_PER_CHIP * COLOR_CHANNEL_COUNT == TLC_FRAME_VALUE_COUNT,
+              "The frame size must match Teensy_TLC_Control/TLCprotocol.h");
 
 // Class interface
 namespace hdrbacklightdriverjli {
 
-class TLCdriver
-#ifdef USING_SERIAL_WINDOWS_LIBRARY
-    // Inherite from the serialWindows library class
-    // Use the same function signatures as arduino-serial-lib
-    : public SerialPortWindows
-#endif
-{
+// A whole frame of grayscale values, in the same layout as TLCdriver's state variables
+// For frames built away from the driver, e.g. in a render thread
+struct GSFrame {
+    uint16_t gs[TLC_COUNT][LED_CHANNELS_PER_CHIP][COLOR_CHANNEL_COUNT];
+
+    // Set the brightness of the LED at (x, y), ignored if out of range
+    void set(size_t x, size_t y, uint16_t bright) {
+        if (x < SCREEN_SIZE_X && y < SCREEN_SIZE_Y) {
+            (&gs[0][0][0])[tlc_frame_index(x, y)] = bright;
+        }
+    }
+    void setAll(uint16_t bright) {
+        tlc_fill_frame(&gs[0][0][0], bright);
+    }
+};
+
+// Latest-frame-wins mailbox from a render thread to the thread calling updateFrame(FrameMailbox&)
+typedef TripleBuffer<GSFrame> FrameMailbox;
+
+// A frame that several threads can set at the same time without locks, e.g. one thread per screen region,
+// while the thread calling updateFrame(const ConcurrentFrame&) takes consistent snapshots of it.
+// Each chip has a sequence lock: a writer bumps its chip's state word before and after writing,
+// and snapshot() retries until no state word changed while it was copying.
+// Writers don't wait for each other, and writers to LEDs on different chips don't share a cache line.
+// Only when writers keep snapshot() from finishing for SNAPSHOT_PATIENCE attempts do new writes
+// hold back until it is done.
+class ConcurrentFrame {
+   public:
+    ConcurrentFrame();
+
+    // Same as TLCdriver's, safe to call from any thread. Out-of-range coordinates are ignored
+    void setLED(size_t x, size_t y, uint16_t bright);
+    void setAllLED(uint16_t bright);
+    void setLEDChip(size_t chip_index, uint16_t bright);
+    // The rectangle from (x0, y0) to (x1, y1) inclusive, seen all at once by snapshot()
+    void setZone(size_t x0, size_t y0, size_t x1, size_t y1, uint16_t bright);
+
+    // Copy a frame in which every update above is either complete or not started
+    void snapshot(GSFrame& frame) const;
+    // Snapshots that had to start again because of a concurrent writer
+    unsigned long retries() const {
+        return _retries.load(std::memory_order_relaxed);
+    }
+
+   private:
+    // Lower 32 bits: writers inside, upper 32 bits: completed writes
+    static const uint64_t WRITE_DONE = (uint64_t)1 << 32;
+    static const uint64_t WRITERS_MASK = WRITE_DONE - 1;
+    static const int SNAPSHOT_PATIENCE = 16;
+
+    struct alignas(64) Chip {
+        std::atomic<uint64_t> state;
+        std::atomic<uint16_t> gs[LED_CHANNELS_PER_CHIP][COLOR_CHANNEL_COUNT];
+    };
+    Chip _chips[TLC_COUNT];
+    mutable std::atomic<unsigned long> _retries{0};
+    alignas(64) mutable std::atomic<bool> _snapshotStarved{false};
+
+    void begin_write(size_t chip_index);
+    void end_write(size_t chip_index);
+};
+
+// The driver, talking to the Teensy through a Transport (see HDR-backlight-transport.hpp).
+// TLCdriver is the one on the serial port; the others run without a board, e.g. BasicTLCdriver<LoopbackTransport>
+template <class Transport>
+class BasicTLCdriver {
     // The array for all grayscale pixel values
     // Initialize all to 0
     uint16_t _gsData[TLC_COUNT][LED_CHANNELS_PER_CHIP][COLOR_CHANNEL_COUNT] = {{{0}}};
@@ -79,61 +161,55 @@ class TLCdriver
     int write_buffer_size;
 
     // Used to allocate memory for *write_buffer
-    // Allocate 144*2 more for safety
-    const int MAX_write_buffer_size = 2 * TLC_COUNT * LED_CHANNELS_PER_CHIP * COLOR_CHANNEL_COUNT + 144 * 2;
+    // Large enough for a whole batch of submitFrames(), padding included
+    const int MAX_write_buffer_size = 2 + BATCH_HEADER_SIZE + TLC_BATCH_MAX_FRAMES * 2 * TLC_FRAME_VALUE_COUNT + TLC_USB_PACKET_SIZE;
 
     // Convert PCB LED coordinate to the indices of _gsData[]
-    const size_t _gsIndexChip[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
-        {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
-        {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
-        {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
-        {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
-    };
-
-    const size_t _gsIndexChannel[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
-        {9, 9, 9, 12, 12, 12, 8, 8, 4, 4, 0, 2, 6, 11, 11, 11},
-        {10, 14, 14, 14, 13, 13, 13, 8, 4, 0, 0, 6, 6, 15, 15, 15},
-        {10, 10, 15, 15, 15, 11, 11, 11, 7, 5, 5, 3, 3, 10, 10, 10},
-        {9, 12, 12, 12, 0, 0, 0, 5, 7, 1, 5, 7, 3, 14, 14, 14},
-        {13, 9, 9, 8, 4, 5, 5, 1, 7, 2, 1, 7, 7, 13, 13, 13},
-        {14, 13, 13, 8, 4, 1, 1, 2, 3, 2, 1, 4, 4, 9, 9, 9},
-        {10, 14, 14, 8, 4, 2, 2, 6, 3, 2, 2, 5, 0, 4, 12, 12},
-        {15, 10, 10, 11, 7, 6, 6, 3, 3, 6, 2, 5, 5, 0, 12, 8},
-        {15, 15, 11, 11, 7, 7, 3, 3, 6, 6, 1, 1, 1, 0, 8, 8},
-    };
-
-    // Quick check: Adjacent LEDs in the same channel must have different color
-    const size_t _gsIndexColor[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
-        {1, 0, 2, 1, 0, 2, 1, 0, 0, 1, 2, 1, 2, 1, 0, 2},
-        {2, 1, 0, 2, 1, 0, 2, 2, 2, 1, 0, 0, 1, 1, 0, 2},
-        {0, 1, 2, 0, 1, 2, 0, 1, 1, 1, 2, 0, 2, 1, 0, 2},
-        {2, 1, 2, 0, 2, 0, 1, 2, 0, 2, 0, 2, 1, 1, 0, 2},
-        {2, 1, 0, 1, 1, 0, 1, 2, 2, 2, 0, 1, 0, 1, 0, 2},
-        {2, 1, 0, 0, 0, 0, 1, 2, 1, 0, 1, 2, 0, 1, 0, 2},
-        {2, 1, 0, 2, 2, 0, 1, 2, 0, 1, 0, 2, 1, 1, 1, 0},
-        {2, 1, 0, 1, 1, 0, 1, 2, 2, 2, 2, 1, 0, 2, 2, 1},
-        {0, 1, 2, 0, 0, 2, 1, 0, 1, 0, 1, 0, 2, 0, 0, 2},
-    };
+    // The tables are in TLCprotocol.h, because the Teensy needs them to expand zones and gradients
+    const uint8_t (&_gsIndexChip)[SCREEN_SIZE_X][SCREEN_SIZE_Y] = tlc_index_chip;
+    const uint8_t (&_gsIndexChannel)[SCREEN_SIZE_X][SCREEN_SIZE_Y] = tlc_index_channel;
+    const uint8_t (&_gsIndexColor)[SCREEN_SIZE_X][SCREEN_SIZE_Y] = tlc_index_color;
 
    public:
     // ctor: Open serial port, allocate memory and verify the conversion matrices with checksum()
-    TLCdriver(const char* serialport = DEFAULT_SERIAL_PORT, int baud = 9600);
+    // If that fails, error() says why, and the commands go nowhere.
+    // A sketch that answers the handshake ('H', 'I') keeps running; one that doesn't, e.g. an older one, is rebooted
+    BasicTLCdriver(const char* serialport = DEFAULT_SERIAL_PORT, int baud = 9600);
 
     // dtor: Free memory space and close serial port
-    ~TLCdriver();
+    ~BasicTLCdriver();
 
     // Accessor methods
     auto get_fd() const {  // deduced return types are a C++14 extension
         // The return types are different on Windows and POSIX systems
-        return serialport_fd;
+        return _transport.handle();
+    }
+    Transport& transport() {
+        return _transport;
+    }
+    // TLC_OK, or the latest TLC_ERROR_* with a message on cerr
+    int error() const {
+        return _error;
+    }
+
+    // What the sketch answered to the handshake. A sketch older than the handshake has protocol_version 0,
+    // and everything is assumed of it
+    struct Capabilities {
+        int protocol_version;
+        int tlc_count, leds_per_chip, color_channels;
+        uint16_t features;  // TLC_FEATURE_*
+        int credit_depth;   // Commands buffered with flow control
+        int frame_queue_depth;
+        int batch_max_frames;  // Per 'G', 'B', at most TLC_BATCH_MAX_FRAMES
+    };
+    const Capabilities& capabilities() const {
+        return _capabilities;
+    }
+    bool supports(uint16_t feature) const {
+        return (_capabilities.features & feature) == feature;
     }
     void print_index(size_t x, size_t y) {
-        std::clog << "Internal data indices of (" << x << ", " << y << "):\n\t" << _gsIndexChip[x][y] << " " << _gsIndexChannel[x][y] << " " << _gsIndexColor[x][y] << std::endl;
+        std::clog << "Internal data indices of (" << x << ", " << y << "):\n\t" << (int)_gsIndexChip[x][y] << " " << (int)_gsIndexChannel[x][y] << " " << (int)_gsIndexColor[x][y] << std::endl;
     }
 
     // Update state variables
@@ -144,17 +220,267 @@ class TLCdriver
 
     // Send data to Teensy
     void updateFrame();
+    // Send a whole frame built away from the driver, as it is, without calibration
+    void updateFrame(const GSFrame& frame);
+    // Send the newest frame published to the mailbox, if there is one not sent yet
+    // Returns false without sending anything otherwise. The frame is sent as it is, without calibration
+    bool updateFrame(FrameMailbox& mailbox);
+    // Send a consistent snapshot of a frame that other threads keep setting, without calibration
+    void updateFrame(const ConcurrentFrame& frame);
+    // Send TLC_FRAME_VALUE_COUNT values already in wire order (higher byte first), e.g. from TrackReader::next()
+    // The state variables take them too, as with updateFrame(const GSFrame&)
+    void updateFrameWire(const uint8_t* values);
+    // updateFrame() in two halves, so that one thread can keep several boards busy:
+    // sendFrame() to every board, then readFeedback() from every board.
+    // With UringTransport, the frames and the reads of their feedback go out in one system call.
+    // Returns false if the feedback was missing or wrong
+    void sendFrame();
+    bool readFeedback();
+
+    // Several frames known ahead, e.g. from a track, in one write each up to TLC_BATCH_MAX_FRAMES ('G', 'B').
+    // The Teensy queues them and shifts one out every interval_us (as soon as it can if 0), so that it keeps time:
+    // it answers once the frames are queued, after waiting for room if its queue is full.
+    // With align, every batch is padded to a whole number of 64-byte USB packets.
+    // A sketch without batches gets one 'G', 'O' per frame instead, every interval_us of the host's clock.
+    // The frames are sent as they are, without calibration; stats() counts a batch as one frame
+    void submitFrames(const GSFrame* frames, size_t count, uint32_t interval_us = 0, bool align = false);
+    // count frames of TLC_FRAME_VALUE_COUNT values already in wire order, one after the other
+    void submitFramesWire(const uint8_t* values, size_t count, uint32_t interval_us = 0, bool align = false);
+
+    // Credit-based flow control: rather than waiting for 'D', 'N' after every command, the driver
+    // keeps up to as many commands in flight as the Teensy can buffer, and only waits when none is left.
+    // The commands are acknowledged in batches, so readFeedback() has nothing to read and returns true,
+    // and stats() times the wait for a credit and the write instead of the round trip.
+    // Returns the number of credits the Teensy advertised, 0 if disabled, if the sketch doesn't support it,
+    // or while timestamps are on: the sketch only sends them without flow control
+    int setFlowControl(bool enable);
+    // The fastest way to stream frames that both ends support: flow control if the sketch has it.
+    // (submitFrames() picks batches by itself.) Returns the credits, 0 for a command at a time
+    int setFastestMode() {
+        return supports(TLC_FEATURE_FLOW_CONTROL) ? setFlowControl(true) : 0;
+    }
+    // Send the frame held back by the adaptive rate, if any, and wait until the Teensy has executed
+    // every command sent. Returns false on a timeout or wrong feedback
+    bool flush();
+
+    // Reopen the port after the Teensy dropped off USB, e.g. a glitch of the cable, and carry on.
+    // The sketch keeps running meanwhile, so the handshake is enough and the reboot
+    // is skipped; a sketch that doesn't answer is rebooted. Then the global brightness and max current,
+    // the dot correction if it was uploaded, interpolation, timestamps, flow control and the last frame are sent again.
+    // Returns TLC_OK, or TLC_ERROR_LINK if the port didn't come back within timeout_ms
+    int reconnect(int timeout_ms = 2000);
+    // reconnect() by itself when a write or a read fails on the port, in the middle of a command.
+    // The command is then taken as done: the state sent again includes it
+    void setAutoReconnect(bool enable, int timeout_ms = 2000) {
+        _autoReconnect = enable;
+        _reconnectTimeoutMs = timeout_ms;
+    }
+    unsigned long reconnects() const {
+        return _reconnects;
+    }
+
+    // The link health is always kept: after a timeout or wrong feedback, the driver drains what is left
+    // of the answers (a resync) so they aren't taken for the feedback of the next command.
+    // With the adaptive rate, updateFrame() also sends no more frames than LinkHealth lets through.
+    // A frame held back isn't lost, the newest one goes out with the next updateFrame() let through, or flush()
+    void setAdaptiveRate(bool enable) {
+        _adaptiveRate = enable;
+    }
+    const LinkHealth& health() const {
+        return _health;
+    }
+
+    // 8-bit frames ('G', '8'), at half the bytes of 16-bit ones: the frames sent by updateFrame() and sendFrame()
+    // are dithered in time (see TemporalDither), so that their average over consecutive frames keeps all 16 bits.
+    // Frames in wire order and batches stay 16-bit. Returns false if the sketch doesn't support 8-bit frames
+    bool setDithering(bool enable);
+
+    // Skip the frames of updateFrame() and updateFrameWire() that no one could tell from the last frame sent
+    // (see ChangeGate), but send one at least every keepalive_us, so that the link health still hears from the link.
+    // Not while dithering, which needs every frame. The frames skipped leave their share of the link to the changes:
+    // the credits with flow control, and their turns of the adaptive rate, for bursts of LINK_HEALTH_BURST_FRAMES.
+    // Enabling builds the table of ChangeGate, a few milliseconds
+    void setChangeGate(bool enable, double threshold_pq = CHANGE_GATE_THRESHOLD, double peak_nits = 1000, double keepalive_us = CHANGE_GATE_KEEPALIVE_US);
+    const ChangeGate& changeGate() const {
+        return _gate;
+    }
+
+    // Keyframe interpolation on the Teensy:
+    // every frame sent by updateFrame() becomes a keyframe, and the Teensy refreshes the LEDs
+    // every refresh_interval_us with a frame linearly interpolated from the previous one.
+    // keyframe_interval_us is the expected time between two updateFrame() calls.
+    void setInterpolation(bool enable, uint32_t keyframe_interval_us = 16667, uint32_t refresh_interval_us = 4167);
+
+    // Procedural effects, expanded into a frame on the Teensy
+    // Each costs a few bytes on the serial link instead of a full frame,
+    // and updates the state variables as if the frame had been set with setLED()
+    void fillFrame(uint16_t bright);
+    // Set the LEDs in the rectangle from (x0, y0) to (x1, y1) inclusive, leave the others
+    void setZone(size_t x0, size_t y0, size_t x1, size_t y1, uint16_t bright);
+    // Fade all the LEDs from one brightness to another over refresh_count refresh intervals of setInterpolation()
+    void fadeAll(uint16_t from, uint16_t to, uint16_t refresh_count);
+    // axis is GRADIENT_AXIS_X or GRADIENT_AXIS_Y
+    void setGradient(uint8_t axis, uint16_t from, uint16_t to);
+
+    // TLC5955 control register, updated without resending the grayscale data
+    // Global brightness in [0, 127] scales the LED current from 10% to 100% of the max current,
+    // for whole-panel fades without losing grayscale precision
+    void setGlobalBrightness(uint8_t bright);
+    void setGlobalBrightness(uint8_t red, uint8_t green, uint8_t blue);
+    // Max current in [0, 7], see the TLC5955 datasheet. 4 is 2.75A in total
+    void setMaxCurrent(uint8_t red, uint8_t green, uint8_t blue);
+
+    // LED-to-LED uniformity calibration in the TLC5955 dot correction
+    // The file has one "x y gain" line per measured LED, the brightness relative to the others
+    // at the same grayscale value ('#' starts a comment, LEDs not listed have a gain of 1).
+    // The brighter LEDs are dimmed down to the dimmest one with dot correction, and what dot correction
+    // can't resolve is folded into a per-LED scale applied once in setLED(), setAllLED() and setLEDChip().
+    // The effects expanded on the Teensy only get the dot correction.
+    // If persist is set, the Teensy keeps the dot correction over reboots
+    bool loadCalibration(const char* path, bool persist = true);
+    // Back to no dot correction (127 everywhere)
+    void resetCalibration(bool persist = true);
+
+    // Real-time mode for the thread that calls updateFrame(), so that it isn't preempted on a loaded machine:
+    // SCHED_FIFO at the given priority (1 to 99), pinned to cpu (no pinning if negative),
+    // all memory locked and the stack pre-faulted. The driver doesn't allocate memory after construction.
+    // Each step that isn't permitted (e.g. without CAP_SYS_NICE or a high enough RLIMIT_MEMLOCK) prints a warning
+    // and is skipped. Returns true if all steps succeeded. Linux only
+    bool setRealtime(int priority = 80, int cpu = -1);
+
+    // Time taken by updateFrame(), from encoding to feedback
+    struct FrameStats {
+        unsigned long frames;
+        double mean_us;
+        double stddev_us;  // Jitter
+        double min_us;
+        double max_us;
+    };
+    FrameStats stats() const;
+    void resetStats();
+
+    // Timestamps in the feedback of every command, a few bytes more: when the Teensy started receiving it,
+    // received it, shifted it out and latched it. Not with flow control, where commands are acknowledged in batches.
+    // Returns false, and timestamps stay off, with flow control or if the sketch didn't answer with timestamps
+    bool setTimestamps(bool enable);
+    // Where the time of the frames timed by stats() goes, on average, in microseconds,
+    // the Teensy's timestamps taken to the host's clock with the offset estimated by ClockSync
+    struct LatencyStats {
+        unsigned long frames;  // With timestamps
+        double host_us;        // From the start of the frame to the write: encoding, and waiting for a credit
+        double usb_us;         // From the write to the Teensy starting to receive the command
+        double receive_us;     // Until the whole command is received
+        double shift_us;       // Shifting the frame out to the TLC5955s
+        double latch_us;
+        double feedback_us;  // From the latch to the host reading the feedback
+        double clock_offset_us;
+        double clock_uncertainty_us;
+    };
+    LatencyStats latency() const;
 
    private:
+    // Running sums for stats(), in microseconds
+    unsigned long _statFrames = 0;
+    double _statSum = 0, _statSumSquares = 0, _statMin = 0, _statMax = 0;
+    void record_frame_time(std::chrono::steady_clock::time_point start);
+
+    // The timestamps of the latest feedback, unwrapped, and the stages of stats() they add up to
+    ClockSync _clock;
+    bool _stampValid = false;
+    int64_t _stamps[4];  // Receive started, received, shifted, latched, on the Teensy's clock
+    std::chrono::steady_clock::time_point _writeStart, _stampAck;
+    unsigned long _latencyFrames = 0;
+    double _latencySum[6] = {0};
+    bool read_timestamps(const char* caller);
+    static double host_us(std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double, std::micro>(t.time_since_epoch()).count();
+    }
+
+    // Control register values, as set by the Teensy sketch in setup()
+    uint8_t _brightnessControl[COLOR_CHANNEL_COUNT] = {127, 127, 127};
+    uint8_t _maxCurrent[COLOR_CHANNEL_COUNT] = {4, 4, 4};
+    void updateControl();
+
+    // Dot correction values and the per-LED scale of what dot correction can't resolve,
+    // 16 fractional bits (0x10000 is 1.0). Set by loadCalibration()
+    uint8_t _dcData[TLC_COUNT][LED_CHANNELS_PER_CHIP][COLOR_CHANNEL_COUNT];
+    uint32_t _gsResidual[TLC_COUNT][LED_CHANNELS_PER_CHIP][COLOR_CHANNEL_COUNT];
+    bool _residualEnabled = false;
+    uint16_t calibrated(size_t chip, size_t channel, size_t color, uint16_t bright) const {
+        if (!_residualEnabled) {
+            return bright;
+        }
+        return (uint16_t)(((uint32_t)bright * _gsResidual[chip][channel][color]) >> 16);
+    }
+    void uploadDotCorrection(bool persist);
+
     bool add_to_buffer(uint8_t byte);
-#ifdef USING_SERIAL_WINDOWS_LIBRARY
-    HANDLE serialport_fd;
-#else
-    int serialport_fd;
-#endif
-    void verify_coordinate(size_t x, size_t y);
-    void checksum();
+    bool add_to_buffer_uint16(uint16_t value);
+    bool add_to_buffer_uint32(uint32_t value);
+    void send_buffer_and_read_feedback(const char* caller);
+    void send_buffer(const char* caller);
+    bool read_feedback(const char* caller);
+
+    // Credits advertised by the Teensy, 0 without flow control, and those not taken by commands in flight
+    int _creditDepth = 0;
+    int _credits = 0;
+    bool read_credits(const char* caller);
+
+    // For reconnect()
+    std::string _port;
+    int _baud;
+    int _error = TLC_OK;
+    bool _autoReconnect = false, _reconnecting = false;
+    bool _commandReplayed = false;  // The command in flight was lost with the port, and reconnect() sent the state again
+    int _reconnectTimeoutMs = 2000;
+    unsigned long _reconnects = 0;
+    bool _dotCorrectionUploaded = false;
+    bool _interpolationEnabled = false;
+    uint32_t _keyframeIntervalUs = 16667, _refreshIntervalUs = 4167;
+    bool _timestampsEnabled = false;
+    bool open_port();
+    // Complete any command cut short and say hello, within TLC_HANDSHAKE_TIMEOUT_MS. False if the sketch didn't answer
+    bool handshake();
+    // Until the sketch answers: what the driver could do with any sketch before the handshake
+    static Capabilities assumed_capabilities() {
+        return {0, TLC_COUNT, LED_CHANNELS_PER_CHIP, COLOR_CHANNEL_COUNT, TLC_FEATURES_ALL, TLC_CREDIT_DEPTH, TLC_FRAME_QUEUE_DEPTH, TLC_BATCH_MAX_FRAMES};
+    }
+    Capabilities _capabilities = assumed_capabilities();
+    bool link_lost(const char* caller);
+
+    LinkHealth _health;
+    bool _adaptiveRate = false;
+    bool _framePending = false;  // Held back by the adaptive rate
+    TemporalDither _dither;
+    bool _ditheringEnabled = false;
+    ChangeGate _gate;
+    bool _gateEnabled = false;
+    bool _degraded = false;      // As last reported
+    double _writeUs = 0;  // linkClockUs() of the last write
+    // Ring of the write times of the commands in flight, with flow control
+    double _creditWritesUs[TLC_CREDIT_DEPTH];
+    int _creditWritesHead = 0;
+    int _creditWritesCount = 0;
+    void resync();
+
+    // How long the Teensy may hold a command back while its frame queue is full, added to the feedback timeouts
+    int _queueWaitMs = 0;
+    void begin_batch(int count, uint32_t interval_us, bool align);
+    // The state variables follow the frames sent in wire order too, for reconnect()
+    void wire_to_state(const uint8_t* values) {
+        uint16_t* gs = &_gsData[0][0][0];
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            gs[i] = (uint16_t)(values[2 * i] << 8 | values[2 * i + 1]);
+        }
+    }
+    void end_batch(int count, bool align);
+    Transport _transport;
+    std::chrono::steady_clock::time_point _frameStart;  // Of the frame sent by sendFrame()
+    bool verify_coordinate(size_t x, size_t y);
+    bool checksum();
 };
+
+typedef BasicTLCdriver<SerialTransport> TLCdriver;
 }  //namespace: hdrbacklightdriverjli
 
 // Implementation
@@ -164,75 +490,67 @@ using std::cerr;
 using std::clog;
 using std::endl;
 
-TLCdriver::TLCdriver(const char* serialport, int baud) {
+template <class Transport>
+BasicTLCdriver<Transport>::BasicTLCdriver(const char* serialport, int baud) : _port(serialport), _baud(baud) {
     // Constructor
-    serialport_fd = serialport_init(serialport, baud);
-    if (serialport_fd == INVALID_HANDLE_VALUE) {
-        // Error occurred
-        // Error handled in serialport_init()
-        exit(1);
-    }
-
-    clog << "Port \"" << serialport << "\" successfully opened :)" << endl;
+    // Allocate memory for *write_buffer
+    write_buffer = new uint8_t[MAX_write_buffer_size];
+    write_buffer_size = 0;
 
-    // Tell teensy to reset
-    serialport_writebyte(serialport_fd, 'R');
-    serialport_writebyte(serialport_fd, 'T');
-
-    clog << "Resetting Teensy..." << endl;
-
-    serialport_close(serialport_fd);
-
-    int connect_count = 0;
-    while (1) {
-        clock_t timer_start = clock();
-        while (clock() - timer_start < 0.1 * CLOCKS_PER_SEC)
-            // Wait 0.1s before reconnecting
-            ;
-
-        serialport_fd = serialport_init(serialport, baud);
-        connect_count++;
-        if (serialport_fd != INVALID_HANDLE_VALUE) {
-            if (connect_count > 1) {
-                // Expected at least one reconnection attempt
-                break;
-            } else {
-                clog << "\n\nReboot failed. Please reconnect the cable and retry." << endl;
-                exit(1);
+    // The Teensy may have a stored calibration, but the host doesn't know it until loadCalibration()
+    for (int i = 0; i < TLC_COUNT; i++) {
+        for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                _dcData[i][j][k] = DOT_CORRECTION_MAX;
+                _gsResidual[i][j][k] = 0x10000;
             }
-        } else {
-            clog << "\n\nTeensy still rebooting..." << endl;
         }
     }
 
-    clog << "\n\nThe error messages above are expected.\n";
-    clog << "Reboot complete!" << endl;
-
     // Verify the conversion matrices
-    checksum();
+    if (!checksum()) {
+        _error = TLC_ERROR_CHECKSUM;
+        return;
+    }
 
-    // Allocate memory for *write_buffer
-    write_buffer = new uint8_t[MAX_write_buffer_size];
-    write_buffer_size = 0;
+    if (!_transport.open(serialport, baud)) {
+        // Error occurred
+        // Error handled in open()
+        _error = TLC_ERROR_OPEN;
+        return;
+    }
+
+    clog << "Port \"" << serialport << "\" successfully opened :)" << endl;
+
+    if (handshake()) {
+        clog << "Teensy sketch running, protocol version " << _capabilities.protocol_version << endl;
+    } else if (!_transport.reboot(serialport, baud)) {
+        _error = TLC_ERROR_REBOOT;
+    }
 }
 
-TLCdriver::~TLCdriver() {
+template <class Transport>
+BasicTLCdriver<Transport>::~BasicTLCdriver() {
     // Destructor
     // Free memory space
     delete[] write_buffer;
 
     // Close the serial port
-    serialport_close(serialport_fd);
+    _transport.close();
 }
 
-void TLCdriver::verify_coordinate(size_t x, size_t y) {
+template <class Transport>
+bool BasicTLCdriver<Transport>::verify_coordinate(size_t x, size_t y) {
     if (x >= SCREEN_SIZE_X || y >= SCREEN_SIZE_Y) {  // size_t is always unsigned: no need to check sign
         cerr << "TLC5955converter::to_gsIndex(): index out of range" << endl;
-        exit(1);
+        _error = TLC_ERROR_COORDINATE;
+        return false;
     }
+    return true;
 }
 
-void TLCdriver::checksum() {
+template <class Transport>
+bool BasicTLCdriver<Transport>::checksum() {
     // Checksum: each channel is expected to have a checksum of:
     //   TLC_COUNT * COLOR_CHANNEL_COUNT * (COLOR_CHANNEL_COUNT - 1) / 2
     //           + COLOR_CHANNEL_COUNT * TLC_COUNT * (TLC_COUNT - 1) / 2
@@ -255,42 +573,52 @@ void TLCdriver::checksum() {
                 cerr << c[i] << ' ';
             }
             cerr << '\n';
-            exit(1);
+            return false;
         }
     }
     clog << "Conversion matrices checksum OK." << endl;
+    return true;
 }
 
-void TLCdriver::setLED(size_t x, size_t y, uint16_t bright) {
+template <class Transport>
+void BasicTLCdriver<Transport>::setLED(size_t x, size_t y, uint16_t bright) {
     // Set the brightness of the LED at (x, y) to bright
-    verify_coordinate(x, y);
-    _gsData[_gsIndexChip[x][y]][_gsIndexChannel[x][y]][_gsIndexColor[x][y]] = bright;
+    if (!verify_coordinate(x, y)) {
+        return;
+    }
+    size_t i = _gsIndexChip[x][y], j = _gsIndexChannel[x][y], k = _gsIndexColor[x][y];
+    _gsData[i][j][k] = calibrated(i, j, k, bright);
 }
 
-void TLCdriver::setAllLED(uint16_t bright) {
+template <class Transport>
+void BasicTLCdriver<Transport>::setAllLED(uint16_t bright) {
     for (int i = 0; i < TLC_COUNT; i++) {
         for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
             for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
-                _gsData[i][j][k] = bright;
+                _gsData[i][j][k] = calibrated(i, j, k, bright);
             }
         }
     }
 }
 
-void TLCdriver::setLEDChip(size_t chip_index, uint16_t bright) {
+template <class Transport>
+void BasicTLCdriver<Transport>::setLEDChip(size_t chip_index, uint16_t bright) {
     // DEBUG Chip problems
     // Set the brightness of the LEDs of a specific chip
     if (chip_index >= TLC_COUNT) {
         cerr << "TLCdriver::setLEDChip(): chip_index out of range!" << endl;
+        _error = TLC_ERROR_COORDINATE;
+        return;
     }
     for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
         for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
-            _gsData[chip_index][j][k] = bright;
+            _gsData[chip_index][j][k] = calibrated(chip_index, j, k, bright);
         }
     }
 }
 
-bool TLCdriver::add_to_buffer(uint8_t byte) {
+template <class Transport>
+bool BasicTLCdriver<Transport>::add_to_buffer(uint8_t byte) {
     if (write_buffer_size >= MAX_write_buffer_size) {
         return false;
     }
@@ -298,10 +626,448 @@ bool TLCdriver::add_to_buffer(uint8_t byte) {
     return true;
 }
 
-void TLCdriver::updateFrame() {
+template <class Transport>
+bool BasicTLCdriver<Transport>::add_to_buffer_uint16(uint16_t value) {
+    return add_to_buffer((uint8_t)(value >> 8)) && add_to_buffer((uint8_t)value);
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::add_to_buffer_uint32(uint32_t value) {
+    // Send the highest byte first, as the grayscale values
+    return add_to_buffer((uint8_t)(value >> 24)) && add_to_buffer((uint8_t)(value >> 16)) &&
+           add_to_buffer((uint8_t)(value >> 8)) && add_to_buffer((uint8_t)value);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::send_buffer_and_read_feedback(const char* caller) {
+    send_buffer(caller);
+    read_feedback(caller);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::send_buffer(const char* caller) {
+    if (_creditDepth > 0) {
+        while (_credits == 0) {
+            if (!read_credits(caller)) {
+                // Lost count of the commands in flight: take it that the Teensy is done with them
+                _credits = _creditDepth;
+                _creditWritesCount = 0;
+            }
+        }
+        _credits--;
+    }
+    _writeStart = std::chrono::steady_clock::now();
+    _writeUs = linkClockUs(_transport);
+    if (_creditDepth > 0) {
+        if (_creditWritesCount < TLC_CREDIT_DEPTH) {
+            _creditWritesUs[(_creditWritesHead + _creditWritesCount) % TLC_CREDIT_DEPTH] = _writeUs;
+            _creditWritesCount++;
+        }
+    }
+    bool written = _transport.write(write_buffer, write_buffer_size);
+    write_buffer_size = 0;
+    if (!written) {
+        _commandReplayed = link_lost(caller);
+    }
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::read_credits(const char* caller) {
+    // 'A', 'K' and the number of commands done
+    int feedback_byte_0 = _transport.readByte(90 + _queueWaitMs);
+    int feedback_byte_1 = _transport.readByte(10);
+    int count = _transport.readByte(10);
+
+    if (feedback_byte_0 == -1 || feedback_byte_1 == -1 || count == -1) {
+        cerr << caller << ":\n\tError: couldn't read feedback bytes" << endl;
+        _health.timeout(linkClockUs(_transport));
+        if (link_lost(caller)) {
+            return true;  // With the credits from reconnect()
+        }
+    } else if (feedback_byte_0 == -2 || feedback_byte_1 == -2 || count == -2) {
+        cerr << caller << ":\n\tError: feedback bytes reading timeout" << endl;
+        _health.timeout(linkClockUs(_transport));
+    } else if (!(feedback_byte_0 == 'A' && feedback_byte_1 == 'K') || count == 0 || _credits + count > _creditDepth) {
+        cerr << caller << ":\n\tError: feedback bytes wrong" << endl;
+        _health.wrongFeedback(linkClockUs(_transport));
+    } else {
+        _credits += count;
+        double now_us = linkClockUs(_transport);
+        for (int i = 0; i < count && _creditWritesCount > 0; i++) {
+            _health.ack(now_us - _creditWritesUs[_creditWritesHead], now_us);
+            _creditWritesHead = (_creditWritesHead + 1) % TLC_CREDIT_DEPTH;
+            _creditWritesCount--;
+        }
+        return true;
+    }
+    resync();
+    return false;
+}
+
+template <class Transport>
+int BasicTLCdriver<Transport>::setFlowControl(bool enable) {
+    if (enable && !supports(TLC_FEATURE_FLOW_CONTROL)) {
+        return 0;  // It said so in the handshake
+    }
+    if (enable && _timestampsEnabled) {
+        cerr << "TLCdriver::setFlowControl():\n\tError: not with timestamps, turn them off first" << endl;
+        return 0;
+    }
+    // The answer has to be the next thing the Teensy sends
+    flush();
+    _creditDepth = _credits = 0;
+    _creditWritesCount = 0;
+
+    add_to_buffer('C');
+    add_to_buffer('R');
+    add_to_buffer(enable ? 1 : 0);
+    send_buffer("TLCdriver::setFlowControl()");
+
+    int feedback_byte_0 = _transport.readByte(90);
+    int feedback_byte_1 = _transport.readByte(10);
+    int depth = _transport.readByte(10);
+    if (feedback_byte_0 != 'C' || feedback_byte_1 != 'R' || depth < 0) {
+        if (enable) {
+            cerr << "TLCdriver::setFlowControl():\n\tError: no answer, the sketch may be older than flow control" << endl;
+        }
+        return 0;
+    }
+    // No more in flight than the ring of write times holds, even if the sketch has room for more
+    _creditDepth = _credits = std::min(depth, TLC_CREDIT_DEPTH);
+    return _creditDepth;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::flush() {
+    if (_framePending) {
+        _framePending = false;
+        sendFrame();
+        if (readFeedback() && _gateEnabled) {
+            _gate.sent(&_gsData[0][0][0], linkClockUs(_transport));
+        }
+    }
+    while (_credits < _creditDepth) {
+        if (!read_credits("TLCdriver::flush()")) {
+            _credits = _creditDepth;
+            _creditWritesCount = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::read_feedback(const char* caller) {
+    _stampValid = false;
+    if (_commandReplayed) {
+        _commandReplayed = false;
+        return true;
+    }
+    if (_creditDepth > 0) {
+        return true;  // Acknowledged in batches, see send_buffer()
+    }
+    ///////////////////////////////////////////////////
+    // Read feedback
+    int feedback_byte_0, feedback_byte_1;
+    feedback_byte_0 = _transport.readByte(90 + _queueWaitMs);  // 90 ms timeout
+    feedback_byte_1 = _transport.readByte(10);                 // 10 ms timeout
+    // Total 100 ms timeout, which means minimum 10 FPS
+
+    if (feedback_byte_0 == -1 || feedback_byte_1 == -1) {
+        cerr << caller << ":\n\tError: couldn't read feedback bytes" << endl;
+        _health.timeout(linkClockUs(_transport));
+        if (link_lost(caller)) {
+            return true;
+        }
+    } else if (feedback_byte_0 == -2 || feedback_byte_1 == -2) {
+        cerr << caller << ":\n\tError: feedback bytes reading timeout" << endl;
+        _health.timeout(linkClockUs(_transport));
+    } else if (feedback_byte_0 == 'D' && feedback_byte_1 == 'T') {
+        return read_timestamps(caller);
+    } else if (!(feedback_byte_0 == 'D' && feedback_byte_1 == 'N')) {
+        // Wrong feedback byte
+        cerr << caller << ":\n\tError: feedback bytes wrong" << endl;
+        _health.wrongFeedback(linkClockUs(_transport));
+    } else {
+        double now_us = linkClockUs(_transport);
+        _health.ack(now_us - _writeUs, now_us);
+        return true;
+    }
+    resync();
+    return false;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::link_lost(const char* caller) {
+    _commandReplayed = false;
+    if (!_autoReconnect || _reconnecting) {
+        if (_error != TLC_ERROR_LINK) {
+            cerr << caller << ":\n\tError: the port failed" << endl;
+        }
+        _error = TLC_ERROR_LINK;
+        return false;
+    }
+    cerr << caller << ":\n\tError: the port failed, reconnecting" << endl;
+    return reconnect(_reconnectTimeoutMs) == TLC_OK;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::open_port() {
+#ifndef USING_SERIAL_WINDOWS_LIBRARY
+    // Wait for the device node rather than have open() print an error for every attempt
+    if (_port[0] == '/' && access(_port.c_str(), F_OK) != 0) {
+        return false;
+    }
+#endif
+    return _transport.open(_port.c_str(), _baud);
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::handshake() {
+    _capabilities = assumed_capabilities();
+    // A glitch, or a host that died, may have cut a command short: zeros make up the rest of it, and the sketch skips the others
+    std::memset(write_buffer, 0, TLC_HELLO_FILLER_SIZE);
+    if (!_transport.write(write_buffer, TLC_HELLO_FILLER_SIZE)) {
+        return false;
+    }
+    // 'H', 'I' is answered right away, behind the feedback of the command cut short and whatever setup() printed
+    add_to_buffer('H');
+    add_to_buffer('I');
+    add_to_buffer(TLC_PROTOCOL_VERSION);
+    bool written = _transport.write(write_buffer, write_buffer_size);
+    write_buffer_size = 0;
+    if (!written) {
+        return false;
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TLC_HANDSHAKE_TIMEOUT_MS);
+    int previous = -1;
+    while (std::chrono::steady_clock::now() < deadline) {
+        int b = _transport.readByte(5);
+        if (b == -1) {
+            return false;
+        }
+        if (previous == 'H' && b == 'I') {
+            break;
+        }
+        previous = b;
+    }
+    uint8_t hello[HELLO_FEEDBACK_SIZE];
+    for (int i = 0; i < HELLO_FEEDBACK_SIZE; i++) {
+        int b = previous == 'H' ? _transport.readByte(10) : -1;
+        if (b < 0) {
+            return false;
+        }
+        hello[i] = (uint8_t)b;
+    }
+
+    // A newer sketch still speaks this version
+    _capabilities.protocol_version = std::min((int)hello[0], TLC_PROTOCOL_VERSION);
+    _capabilities.tlc_count = hello[1];
+    _capabilities.leds_per_chip = hello[2];
+    _capabilities.color_channels = hello[3];
+    _capabilities.features = (uint16_t)(hello[4] << 8 | hello[5]);
+    _capabilities.credit_depth = hello[6];
+    _capabilities.frame_queue_depth = hello[7];
+    // The write buffer holds TLC_BATCH_MAX_FRAMES
+    _capabilities.batch_max_frames = std::max(1, std::min((int)hello[8], TLC_BATCH_MAX_FRAMES));
+    if (_capabilities.tlc_count != TLC_COUNT || _capabilities.leds_per_chip != LED_CHANNELS_PER_CHIP || _capabilities.color_channels != COLOR_CHANNEL_COUNT) {
+        cerr << "TLCdriver::handshake():\n\tError: the sketch drives " << _capabilities.tlc_count << " chips of " << _capabilities.leds_per_chip << " LEDs with "
+             << _capabilities.color_channels << " colors, the driver " << TLC_COUNT << " of " << LED_CHANNELS_PER_CHIP << " with " << COLOR_CHANNEL_COUNT << endl;
+        _error = TLC_ERROR_GEOMETRY;
+    }
+    return true;
+}
+
+template <class Transport>
+int BasicTLCdriver<Transport>::reconnect(int timeout_ms) {
+    auto start = std::chrono::steady_clock::now();
+    _reconnecting = true;
+    _transport.close();
+    write_buffer_size = 0;
+    bool flow_control = _creditDepth > 0;
+    _creditDepth = _credits = 0;
+    _creditWritesCount = 0;
+    _framePending = false;
+    _gate.forget();
+
+    // The port comes back once the Teensy is on USB again
+    bool opened;
+    while (!(opened = open_port()) && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(timeout_ms)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!opened) {
+        cerr << "TLCdriver::reconnect():\n\tError: \"" << _port << "\" didn't come back" << endl;
+        _reconnecting = false;
+        _error = TLC_ERROR_LINK;
+        return _error;
+    }
+
+    if (!handshake()) {
+        clog << "TLCdriver::reconnect(): no answer to the handshake, rebooting the Teensy" << endl;
+        if (!_transport.reboot(_port.c_str(), _baud)) {
+            _reconnecting = false;
+            _error = TLC_ERROR_LINK;
+            return _error;
+        }
+    }
+    if (_error == TLC_ERROR_GEOMETRY) {
+        _reconnecting = false;
+        return _error;
+    }
+
+    // Whatever the sketch lost, or forgot in a reboot or the handshake
+    if (_ditheringEnabled && !supports(TLC_FEATURE_FRAME8)) {
+        setDithering(false);
+    }
+    if (_timestampsEnabled && !setTimestamps(true)) {
+        clog << "TLCdriver::reconnect(): timestamps are off" << endl;
+    }
+    if (flow_control) {
+        setFlowControl(true);
+    }
+
+    updateControl();
+    if (_dotCorrectionUploaded) {
+        uploadDotCorrection(false);
+    }
+    setInterpolation(_interpolationEnabled, _keyframeIntervalUs, _refreshIntervalUs);
+    sendFrame();
+    readFeedback();
+    bool ok = flush() && _error != TLC_ERROR_LINK;
+    _reconnecting = false;
+    if (!ok) {
+        _error = TLC_ERROR_LINK;
+        return _error;
+    }
+    _reconnects++;
+    _error = TLC_OK;
+    clog << "TLCdriver::reconnect(): back after " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms" << endl;
+    return TLC_OK;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::resync() {
+    // The rest of a wrong answer, or a late one, would be taken for the feedback of the next command
+    size_t discarded = 0;
+    while (discarded < (size_t)MAX_write_buffer_size && _transport.readByte(1) >= 0) {
+        discarded++;
+    }
+    _health.resync(discarded);
+    _gate.forget();  // The frames in flight may be lost
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::read_timestamps(const char* caller) {
+    uint8_t stamp[TIMESTAMP_FEEDBACK_SIZE];
+    for (int i = 0; i < TIMESTAMP_FEEDBACK_SIZE; i++) {
+        int b = _transport.readByte(10);
+        if (b < 0) {
+            cerr << caller << ":\n\tError: couldn't read the timestamps in the feedback" << endl;
+            _health.timeout(linkClockUs(_transport));
+            resync();
+            return false;
+        }
+        stamp[i] = (uint8_t)b;
+    }
+    _stampAck = std::chrono::steady_clock::now();
+    double now_us = linkClockUs(_transport);
+    _health.ack(now_us - _writeUs, now_us);
+
+    // 32-bit start, then three 16-bit steps
+    _stamps[0] = _clock.unwrap((uint32_t)stamp[0] << 24 | (uint32_t)stamp[1] << 16 | (uint32_t)stamp[2] << 8 | stamp[3]);
+    for (int i = 1; i < 4; i++) {
+        _stamps[i] = _stamps[i - 1] + (stamp[2 + 2 * i] << 8 | stamp[3 + 2 * i]);
+    }
+    _clock.addSample(host_us(_writeStart), host_us(_stampAck), _stamps[0], _stamps[3]);
+    _stampValid = true;
+    return true;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::setTimestamps(bool enable) {
+    if (enable && !supports(TLC_FEATURE_TIMESTAMPS)) {
+        cerr << "TLCdriver::setTimestamps():\n\tError: the sketch doesn't support timestamps" << endl;
+        return false;
+    }
+    if (enable && _creditDepth > 0) {
+        cerr << "TLCdriver::setTimestamps():\n\tError: not with flow control, turn it off first" << endl;
+        return false;
+    }
+    _timestampsEnabled = enable;
+    add_to_buffer('T');
+    add_to_buffer('S');
+    add_to_buffer(enable ? 1 : 0);
+    send_buffer("TLCdriver::setTimestamps()");
+    if (!read_feedback("TLCdriver::setTimestamps()")) {
+        _timestampsEnabled = false;
+        return false;
+    }
+    if (enable && !_stampValid) {
+        cerr << "TLCdriver::setTimestamps():\n\tError: no timestamps in the feedback" << endl;
+        _timestampsEnabled = false;
+        return false;
+    }
+    _stampValid = false;
+    return true;
+}
+
+template <class Transport>
+typename BasicTLCdriver<Transport>::LatencyStats BasicTLCdriver<Transport>::latency() const {
+    LatencyStats result = {_latencyFrames, 0, 0, 0, 0, 0, 0, _clock.offsetUs(), _clock.uncertaintyUs()};
+    if (_latencyFrames > 0) {
+        double* stages[6] = {&result.host_us, &result.usb_us, &result.receive_us, &result.shift_us, &result.latch_us, &result.feedback_us};
+        for (int i = 0; i < 6; i++) {
+            *stages[i] = _latencySum[i] / _latencyFrames;
+        }
+    }
+    return result;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::updateFrame() {
+    if (_gateEnabled && !_ditheringEnabled && !_gate.pass(&_gsData[0][0][0], linkClockUs(_transport))) {
+        _framePending = false;  // The LEDs show the frame already, as far as anyone can tell
+        if (_adaptiveRate) {
+            _health.skip(linkClockUs(_transport));
+        }
+        return;
+    }
+    if (_adaptiveRate && !_health.admit(linkClockUs(_transport))) {
+        _framePending = true;
+        return;
+    }
+    _framePending = false;
+    sendFrame();
+    if (readFeedback() && _gateEnabled) {
+        _gate.sent(&_gsData[0][0][0], linkClockUs(_transport));
+    }
+
+    if (_adaptiveRate && _health.degraded() != _degraded) {
+        _degraded = _health.degraded();
+        if (_degraded) {
+            clog << "TLCdriver::updateFrame(): link degraded, lowering the frame rate" << endl;
+        } else {
+            clog << "TLCdriver::updateFrame(): link clear, back to the full frame rate" << endl;
+        }
+    }
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::sendFrame() {
+    _frameStart = std::chrono::steady_clock::now();
+
     ////////////////////////////////////////////////////
     //Write and send data
 
+    if (_ditheringEnabled) {
+        add_to_buffer('G');
+        add_to_buffer('8');
+        _dither.quantize(&_gsData[0][0][0], write_buffer + write_buffer_size);
+        write_buffer_size += FRAME8_PAYLOAD_SIZE;
+        send_buffer("TLCdriver::updateFrame()");
+        return;
+    }
+
     // 0xFF, 0x00 mark the start
     add_to_buffer('G');
     add_to_buffer('O');
@@ -313,23 +1079,585 @@ void TLCdriver::updateFrame() {
             }
         }
     }
-    serialport_writeBuffer(serialport_fd, write_buffer, write_buffer_size);
-    write_buffer_size = 0;
+    send_buffer("TLCdriver::updateFrame()");
+}
 
-    ///////////////////////////////////////////////////
-    // Read feedback
-    int feedback_byte_0, feedback_byte_1;
-    feedback_byte_0 = serialport_readByte(serialport_fd, 90);  // 90 ms timeout
-    feedback_byte_1 = serialport_readByte(serialport_fd, 10);  // 10 ms timeout
-    // Total 100 ms timeout, which means minimum 10 FPS
+template <class Transport>
+bool BasicTLCdriver<Transport>::setDithering(bool enable) {
+    if (enable && !supports(TLC_FEATURE_FRAME8)) {
+        cerr << "TLCdriver::setDithering():\n\tError: the sketch doesn't support 8-bit frames" << endl;
+        return false;
+    }
+    if (enable != _ditheringEnabled) {
+        _dither.reset();
+    }
+    _ditheringEnabled = enable;
+    return true;
+}
 
-    if (feedback_byte_0 == -1 || feedback_byte_1 == -1) {
-        cerr << "TLCdriver::updateFrame():\n\tError: couldn't read feedback bytes" << endl;
-    } else if (feedback_byte_0 == -2 || feedback_byte_1 == -2) {
-        cerr << "TLCdriver::updateFrame():\n\tError: feedback bytes reading timeout" << endl;
-    } else if (!(feedback_byte_0 == 'D' && feedback_byte_1 == 'N')) {
-        // Wrong feedback byte
-        cerr << "TLCdriver::updateFrame():\n\tError: feedback bytes wrong" << endl;
+template <class Transport>
+void BasicTLCdriver<Transport>::setChangeGate(bool enable, double threshold_pq, double peak_nits, double keepalive_us) {
+    if (enable) {
+        _gate.configure(threshold_pq, peak_nits, keepalive_us);
+    }
+    _gate.resetStats();
+    _gateEnabled = enable;
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::readFeedback() {
+    bool ok = read_feedback("TLCdriver::updateFrame()");
+    record_frame_time(_frameStart);
+    return ok;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::updateFrame(const GSFrame& frame) {
+    std::memcpy(_gsData, frame.gs, sizeof(_gsData));
+    updateFrame();
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::updateFrame(FrameMailbox& mailbox) {
+    if (!mailbox.acquire()) {
+        return false;
+    }
+    updateFrame(mailbox.front());
+    return true;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::updateFrame(const ConcurrentFrame& frame) {
+    GSFrame snapshot;
+    frame.snapshot(snapshot);
+    updateFrame(snapshot);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::updateFrameWire(const uint8_t* values) {
+    auto timer_start = std::chrono::steady_clock::now();
+    wire_to_state(values);
+    if (_gateEnabled && !_gate.pass(&_gsData[0][0][0], linkClockUs(_transport))) {
+        return;
+    }
+
+    add_to_buffer('G');
+    add_to_buffer('O');
+    std::memcpy(write_buffer + write_buffer_size, values, TLC_FRAME_VALUE_COUNT * 2);
+    write_buffer_size += TLC_FRAME_VALUE_COUNT * 2;
+    send_buffer("TLCdriver::updateFrameWire()");
+    if (read_feedback("TLCdriver::updateFrameWire()") && _gateEnabled) {
+        _gate.sent(&_gsData[0][0][0], linkClockUs(_transport));
+    }
+
+    record_frame_time(timer_start);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::submitFrames(const GSFrame* frames, size_t count, uint32_t interval_us, bool align) {
+    if (!supports(TLC_FEATURE_BATCH)) {
+        auto due = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < count; n++, due += std::chrono::microseconds(interval_us)) {
+            std::this_thread::sleep_until(due);
+            updateFrame(frames[n]);
+        }
+        return;
+    }
+    _gate.forget();
+    const size_t batch_max = _capabilities.batch_max_frames;
+    for (size_t start = 0; start < count; start += batch_max) {
+        int batch = (int)std::min(count - start, batch_max);
+        begin_batch(batch, interval_us, align);
+        for (int n = 0; n < batch; n++) {
+            const uint16_t* values = &frames[start + n].gs[0][0][0];
+            for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+                add_to_buffer_uint16(values[i]);
+            }
+        }
+        end_batch(batch, align);
+    }
+    if (count > 0) {
+        std::memcpy(_gsData, frames[count - 1].gs, sizeof(_gsData));
+    }
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::submitFramesWire(const uint8_t* values, size_t count, uint32_t interval_us, bool align) {
+    if (!supports(TLC_FEATURE_BATCH)) {
+        auto due = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < count; n++, due += std::chrono::microseconds(interval_us)) {
+            std::this_thread::sleep_until(due);
+            updateFrameWire(values + n * 2 * TLC_FRAME_VALUE_COUNT);
+        }
+        return;
+    }
+    _gate.forget();
+    const size_t batch_max = _capabilities.batch_max_frames;
+    for (size_t start = 0; start < count; start += batch_max) {
+        int batch = (int)std::min(count - start, batch_max);
+        begin_batch(batch, interval_us, align);
+        std::memcpy(write_buffer + write_buffer_size, values + start * 2 * TLC_FRAME_VALUE_COUNT, batch * 2 * TLC_FRAME_VALUE_COUNT);
+        write_buffer_size += batch * 2 * TLC_FRAME_VALUE_COUNT;
+        end_batch(batch, align);
+    }
+    if (count > 0) {
+        wire_to_state(values + (count - 1) * 2 * TLC_FRAME_VALUE_COUNT);
+    }
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::begin_batch(int count, uint32_t interval_us, bool align) {
+    _frameStart = std::chrono::steady_clock::now();
+    // The Teensy may have a full queue of frames to show before this batch fits
+    _queueWaitMs = (int)((uint64_t)interval_us * _capabilities.frame_queue_depth / 1000);
+
+    add_to_buffer('G');
+    add_to_buffer('B');
+    add_to_buffer((uint8_t)count);
+    add_to_buffer((uint8_t)(align ? tlc_batch_padding(count) : 0));
+    add_to_buffer_uint32(interval_us);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::end_batch(int count, bool align) {
+    if (align) {
+        std::memset(write_buffer + write_buffer_size, 0, tlc_batch_padding(count));
+        write_buffer_size += tlc_batch_padding(count);
+    }
+    send_buffer_and_read_feedback("TLCdriver::submitFrames()");
+    record_frame_time(_frameStart);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::record_frame_time(std::chrono::steady_clock::time_point start) {
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if (_stampValid) {
+        // The stages add up to the time from start to the feedback
+        _stampValid = false;
+        _latencyFrames++;
+        _latencySum[0] += host_us(_writeStart) - host_us(start);
+        _latencySum[1] += _clock.toHost(_stamps[0]) - host_us(_writeStart);
+        for (int i = 1; i < 4; i++) {
+            _latencySum[1 + i] += _stamps[i] - _stamps[i - 1];
+        }
+        _latencySum[5] += host_us(_stampAck) - _clock.toHost(_stamps[3]);
+    }
+    if (_statFrames == 0 || elapsed < _statMin) {
+        _statMin = elapsed;
+    }
+    if (_statFrames == 0 || elapsed > _statMax) {
+        _statMax = elapsed;
+    }
+    _statFrames++;
+    _statSum += elapsed;
+    _statSumSquares += elapsed * elapsed;
+}
+
+template <class Transport>
+typename BasicTLCdriver<Transport>::FrameStats BasicTLCdriver<Transport>::stats() const {
+    FrameStats result = {_statFrames, 0, 0, _statMin, _statMax};
+    if (_statFrames > 0) {
+        result.mean_us = _statSum / _statFrames;
+        result.stddev_us = std::sqrt(std::max(0.0, _statSumSquares / _statFrames - result.mean_us * result.mean_us));
+    }
+    return result;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::resetStats() {
+    _statFrames = 0;
+    _statSum = _statSumSquares = _statMin = _statMax = 0;
+    _latencyFrames = 0;
+    std::fill(_latencySum, _latencySum + 6, 0.0);
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::setRealtime(int priority, int cpu) {
+#if defined(__linux__)
+    bool ok = true;
+
+    // Lock the pages in RAM, including the ones mapped later, so that a page fault doesn't stall a frame
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        cerr << "TLCdriver::setRealtime(): Warning: couldn't lock memory: " << strerror(errno) << endl;
+        ok = false;
+    }
+
+    // Touch the stack now rather than during a frame
+    // 256 KiB is far more than updateFrame() needs
+    {
+        volatile uint8_t stack_prefault[256 * 1024];
+        for (size_t i = 0; i < sizeof(stack_prefault); i += 4096) {
+            stack_prefault[i] = 0;
+        }
+    }
+
+    struct sched_param param;
+    param.sched_priority = priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+        cerr << "TLCdriver::setRealtime(): Warning: couldn't set SCHED_FIFO priority " << priority << ": " << strerror(error) << endl;
+        ok = false;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0) {
+            cerr << "TLCdriver::setRealtime(): Warning: couldn't pin the thread to CPU " << cpu << ": " << strerror(error) << endl;
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        clog << "Real-time mode on: SCHED_FIFO priority " << priority << (cpu >= 0 ? ", pinned to CPU " + std::to_string(cpu) : "") << endl;
+    }
+    return ok;
+#else
+    (void)priority;
+    (void)cpu;
+    cerr << "TLCdriver::setRealtime(): Warning: real-time mode is only supported on Linux" << endl;
+    return false;
+#endif
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setInterpolation(bool enable, uint32_t keyframe_interval_us, uint32_t refresh_interval_us) {
+    _interpolationEnabled = enable;
+    _keyframeIntervalUs = keyframe_interval_us;
+    _refreshIntervalUs = refresh_interval_us;
+    add_to_buffer('I');
+    add_to_buffer('P');
+    add_to_buffer(enable ? 1 : 0);
+    add_to_buffer_uint32(keyframe_interval_us);
+    add_to_buffer_uint32(refresh_interval_us);
+    send_buffer_and_read_feedback("TLCdriver::setInterpolation()");
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::fillFrame(uint16_t bright) {
+    tlc_fill_frame(&_gsData[0][0][0], bright);
+    _gate.forget();
+
+    add_to_buffer('F');
+    add_to_buffer('L');
+    add_to_buffer_uint16(bright);
+    send_buffer_and_read_feedback("TLCdriver::fillFrame()");
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setZone(size_t x0, size_t y0, size_t x1, size_t y1, uint16_t bright) {
+    if (!verify_coordinate(x0, y0) || !verify_coordinate(x1, y1)) {
+        return;
+    }
+
+    uint8_t mask[ZONE_MASK_SIZE] = {0};
+    for (size_t x = std::min(x0, x1); x <= std::max(x0, x1); x++) {
+        for (size_t y = std::min(y0, y1); y <= std::max(y0, y1); y++) {
+            tlc_zone_mask_set(mask, x, y);
+        }
+    }
+    tlc_fill_zone(&_gsData[0][0][0], mask, bright);
+    _gate.forget();
+
+    add_to_buffer('Z');
+    add_to_buffer('N');
+    for (int i = 0; i < ZONE_MASK_SIZE; i++) {
+        add_to_buffer(mask[i]);
+    }
+    add_to_buffer_uint16(bright);
+    send_buffer_and_read_feedback("TLCdriver::setZone()");
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::fadeAll(uint16_t from, uint16_t to, uint16_t refresh_count) {
+    // The LEDs end up at the last frame of the fade
+    tlc_fill_frame(&_gsData[0][0][0], to);
+    _gate.forget();
+
+    add_to_buffer('F');
+    add_to_buffer('D');
+    add_to_buffer_uint16(from);
+    add_to_buffer_uint16(to);
+    add_to_buffer_uint16(refresh_count);
+    send_buffer_and_read_feedback("TLCdriver::fadeAll()");
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setGradient(uint8_t axis, uint16_t from, uint16_t to) {
+    if (axis != GRADIENT_AXIS_X && axis != GRADIENT_AXIS_Y) {
+        cerr << "TLCdriver::setGradient(): axis out of range!" << endl;
+        return;
+    }
+    tlc_gradient_frame(&_gsData[0][0][0], axis, from, to);
+    _gate.forget();
+
+    add_to_buffer('G');
+    add_to_buffer('D');
+    add_to_buffer(axis);
+    add_to_buffer_uint16(from);
+    add_to_buffer_uint16(to);
+    send_buffer_and_read_feedback("TLCdriver::setGradient()");
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setGlobalBrightness(uint8_t bright) {
+    setGlobalBrightness(bright, bright, bright);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setGlobalBrightness(uint8_t red, uint8_t green, uint8_t blue) {
+    if (red > BRIGHTNESS_CONTROL_MAX || green > BRIGHTNESS_CONTROL_MAX || blue > BRIGHTNESS_CONTROL_MAX) {
+        cerr << "TLCdriver::setGlobalBrightness(): brightness out of range!" << endl;
+        return;
+    }
+    _brightnessControl[0] = red;
+    _brightnessControl[1] = green;
+    _brightnessControl[2] = blue;
+    updateControl();
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::setMaxCurrent(uint8_t red, uint8_t green, uint8_t blue) {
+    if (red > MAX_CURRENT_MAX || green > MAX_CURRENT_MAX || blue > MAX_CURRENT_MAX) {
+        cerr << "TLCdriver::setMaxCurrent(): max current out of range!" << endl;
+        return;
+    }
+    _maxCurrent[0] = red;
+    _maxCurrent[1] = green;
+    _maxCurrent[2] = blue;
+    updateControl();
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::updateControl() {
+    add_to_buffer('B');
+    add_to_buffer('C');
+    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+        add_to_buffer(_brightnessControl[k]);
+    }
+    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+        add_to_buffer(_maxCurrent[k]);
+    }
+    send_buffer_and_read_feedback("TLCdriver::updateControl()");
+}
+
+template <class Transport>
+bool BasicTLCdriver<Transport>::loadCalibration(const char* path, bool persist) {
+    std::ifstream file(path);
+    if (!file) {
+        cerr << "TLCdriver::loadCalibration(): couldn't open \"" << path << "\"" << endl;
+        return false;
+    }
+
+    double gain[SCREEN_SIZE_X][SCREEN_SIZE_Y];
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            gain[x][y] = 1;
+        }
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;  // Blank or comment
+        }
+        std::istringstream fields(line);
+        int x, y;
+        double g;
+        if (!(fields >> x >> y >> g) || x < 0 || x >= SCREEN_SIZE_X || y < 0 || y >= SCREEN_SIZE_Y || !(g > 0)) {
+            cerr << "TLCdriver::loadCalibration(): " << path << ":" << line_number << ": expected \"x y gain\"" << endl;
+            return false;
+        }
+        gain[x][y] = g;
+    }
+
+    double min_gain = gain[0][0];
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            min_gain = std::min(min_gain, gain[x][y]);
+        }
+    }
+
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            // Dot correction scales the current linearly from DOT_CORRECTION_MIN_FRACTION to 1
+            // Round up so that the residual is never above 1 and never clips
+            double scale = min_gain / gain[x][y];
+            double dc = std::ceil((scale - DOT_CORRECTION_MIN_FRACTION) / (1 - DOT_CORRECTION_MIN_FRACTION) * DOT_CORRECTION_MAX - 1e-9);
+            dc = std::max(0.0, std::min((double)DOT_CORRECTION_MAX, dc));
+            double dc_scale = DOT_CORRECTION_MIN_FRACTION + (1 - DOT_CORRECTION_MIN_FRACTION) * dc / DOT_CORRECTION_MAX;
+
+            size_t i = _gsIndexChip[x][y], j = _gsIndexChannel[x][y], k = _gsIndexColor[x][y];
+            _dcData[i][j][k] = (uint8_t)dc;
+            _gsResidual[i][j][k] = (uint32_t)std::lround(std::min(1.0, scale / dc_scale) * 0x10000);
+        }
+    }
+    _residualEnabled = true;
+
+    uploadDotCorrection(persist);
+    clog << "Calibration \"" << path << "\" loaded." << endl;
+    return true;
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::resetCalibration(bool persist) {
+    for (int i = 0; i < TLC_COUNT; i++) {
+        for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                _dcData[i][j][k] = DOT_CORRECTION_MAX;
+                _gsResidual[i][j][k] = 0x10000;
+            }
+        }
+    }
+    _residualEnabled = false;
+    uploadDotCorrection(persist);
+}
+
+template <class Transport>
+void BasicTLCdriver<Transport>::uploadDotCorrection(bool persist) {
+    _dotCorrectionUploaded = true;
+    add_to_buffer('D');
+    add_to_buffer('C');
+    for (int i = 0; i < TLC_COUNT; i++) {
+        for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                add_to_buffer(_dcData[i][j][k]);
+            }
+        }
+    }
+    add_to_buffer(persist ? 1 : 0);
+    send_buffer_and_read_feedback("TLCdriver::uploadDotCorrection()");
+}
+
+ConcurrentFrame::ConcurrentFrame() {
+    for (int i = 0; i < TLC_COUNT; i++) {
+        _chips[i].state.store(0, std::memory_order_relaxed);
+        for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                _chips[i].gs[j][k].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void ConcurrentFrame::begin_write(size_t chip_index) {
+    while (_snapshotStarved.load(std::memory_order_relaxed)) {
+        std::this_thread::yield();
+    }
+    // The values are stored with release ordering after this,
+    // so a snapshot that sees one of them also sees this state change
+    _chips[chip_index].state.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ConcurrentFrame::end_write(size_t chip_index) {
+    // One writer out, one write done, in a single step
+    _chips[chip_index].state.fetch_add(WRITE_DONE - 1, std::memory_order_release);
+}
+
+void ConcurrentFrame::setLED(size_t x, size_t y, uint16_t bright) {
+    if (x >= SCREEN_SIZE_X || y >= SCREEN_SIZE_Y) {
+        return;
+    }
+    size_t chip_index = tlc_index_chip[x][y];
+    begin_write(chip_index);
+    _chips[chip_index].gs[tlc_index_channel[x][y]][tlc_index_color[x][y]].store(bright, std::memory_order_release);
+    end_write(chip_index);
+}
+
+void ConcurrentFrame::setAllLED(uint16_t bright) {
+    for (int i = 0; i < TLC_COUNT; i++) {
+        begin_write(i);
+    }
+    for (int i = 0; i < TLC_COUNT; i++) {
+        for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                _chips[i].gs[j][k].store(bright, std::memory_order_release);
+            }
+        }
+    }
+    for (int i = 0; i < TLC_COUNT; i++) {
+        end_write(i);
+    }
+}
+
+void ConcurrentFrame::setLEDChip(size_t chip_index, uint16_t bright) {
+    if (chip_index >= TLC_COUNT) {
+        return;
+    }
+    begin_write(chip_index);
+    for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+        for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+            _chips[chip_index].gs[j][k].store(bright, std::memory_order_release);
+        }
+    }
+    end_write(chip_index);
+}
+
+void ConcurrentFrame::setZone(size_t x0, size_t y0, size_t x1, size_t y1, uint16_t bright) {
+    x1 = std::min(std::max(x0, x1), (size_t)SCREEN_SIZE_X - 1);
+    y1 = std::min(std::max(y0, y1), (size_t)SCREEN_SIZE_Y - 1);
+    x0 = std::min(x0, x1);
+    y0 = std::min(y0, y1);
+
+    // Only lock the chips that the zone touches
+    bool touched[TLC_COUNT] = {false};
+    for (size_t x = x0; x <= x1; x++) {
+        for (size_t y = y0; y <= y1; y++) {
+            touched[tlc_index_chip[x][y]] = true;
+        }
+    }
+    for (int i = 0; i < TLC_COUNT; i++) {
+        if (touched[i]) {
+            begin_write(i);
+        }
+    }
+    for (size_t x = x0; x <= x1; x++) {
+        for (size_t y = y0; y <= y1; y++) {
+            _chips[tlc_index_chip[x][y]].gs[tlc_index_channel[x][y]][tlc_index_color[x][y]].store(bright, std::memory_order_release);
+        }
+    }
+    for (int i = 0; i < TLC_COUNT; i++) {
+        if (touched[i]) {
+            end_write(i);
+        }
+    }
+}
+
+void ConcurrentFrame::snapshot(GSFrame& frame) const {
+    uint64_t state[TLC_COUNT];
+    for (int attempt = 1;; attempt++) {
+        bool writing = false;
+        for (int i = 0; i < TLC_COUNT; i++) {
+            state[i] = _chips[i].state.load(std::memory_order_acquire);
+            writing |= (state[i] & WRITERS_MASK) != 0;
+        }
+        if (!writing) {
+            for (int i = 0; i < TLC_COUNT; i++) {
+                for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+                    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                        frame.gs[i][j][k] = _chips[i].gs[j][k].load(std::memory_order_acquire);
+                    }
+                }
+            }
+            // If a value above came from a write that started after the states were read,
+            // the acquire loads make the state loads below see that write
+            bool changed = false;
+            for (int i = 0; i < TLC_COUNT; i++) {
+                changed |= _chips[i].state.load(std::memory_order_relaxed) != state[i];
+            }
+            if (!changed) {
+                _snapshotStarved.store(false, std::memory_order_relaxed);
+                return;
+            }
+        }
+        _retries.fetch_add(1, std::memory_order_relaxed);
+        if (attempt == SNAPSHOT_PATIENCE) {
+            _snapshotStarved.store(true, std::memory_order_relaxed);
+        }
     }
 }
 }  //namespace: hdrbacklightdriverjli
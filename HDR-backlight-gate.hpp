@@ -0,0 +1,190 @@
+/* Perceptual change gate for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_GATE_H
+#define HDR_BACKLIGHT_GATE_H
+
+#include <cstdint>    // uint16_t
+#include <cstring>    // std::memset, std::memcpy
+#include <cmath>      // std::pow
+#include <vector>     // std::vector
+#include <algorithm>  // std::min, std::max
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "Teensy_TLC_Control/TLCprotocol.h"
+
+// With -mavx2, 8 zones at a time with gathers from the table, plain C++ otherwise. Both give the same answers
+#if defined(__AVX2__)
+#define CHANGE_GATE_KERNEL "AVX2"
+#else
+#define CHANGE_GATE_KERNEL "scalar"
+#endif
+
+// The smallest change of a zone's PQ signal that is sent: one code of 10-bit PQ, the steps HDR10 video comes in
+#define CHANGE_GATE_THRESHOLD (1.0 / 1023)
+// A frame goes out at least this often, even if nothing changed
+#define CHANGE_GATE_KEEPALIVE_US 100000.0
+// The values sharing a tolerance, 1 << 4 = 16 of them
+#define CHANGE_GATE_BUCKET_SHIFT 4
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Whether a frame looks any different from the last one sent. The light of every zone
+// (value / 65535 of peak_nits) goes through the inverse of the PQ EOTF, which is close to even steps of what
+// the eye can tell apart, and a zone changed if its PQ signal moved by more than the threshold.
+// That takes no pow() per frame: a table holds, for every bucket of values, the largest difference of
+// two values that stays within the threshold for any lower value in the bucket, so a zone is one lookup and
+// one comparison, and a change is never missed. Times are in microseconds, on any clock, the same for every call
+class ChangeGate {
+   public:
+    // Until configure(), any change is visible
+    ChangeGate() {
+        std::memset(_tolerance, 0, sizeof(_tolerance));
+    }
+
+    // keepalive_us of 0: no keep-alive
+    void configure(double threshold_pq = CHANGE_GATE_THRESHOLD, double peak_nits = 1000, double keepalive_us = CHANGE_GATE_KEEPALIVE_US);
+
+    // Whether a value of the TLC_FRAME_VALUE_COUNT of two frames differs visibly
+    bool visible(const uint16_t* a, const uint16_t* b) const;
+    // Whether the frame has to go out at now_us: it differs visibly from the last frame sent(),
+    // there was none, or the keep-alive is due. A frame that doesn't is counted as skipped
+    bool pass(const uint16_t* frame, double now_us);
+    // The frame went out at now_us, and the LEDs show it. Without flow control, the Teensy acknowledged it;
+    // with flow control, its acknowledgement comes in a later batch, and a failure then has to forget() it
+    void sent(const uint16_t* frame, double now_us);
+    // Let the next frame pass, whenever the LEDs may show something else than the last frame sent:
+    // after an effect, a batch, a failed command or a reconnect
+    void forget() {
+        _hasSent = false;
+    }
+
+    struct Report {
+        unsigned long frames;      // Given to pass()
+        unsigned long skipped;
+        unsigned long keepalives;  // Sent only for the keep-alive
+        double skip_rate;
+    };
+    Report report() const;
+    void resetStats() {
+        _frames = _skipped = _keepalives = 0;
+    }
+
+    // PQ signal in [0, 1] of light in nits, the inverse of the PQ EOTF
+    static double lightToPQ(double nits);
+
+   private:
+    // By the lower value of the two, and one more: a gather reads 4 bytes for the last one
+    uint16_t _tolerance[(65536 >> CHANGE_GATE_BUCKET_SHIFT) + 1];
+    uint16_t _sent[TLC_FRAME_VALUE_COUNT];
+    bool _hasSent = false;
+    double _sentUs = 0;
+    double _keepaliveUs = CHANGE_GATE_KEEPALIVE_US;
+    unsigned long _frames = 0, _skipped = 0, _keepalives = 0;
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+double ChangeGate::lightToPQ(double nits) {
+    const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+    const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+    double p = std::pow(std::min(1.0, std::max(0.0, nits / 10000)), m1);
+    return std::pow((c1 + c2 * p) / (1 + c3 * p), m2);
+}
+
+void ChangeGate::configure(double threshold_pq, double peak_nits, double keepalive_us) {
+    _keepaliveUs = keepalive_us;
+    std::vector<double> signal(65536);
+    for (int value = 0; value < 65536; value++) {
+        signal[value] = lightToPQ(value / 65535.0 * peak_nits);
+    }
+    // The highest value within the threshold of each value only goes up with the value
+    int highest = 0;
+    for (int value = 0; value < 65536; value++) {
+        highest = std::max(highest, value);
+        while (highest < 65535 && signal[highest + 1] - signal[value] <= threshold_pq) {
+            highest++;
+        }
+        int bucket = value >> CHANGE_GATE_BUCKET_SHIFT;
+        uint16_t tolerance = (uint16_t)(highest - value);
+        _tolerance[bucket] = (value & ((1 << CHANGE_GATE_BUCKET_SHIFT) - 1)) == 0 ? tolerance : std::min(_tolerance[bucket], tolerance);
+    }
+    _hasSent = false;
+}
+
+bool ChangeGate::visible(const uint16_t* a, const uint16_t* b) const {
+    // No early exit: a frame that passes is likely to differ in a few zones anyway, and one that is skipped is read to the end
+    unsigned changed = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i low16 = _mm256_set1_epi32(0xFFFF);
+    __m256i any = _mm256_setzero_si256();
+    for (; i + 8 <= TLC_FRAME_VALUE_COUNT; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i)), vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i lower = _mm_min_epu16(va, vb);
+        __m256i difference = _mm256_cvtepu16_epi32(_mm_sub_epi16(_mm_max_epu16(va, vb), lower));
+        __m256i bucket = _mm256_cvtepu16_epi32(_mm_srli_epi16(lower, CHANGE_GATE_BUCKET_SHIFT));
+        __m256i tolerance = _mm256_and_si256(_mm256_i32gather_epi32((const int*)_tolerance, bucket, 2), low16);
+        any = _mm256_or_si256(any, _mm256_cmpgt_epi32(difference, tolerance));
+    }
+    changed = !_mm256_testz_si256(any, any);
+#endif
+    for (; i < TLC_FRAME_VALUE_COUNT; i++) {
+        uint16_t lower = std::min(a[i], b[i]), higher = std::max(a[i], b[i]);
+        changed |= (unsigned)(higher - lower > _tolerance[lower >> CHANGE_GATE_BUCKET_SHIFT]);
+    }
+    return changed != 0;
+}
+
+bool ChangeGate::pass(const uint16_t* frame, double now_us) {
+    _frames++;
+    if (!_hasSent || visible(frame, _sent)) {
+        return true;
+    }
+    if (_keepaliveUs > 0 && now_us - _sentUs >= _keepaliveUs) {
+        _keepalives++;
+        return true;
+    }
+    _skipped++;
+    return false;
+}
+
+void ChangeGate::sent(const uint16_t* frame, double now_us) {
+    std::memcpy(_sent, frame, sizeof(_sent));
+    _sentUs = now_us;
+    _hasSent = true;
+}
+
+ChangeGate::Report ChangeGate::report() const {
+    return {_frames, _skipped, _keepalives, _frames > 0 ? (double)_skipped / _frames : 0};
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_GATE_H
@@ -0,0 +1,210 @@
+/* Serial link health and frame rate control for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_HEALTH_H
+#define HDR_BACKLIGHT_HEALTH_H
+
+#include <cstddef>    // size_t
+#include <vector>     // std::vector
+#include <algorithm>  // std::max, std::min, std::nth_element, std::max_element
+
+// Time without failures after which the link is clear again
+#define LINK_HEALTH_CLEAR_US 500000.0
+// The frame interval after the first failure, and the longest: a timeout already takes 100 ms
+#define LINK_HEALTH_MIN_INTERVAL_US 1000.0
+#define LINK_HEALTH_MAX_INTERVAL_US 100000.0
+// The most frames skipped by ChangeGate that are kept for a burst of changes
+#define LINK_HEALTH_BURST_FRAMES 4
+// An ack this many times slower than the median of the window is a sign of congestion
+#define LINK_HEALTH_SLOW_FACTOR 4
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// The state of the link to the Teensy, from what happens to the commands, and the frame rate it can take.
+// A timeout or wrong feedback doubles the shortest interval between two frames, from
+// LINK_HEALTH_MIN_INTERVAL_US up to LINK_HEALTH_MAX_INTERVAL_US, so a failing link isn't flooded
+// with frames that each wait 100 ms for their feedback. After LINK_HEALTH_CLEAR_US without failures,
+// every ack that isn't slow halves the interval, and the interval goes back to 0,
+// the full rate, when it is shorter than a round trip. A frame that could have gone out but wasn't needed
+// (see skip()) keeps its turn, and up to LINK_HEALTH_BURST_FRAMES of them go out between two turns. Times are in microseconds,
+// on any clock, as long as it is the same one for every call
+class LinkHealth {
+   public:
+    explicit LinkHealth(size_t window = 128);
+
+    // What happened to a command, at now_us
+    void ack(double rtt_us, double now_us);
+    void timeout(double now_us);
+    void wrongFeedback(double now_us);
+    // The input was drained after a failure, discarded_bytes with it
+    void resync(size_t discarded_bytes);
+
+    // Whether a frame may go out at now_us, at the current interval. A frame held back is counted
+    bool admit(double now_us);
+    // A frame at now_us didn't need to go out, e.g. ChangeGate skipped it. If it had its turn, the turn is kept for later
+    void skip(double now_us);
+
+    struct Report {
+        unsigned long acks;
+        unsigned long timeouts;
+        unsigned long wrong_feedback;
+        unsigned long resyncs;
+        unsigned long discarded_bytes;
+        unsigned long held_back;  // Frames not sent by admit()
+        double rtt_p50_us;        // Of the acks in the window
+        double rtt_p99_us;
+        double rtt_max_us;
+        double failure_rate;  // Moving average
+        double interval_us;   // 0 at full rate
+    };
+    Report report() const;
+    void reset();
+
+    // Accessor methods
+    bool degraded() const {
+        return _interval > 0;
+    }
+    double intervalUs() const {
+        return _interval;
+    }
+
+   private:
+    std::vector<double> _rtt;  // Of the last acks
+    mutable std::vector<double> _sorted;  // Scratch for rtt_percentile(), as big as the window
+    size_t _next = 0, _count = 0;
+    double _median = 0;  // Of the RTTs in the window, updated every 16 acks
+    double _failureRate = 0;  // Over about 16 commands
+    double _lastFailure = 0;
+    double _interval = 0;
+    double _lastAdmitted = 0;
+    bool _admitted = false;  // Since reset()
+    int _skippedTurns = 0;   // Up to LINK_HEALTH_BURST_FRAMES
+    unsigned long _acks = 0, _timeouts = 0, _wrongFeedback = 0, _resyncs = 0, _discardedBytes = 0, _heldBack = 0;
+
+    void failure(double now_us);
+    double rtt_percentile(double p) const;
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+LinkHealth::LinkHealth(size_t window) : _rtt(std::max(window, (size_t)1)), _sorted(_rtt.size()) {}
+
+void LinkHealth::ack(double rtt_us, double now_us) {
+    _acks++;
+    bool slow = _count >= 16 && rtt_us > LINK_HEALTH_SLOW_FACTOR * _median;
+    _rtt[_next] = rtt_us;
+    _next = (_next + 1) % _rtt.size();
+    _count = std::min(_count + 1, _rtt.size());
+    if (_count < 16 || _next % 16 == 0) {
+        _median = rtt_percentile(0.5);  // Not on every ack, it sorts the window
+    }
+    _failureRate -= _failureRate / 16;
+
+    if (_interval > 0 && !slow && now_us - _lastFailure >= LINK_HEALTH_CLEAR_US) {
+        _interval /= 2;
+        if (_interval < std::max(LINK_HEALTH_MIN_INTERVAL_US, _median)) {
+            _interval = 0;  // The round trip limits the rate anyway
+            _skippedTurns = 0;
+        }
+    }
+}
+
+void LinkHealth::timeout(double now_us) {
+    _timeouts++;
+    failure(now_us);
+}
+
+void LinkHealth::wrongFeedback(double now_us) {
+    _wrongFeedback++;
+    failure(now_us);
+}
+
+void LinkHealth::failure(double now_us) {
+    _failureRate += (1 - _failureRate) / 16;
+    _lastFailure = now_us;
+    _interval = std::min(std::max(std::max(2 * _interval, 2 * _median), LINK_HEALTH_MIN_INTERVAL_US), LINK_HEALTH_MAX_INTERVAL_US);
+}
+
+void LinkHealth::resync(size_t discarded_bytes) {
+    _resyncs++;
+    _discardedBytes += discarded_bytes;
+}
+
+bool LinkHealth::admit(double now_us) {
+    if (_interval > 0 && _admitted && now_us - _lastAdmitted < _interval) {
+        if (_skippedTurns > 0) {
+            _skippedTurns--;
+            return true;
+        }
+        _heldBack++;
+        return false;
+    }
+    _admitted = true;
+    _lastAdmitted = now_us;
+    return true;
+}
+
+void LinkHealth::skip(double now_us) {
+    if (_interval > 0 && (!_admitted || now_us - _lastAdmitted >= _interval)) {
+        _skippedTurns = std::min(_skippedTurns + 1, LINK_HEALTH_BURST_FRAMES);
+        _admitted = true;
+        _lastAdmitted = now_us;
+    }
+}
+
+double LinkHealth::rtt_percentile(double p) const {
+    if (_count == 0) {
+        return 0;
+    }
+    std::copy(_rtt.begin(), _rtt.begin() + _count, _sorted.begin());
+    size_t rank = std::min((size_t)(p * _count), _count - 1);
+    std::nth_element(_sorted.begin(), _sorted.begin() + rank, _sorted.begin() + _count);
+    return _sorted[rank];
+}
+
+LinkHealth::Report LinkHealth::report() const {
+    Report result = {_acks, _timeouts, _wrongFeedback, _resyncs, _discardedBytes, _heldBack, 0, 0, 0, _failureRate, _interval};
+    if (_count > 0) {
+        result.rtt_p50_us = rtt_percentile(0.5);
+        result.rtt_p99_us = rtt_percentile(0.99);
+        result.rtt_max_us = *std::max_element(_rtt.begin(), _rtt.begin() + _count);
+    }
+    return result;
+}
+
+void LinkHealth::reset() {
+    _next = _count = 0;
+    _median = 0;
+    _failureRate = _interval = 0;
+    _lastFailure = 0;
+    _admitted = false;
+    _skippedTurns = 0;
+    _acks = _timeouts = _wrongFeedback = _resyncs = _discardedBytes = _heldBack = 0;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_HEALTH_H
@@ -0,0 +1,277 @@
+/* Lock-free frame handoff for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_MAILBOX_H
+#define HDR_BACKLIGHT_MAILBOX_H
+
+#include <atomic>  // std::atomic
+#include <cstddef>  // size_t
+#include <memory>   // std::unique_ptr
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Latest-value-wins handoff from one producer thread to one consumer thread, without locks.
+// Three slots: the producer writes the back one, the consumer reads the front one,
+// and publish() / acquire() swap them with the middle one in a single atomic exchange.
+// Neither side ever waits for the other. If the producer publishes twice before the consumer
+// acquires, the older value is dropped.
+//
+//    // Producer (render thread)
+//    mailbox.back() = frame;  // or write into back() in place
+//    mailbox.publish();
+//
+//    // Consumer (transmit thread)
+//    if (mailbox.acquire())
+//        send(mailbox.front());
+template <class T>
+class TripleBuffer {
+   public:
+    TripleBuffer() = default;
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // Producer side
+    T& back() {
+        return _slots[_back];
+    }
+    void publish();
+    void publish(const T& value) {
+        back() = value;
+        publish();
+    }
+
+    // Consumer side
+    // Returns true and moves the newest published value to front() if there is one not acquired yet
+    bool acquire();
+    const T& front() const {
+        return _slots[_front];
+    }
+
+    // For a buffer in memory shared with a process that isn't trusted, which can write anything to the indices:
+    // front(), or nullptr if a slot index is out of range. reset() then puts the indices back as constructed
+    const T* checkedFront() const;
+    void reset();
+
+    // Statistics, safe to read from any thread
+    unsigned long published() const {
+        return _published.load(std::memory_order_relaxed);
+    }
+    unsigned long acquired() const {
+        return _acquired.load(std::memory_order_relaxed);
+    }
+    // Published values overwritten before the consumer saw them
+    unsigned long dropped() const {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+    // Acquired values that replaced at least one dropped value
+    unsigned long coalesced() const {
+        return _coalesced.load(std::memory_order_relaxed);
+    }
+
+   private:
+    // Bits 0-1 of _middle: slot index, bit 2: published and not acquired yet
+    static const unsigned FRESH = 4;
+    static const unsigned INDEX_MASK = 3;
+
+    T _slots[3];
+
+    // Each side's own state on its own cache line, so that they don't slow each other down
+    alignas(64) std::atomic<unsigned> _middle{1};
+    alignas(64) unsigned _back = 0;
+    std::atomic<unsigned long> _published{0};
+    std::atomic<unsigned long> _dropped{0};
+    alignas(64) unsigned _front = 2;
+    unsigned long _droppedSeen = 0;
+    std::atomic<unsigned long> _acquired{0};
+    std::atomic<unsigned long> _coalesced{0};
+};
+
+// Bounded queue for any number of producer and consumer threads, without locks,
+// for pipelines whose stages hand items to each other in order.
+// Every cell carries a sequence number that says whose turn it is to use it,
+// so producers and consumers only contend on their own position counter.
+// When the queue is full, push() fails and the producer decides: wait for the consumer
+// (backpressure), or pushDropOldest() to make room by taking out the oldest item.
+template <class T>
+class BoundedQueue {
+   public:
+    // The capacity is rounded up to a power of two
+    explicit BoundedQueue(size_t capacity);
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool push(const T& value);
+    bool pop(T& value);
+    // Push, popping the oldest items while the queue is full and handing each to drop(item)
+    // Returns the number of items dropped
+    template <class Drop>
+    size_t pushDropOldest(const T& value, Drop drop);
+
+    size_t capacity() const {
+        return _mask + 1;
+    }
+    // Approximate while other threads push and pop
+    size_t size() const {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+   private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(64) std::atomic<size_t> _tail{0};  // Next position to push
+    alignas(64) std::atomic<size_t> _head{0};  // Next position to pop
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+template <class T>
+void TripleBuffer<T>::publish() {
+    // Release: the consumer that picks this slot sees everything written to it
+    unsigned previous = _middle.exchange(_back | FRESH, std::memory_order_acq_rel);
+    _back = previous & INDEX_MASK;
+
+    // Only the producer writes these, no need for read-modify-write
+    _published.store(_published.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (previous & FRESH) {
+        _dropped.store(_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+template <class T>
+bool TripleBuffer<T>::acquire() {
+    if (!(_middle.load(std::memory_order_relaxed) & FRESH)) {
+        return false;
+    }
+    // Acquire: pairs with the release in publish()
+    // The producer may have published again since the check above, then this picks the newer one
+    unsigned previous = _middle.exchange(_front, std::memory_order_acq_rel);
+    _front = previous & INDEX_MASK;
+
+    _acquired.store(_acquired.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    unsigned long dropped = _dropped.load(std::memory_order_relaxed);
+    if (dropped != _droppedSeen) {
+        _droppedSeen = dropped;
+        _coalesced.store(_coalesced.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+template <class T>
+const T* TripleBuffer<T>::checkedFront() const {
+    // Read once, the other process may change it again
+    unsigned front = *(volatile const unsigned*)&_front;
+    return front < 3 ? &_slots[front] : nullptr;
+}
+
+template <class T>
+void TripleBuffer<T>::reset() {
+    _back = 0;
+    _front = 2;
+    _middle.store(1, std::memory_order_release);
+}
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    _mask = size - 1;
+    _cells.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++) {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template <class T>
+bool BoundedQueue<T>::push(const T& value) {
+    size_t position = _tail.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = _cells[position & _mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        // sequence == position: the cell is free for this position
+        // sequence < position: it still holds the item from one lap ago, the queue is full
+        if (sequence == position) {
+            if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.value = value;
+                cell.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (sequence < position) {
+            return false;
+        } else {
+            position = _tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <class T>
+bool BoundedQueue<T>::pop(T& value) {
+    size_t position = _head.load(std::memory_order_relaxed);
+    while (true) {
+        Cell& cell = _cells[position & _mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        // sequence == position + 1: the item for this position was pushed
+        // sequence < position + 1: nothing pushed there yet, the queue is empty
+        if (sequence == position + 1) {
+            if (_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                value = cell.value;
+                // Free for the push one lap later
+                cell.sequence.store(position + _mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (sequence < position + 1) {
+            return false;
+        } else {
+            position = _head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <class T>
+template <class Drop>
+size_t BoundedQueue<T>::pushDropOldest(const T& value, Drop drop) {
+    size_t count = 0;
+    T oldest;
+    while (!push(value)) {
+        // A consumer may empty the queue in between, then the next push() succeeds
+        if (pop(oldest)) {
+            drop(oldest);
+            count++;
+        }
+    }
+    return count;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_MAILBOX_H
@@ -0,0 +1,150 @@
+/* Frame pacing for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_PACER_H
+#define HDR_BACKLIGHT_PACER_H
+
+#include <chrono>     // std::chrono::steady_clock, a monotonic clock
+#include <algorithm>  // std::max
+
+#if defined(__linux__)
+#include <time.h>  // clock_nanosleep()
+#include <cerrno>  // EINTR
+#else
+#include <thread>  // std::this_thread::sleep_until()
+#endif
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Wakes the caller once per frame period, at absolute deadlines on a monotonic clock,
+// so that the frame rate doesn't drift and the thread sleeps in between.
+//
+//    FramePacer pacer(120);
+//    while (1) {
+//        pacer.wait();
+//        TLCteensy.updateFrame();
+//    }
+class FramePacer {
+   public:
+    typedef std::chrono::steady_clock clock;
+
+    // frames_per_second <= 0 disables pacing: wait() returns immediately.
+    // The thread sleeps until spin_us before each deadline, then spins on the clock,
+    // because the sleep itself may overshoot by tens of microseconds
+    FramePacer(double frames_per_second, int spin_us = 50);
+
+    // Block until the next deadline
+    // Returns false if the deadline had already passed, which counts as a missed frame.
+    // If the caller is late by more than a whole period, the skipped deadlines are dropped
+    // rather than run back to back
+    bool wait();
+
+    // Start again from now, e.g. after a pause
+    void reset();
+
+    // Accessor methods
+    clock::duration period() const {
+        return _period;
+    }
+    unsigned long frames() const {
+        return _frames;
+    }
+    unsigned long missed() const {
+        return _missed;
+    }
+    // The latest wait() returned after its deadline, the sleep overshoot included
+    clock::duration max_lateness() const {
+        return _maxLateness;
+    }
+
+   private:
+    clock::duration _period;
+    clock::duration _spin;
+    clock::time_point _deadline;
+    unsigned long _frames = 0;
+    unsigned long _missed = 0;
+    clock::duration _maxLateness = clock::duration::zero();
+
+    void sleep_until(clock::time_point time);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+FramePacer::FramePacer(double frames_per_second, int spin_us)
+    : _period(frames_per_second > 0 ? std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / frames_per_second))
+                                    : clock::duration::zero()),
+      _spin(std::chrono::microseconds(spin_us)),
+      _deadline(clock::now()) {
+}
+
+void FramePacer::reset() {
+    _deadline = clock::now();
+}
+
+bool FramePacer::wait() {
+    _frames++;
+    if (_period == clock::duration::zero()) {
+        return true;
+    }
+
+    // Absolute deadlines: the time spent between two calls doesn't add up
+    _deadline += _period;
+    clock::time_point now = clock::now();
+    if (now >= _deadline) {
+        _missed++;
+        if (now - _deadline > _period) {
+            _deadline = now;
+        }
+        return false;
+    }
+
+    if (_deadline - now > _spin) {
+        sleep_until(_deadline - _spin);
+    }
+    while ((now = clock::now()) < _deadline)
+        ;
+    _maxLateness = std::max(_maxLateness, now - _deadline);
+    return true;
+}
+
+void FramePacer::sleep_until(clock::time_point time) {
+#if defined(__linux__)
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    // TIMER_ABSTIME: waking up late doesn't delay the following deadlines
+    auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch());
+    struct timespec deadline;
+    deadline.tv_sec = since_epoch.count() / 1000000000;
+    deadline.tv_nsec = since_epoch.count() % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;  // Interrupted by a signal
+#else
+    std::this_thread::sleep_until(time);
+#endif
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_PACER_H
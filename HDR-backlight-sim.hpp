@@ -0,0 +1,491 @@
+/* Simulated Teensy for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_SIM_H
+#define HDR_BACKLIGHT_SIM_H
+
+#include <cstdint>  // uint8_t, uint16_t
+#include <cstring>  // std::memcpy, std::memset
+#include <vector>   // std::vector
+#include <chrono>   // std::chrono::steady_clock
+
+#ifndef _WIN32
+#include <cstdio>    // perror()
+#include <string>    // std::string
+#include <thread>    // std::thread
+#include <atomic>    // std::atomic
+#include <stdlib.h>  // posix_openpt(), grantpt(), unlockpt(), ptsname()
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#endif
+
+#include "Teensy_TLC_Control/TLCprotocol.h"
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// The Teensy_TLC_Control sketch without the hardware: it parses the bytes the host sends
+// and answers like the sketch does, keeping the state the sketch would shift out to the TLC5955s.
+// Used to run the driver and the programs built on it without a board.
+// Time is not simulated: interpolation, fades and batches of frames jump to their last frame.
+class TLCfirmwareEmulator {
+   public:
+    TLCfirmwareEmulator();
+
+    // Bytes from the host. The answers are appended to reply
+    void receive(const uint8_t* data, size_t size, std::vector<uint8_t>& reply);
+
+    // The sketch reboots on 'R', 'T': the state is reset, and the serial port goes away for a while
+    // Returns true once per reboot command
+    bool rebootRequested();
+
+    // Answer 'H', 'I' with these TLC_FEATURE_* (the commands all work anyway),
+    // or skip it like a sketch older than the handshake
+    void setHello(bool answer, uint16_t features = TLC_FEATURES_ALL) {
+        _helloAnswered = answer;
+        _helloFeatures = features;
+    }
+
+    // Accessor methods
+    const uint16_t* frame() const {  // TLC_FRAME_VALUE_COUNT values, in the order of the serial protocol
+        return _frame;
+    }
+    const uint8_t* brightness() const {  // Red, green, blue
+        return _brightness;
+    }
+    const uint8_t* maxCurrent() const {
+        return _maxCurrent;
+    }
+    const uint8_t* dotCorrection() const {  // TLC_FRAME_VALUE_COUNT values
+        return _dotCorrection;
+    }
+    bool interpolationEnabled() const {
+        return _interpolationEnabled;
+    }
+    bool flowControlEnabled() const {
+        return _flowControlEnabled;
+    }
+    bool timestampsEnabled() const {
+        return _timestampsEnabled;
+    }
+    // The sketch's micros(), from the last reboot
+    uint32_t micros() const {
+        return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _bootTime).count();
+    }
+    unsigned long frames() const {  // Frames shifted out, one per command that changes the LEDs
+        return _frames;
+    }
+    unsigned long commands() const {
+        return _commands;
+    }
+    unsigned long discardedBytes() const {  // Bytes skipped to resynchronize
+        return _discardedBytes;
+    }
+
+   private:
+    std::vector<uint8_t> _input;  // Received, not processed yet
+    size_t _inputStart = 0;
+    bool _rebootRequested = false;
+    bool _helloAnswered = true;
+    uint16_t _helloFeatures = TLC_FEATURES_ALL;
+
+    uint16_t _frame[TLC_FRAME_VALUE_COUNT];
+    uint8_t _brightness[3];
+    uint8_t _maxCurrent[3];
+    uint8_t _dotCorrection[TLC_FRAME_VALUE_COUNT];
+    uint8_t _storedDotCorrection[TLC_FRAME_VALUE_COUNT];  // The EEPROM, kept over reboots
+    bool _interpolationEnabled;
+    bool _flowControlEnabled;
+    uint8_t _acksPending;  // Commands done with flow control, not acknowledged yet
+    bool _timestampsEnabled;
+    std::chrono::steady_clock::time_point _bootTime;
+    unsigned long _frames = 0;
+    unsigned long _commands = 0;
+    unsigned long _discardedBytes = 0;
+
+    void reset();
+    // The state of setup() that a new host starts from, see 'H', 'I'
+    void reset_session();
+    // Returns the payload size of the command starting at command, with size bytes received, or -1 if it isn't one.
+    // For 'G', 'B' it is the header size until the header is there
+    int payload_size(const uint8_t* command, size_t size) const;
+    void execute(uint8_t a, uint8_t b, const uint8_t* payload, std::vector<uint8_t>& reply);
+    void acknowledge(std::vector<uint8_t>& reply);
+    static uint16_t read_uint16(const uint8_t* bytes) {
+        return (uint16_t)((bytes[0] << 8) | bytes[1]);
+    }
+};
+
+#ifndef _WIN32
+// The emulator behind a pseudo-terminal, linked from a fixed path, for the serial transports.
+// Like the Teensy on USB, the port goes away for reboot_ms when it is asked to reboot.
+// disconnect() makes it go away without a reboot, like a glitch of the cable.
+// serve() handles the bytes that arrive; start() does it on a thread of its own until stop()
+class PtyBoard {
+   public:
+    explicit PtyBoard(const char* link, int reboot_ms = 300);
+    ~PtyBoard() {
+        stop();
+        close_port();
+    }
+    PtyBoard(const PtyBoard&) = delete;
+    PtyBoard& operator=(const PtyBoard&) = delete;
+
+    bool isOpen() const {
+        return _master != -1;
+    }
+    // The pseudo-terminal the link points to
+    const char* name() const {
+        return _name.c_str();
+    }
+
+    // Wait up to timeout_ms for bytes from the host, and answer them. False if the port couldn't come back after a reboot
+    bool serve(int timeout_ms);
+    void start();
+    void stop();
+    // The port goes away for ms at the next serve(), and the board keeps its state. Safe while start() runs
+    void disconnect(int ms) {
+        _disconnectMs = ms;
+    }
+
+    // Not safe while the thread of start() runs
+    const TLCfirmwareEmulator& board() const {
+        return _board;
+    }
+    TLCfirmwareEmulator& board() {
+        return _board;
+    }
+    unsigned long reboots() const {
+        return _reboots;
+    }
+    unsigned long disconnects() const {
+        return _disconnects;
+    }
+
+   private:
+    std::string _link, _name;
+    int _rebootMs;
+    int _master = -1;
+    int _slave = -1;  // Kept open, so that the master doesn't see a hang-up while the host reconnects
+    TLCfirmwareEmulator _board;
+    std::vector<uint8_t> _reply;
+    std::atomic<unsigned long> _reboots{0};
+    std::atomic<int> _disconnectMs{0};
+    std::atomic<unsigned long> _disconnects{0};
+    std::thread _thread;
+    std::atomic<bool> _running{false};
+
+    bool open_port();
+    void close_port();
+};
+#endif
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+TLCfirmwareEmulator::TLCfirmwareEmulator() {
+    std::memset(_storedDotCorrection, DOT_CORRECTION_MAX, sizeof(_storedDotCorrection));
+    reset();
+}
+
+void TLCfirmwareEmulator::reset() {
+    // As in setup() of the sketch
+    tlc_fill_frame(_frame, 0);
+    reset_session();
+    _bootTime = std::chrono::steady_clock::now();
+    _input.clear();
+    _inputStart = 0;
+}
+
+void TLCfirmwareEmulator::reset_session() {
+    for (int k = 0; k < 3; k++) {
+        _brightness[k] = BRIGHTNESS_CONTROL_MAX;
+        _maxCurrent[k] = 4;
+    }
+    std::memcpy(_dotCorrection, _storedDotCorrection, sizeof(_dotCorrection));
+    _interpolationEnabled = false;
+    _flowControlEnabled = false;
+    _acksPending = 0;
+    _timestampsEnabled = false;
+}
+
+bool TLCfirmwareEmulator::rebootRequested() {
+    bool requested = _rebootRequested;
+    _rebootRequested = false;
+    return requested;
+}
+
+int TLCfirmwareEmulator::payload_size(const uint8_t* command, size_t size) const {
+    uint8_t a = command[0], b = command[1];
+    if (a == 'G' && b == 'O') return 2 * TLC_FRAME_VALUE_COUNT;
+    if (a == 'G' && b == '8') return FRAME8_PAYLOAD_SIZE;
+    if (a == 'G' && b == 'B') {
+        if (size < 2 + BATCH_HEADER_SIZE) return BATCH_HEADER_SIZE;
+        return BATCH_HEADER_SIZE + command[2] * 2 * TLC_FRAME_VALUE_COUNT + command[3];
+    }
+    if (a == 'R' && b == 'T') return 0;
+    if (a == 'I' && b == 'P') return INTERPOLATION_PAYLOAD_SIZE;
+    if (a == 'F' && b == 'L') return FILL_PAYLOAD_SIZE;
+    if (a == 'Z' && b == 'N') return ZONE_PAYLOAD_SIZE;
+    if (a == 'F' && b == 'D') return FADE_PAYLOAD_SIZE;
+    if (a == 'G' && b == 'D') return GRADIENT_PAYLOAD_SIZE;
+    if (a == 'B' && b == 'C') return CONTROL_PAYLOAD_SIZE;
+    if (a == 'D' && b == 'C') return DOT_CORRECTION_PAYLOAD_SIZE;
+    if (a == 'C' && b == 'R') return FLOW_CONTROL_PAYLOAD_SIZE;
+    if (a == 'T' && b == 'S') return TIMESTAMPS_PAYLOAD_SIZE;
+    if (a == 'H' && b == 'I' && _helloAnswered) return HELLO_PAYLOAD_SIZE;
+    return -1;
+}
+
+void TLCfirmwareEmulator::receive(const uint8_t* data, size_t size, std::vector<uint8_t>& reply) {
+    _input.insert(_input.end(), data, data + size);
+
+    while (_input.size() - _inputStart >= 2) {
+        const uint8_t* command = &_input[_inputStart];
+        int payload = payload_size(command, _input.size() - _inputStart);
+        if (payload < 0) {
+            // Not the start of a command, resynchronize on the next byte
+            _inputStart++;
+            _discardedBytes++;
+            continue;
+        }
+        if (_input.size() - _inputStart < 2 + (size_t)payload) {
+            break;  // Wait for the rest of the payload
+        }
+        _inputStart += 2 + payload;
+        execute(command[0], command[1], command + 2, reply);
+        if (_rebootRequested) {
+            return;  // Anything after the reboot command is lost with the serial port
+        }
+    }
+
+    // Out of input: the sketch gives back the credits it holds
+    if (_acksPending > 0) {
+        reply.push_back('A');
+        reply.push_back('K');
+        reply.push_back(_acksPending);
+        _acksPending = 0;
+    }
+
+    // Drop what has been processed
+    _input.erase(_input.begin(), _input.begin() + _inputStart);
+    _inputStart = 0;
+}
+
+void TLCfirmwareEmulator::execute(uint8_t a, uint8_t b, const uint8_t* payload, std::vector<uint8_t>& reply) {
+    _commands++;
+    if (a == 'R' && b == 'T') {
+        reset();
+        _rebootRequested = true;
+        return;  // No answer
+    }
+    if (a == 'C' && b == 'R') {
+        _flowControlEnabled = payload[0] != 0;
+        _acksPending = 0;
+        reply.push_back('C');
+        reply.push_back('R');
+        reply.push_back(_flowControlEnabled ? TLC_CREDIT_DEPTH : 0);
+        return;
+    }
+    if (a == 'H' && b == 'I') {
+        reset_session();
+        // The TLC count, LEDs per chip and color channels of the TLC5955 library
+        const uint8_t hello[2 + HELLO_FEEDBACK_SIZE] = {'H', 'I', TLC_PROTOCOL_VERSION, 3, 16, 3, (uint8_t)(_helloFeatures >> 8), (uint8_t)_helloFeatures,
+                                                        TLC_CREDIT_DEPTH, TLC_FRAME_QUEUE_DEPTH, TLC_BATCH_MAX_FRAMES};
+        reply.insert(reply.end(), hello, hello + sizeof(hello));
+        return;
+    }
+
+    if (a == 'G' && b == 'O') {
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            _frame[i] = read_uint16(payload + 2 * i);
+        }
+        _frames++;
+    } else if (a == 'G' && b == '8') {
+        tlc_expand_8bit(_frame, payload);
+        _frames++;
+    } else if (a == 'G' && b == 'B') {
+        // Every frame of the batch is shown, the last one stays
+        const uint8_t* values = payload + BATCH_HEADER_SIZE;
+        for (int n = 0; n < payload[0]; n++, values += 2 * TLC_FRAME_VALUE_COUNT) {
+            for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+                _frame[i] = read_uint16(values + 2 * i);
+            }
+            _frames++;
+        }
+    } else if (a == 'I' && b == 'P') {
+        _interpolationEnabled = payload[0] != 0;
+    } else if (a == 'T' && b == 'S') {
+        _timestampsEnabled = payload[0] != 0;
+    } else if (a == 'F' && b == 'L') {
+        tlc_fill_frame(_frame, read_uint16(payload));
+        _frames++;
+    } else if (a == 'Z' && b == 'N') {
+        tlc_fill_zone(_frame, payload, read_uint16(payload + ZONE_MASK_SIZE));
+        _frames++;
+    } else if (a == 'F' && b == 'D') {
+        // The last frame of the fade
+        tlc_fill_frame(_frame, read_uint16(payload + 2));
+        _frames++;
+    } else if (a == 'G' && b == 'D') {
+        tlc_gradient_frame(_frame, payload[0], read_uint16(payload + 1), read_uint16(payload + 3));
+        _frames++;
+    } else if (a == 'B' && b == 'C') {
+        for (int k = 0; k < 3; k++) {
+            _brightness[k] = payload[k] & BRIGHTNESS_CONTROL_MAX;
+            _maxCurrent[k] = payload[3 + k] > MAX_CURRENT_MAX ? MAX_CURRENT_MAX : payload[3 + k];
+        }
+    } else if (a == 'D' && b == 'C') {
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            _dotCorrection[i] = payload[i] & DOT_CORRECTION_MAX;
+        }
+        if (payload[TLC_FRAME_VALUE_COUNT]) {
+            std::memcpy(_storedDotCorrection, _dotCorrection, sizeof(_storedDotCorrection));
+        }
+    }
+
+    acknowledge(reply);
+}
+
+void TLCfirmwareEmulator::acknowledge(std::vector<uint8_t>& reply) {
+    if (!_flowControlEnabled && _timestampsEnabled) {
+        // Feedback: done, with the time it was done at for every stage, there being no time to take
+        uint32_t now = micros();
+        reply.push_back('D');
+        reply.push_back('T');
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            reply.push_back((uint8_t)(now >> shift));
+        }
+        reply.insert(reply.end(), TIMESTAMP_FEEDBACK_SIZE - 4, 0);
+        return;
+    }
+    if (!_flowControlEnabled) {
+        // Feedback: done
+        reply.push_back('D');
+        reply.push_back('N');
+        return;
+    }
+    // Batched, as in the sketch; receive() sends the rest when it runs out of input
+    if (++_acksPending >= TLC_CREDIT_ACK_BATCH) {
+        reply.push_back('A');
+        reply.push_back('K');
+        reply.push_back(_acksPending);
+        _acksPending = 0;
+    }
+}
+
+#ifndef _WIN32
+PtyBoard::PtyBoard(const char* link, int reboot_ms) : _link(link), _rebootMs(reboot_ms) {
+    open_port();
+}
+
+bool PtyBoard::open_port() {
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (_master == -1 || grantpt(_master) != 0 || unlockpt(_master) != 0) {
+        perror("PtyBoard:\n\tError: couldn't create a pseudo-terminal");
+        close_port();
+        return false;
+    }
+    _name = ptsname(_master);
+    _slave = open(_name.c_str(), O_RDWR | O_NOCTTY);
+
+    // Raw bytes both ways, like a USB serial port
+    struct termios options;
+    tcgetattr(_master, &options);
+    cfmakeraw(&options);
+    tcsetattr(_master, TCSANOW, &options);
+
+    unlink(_link.c_str());
+    if (symlink(_name.c_str(), _link.c_str()) != 0) {
+        perror("PtyBoard:\n\tError: couldn't create the port link");
+        close_port();
+        return false;
+    }
+    return true;
+}
+
+void PtyBoard::close_port() {
+    if (_master != -1) {
+        unlink(_link.c_str());
+        close(_slave);
+        close(_master);
+    }
+    _master = _slave = -1;
+}
+
+bool PtyBoard::serve(int timeout_ms) {
+    if (_master == -1) {
+        return false;
+    }
+    int disconnect_ms = _disconnectMs.exchange(0);
+    if (disconnect_ms > 0) {
+        // Whatever was on the way is lost with the port
+        close_port();
+        std::this_thread::sleep_for(std::chrono::milliseconds(disconnect_ms));
+        _disconnects++;
+        return open_port();
+    }
+    uint8_t buffer[4096];
+    struct pollfd fds = {_master, POLLIN, 0};
+    if (poll(&fds, 1, timeout_ms) > 0) {
+        ssize_t n = read(_master, buffer, sizeof(buffer));
+        if (n > 0) {
+            _reply.clear();
+            _board.receive(buffer, n, _reply);
+            if (!_reply.empty() && write(_master, _reply.data(), _reply.size()) != (ssize_t)_reply.size()) {
+                perror("PtyBoard:\n\tError: couldn't write the feedback");
+            }
+        }
+    }
+    if (_board.rebootRequested()) {
+        // The Teensy drops off USB while it reboots, the host waits for the port to come back
+        close_port();
+        std::this_thread::sleep_for(std::chrono::milliseconds(_rebootMs));
+        _reboots++;
+        return open_port();
+    }
+    return true;
+}
+
+void PtyBoard::start() {
+    _running = true;
+    _thread = std::thread([this] {
+        while (_running && serve(20)) {
+        }
+    });
+}
+
+void PtyBoard::stop() {
+    _running = false;
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+#endif
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_SIM_H
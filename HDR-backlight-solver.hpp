@@ -0,0 +1,372 @@
+/* Optimising backlight solver for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_SOLVER_H
+#define HDR_BACKLIGHT_SOLVER_H
+
+#include <cmath>      // std::exp, std::sqrt
+#include <vector>     // std::vector
+#include <algorithm>  // std::min, std::max
+#include <functional>  // std::function
+#include <thread>     // std::thread
+#include <mutex>      // std::mutex
+#include <condition_variable>  // std::condition_variable
+
+#include "HDR-backlight-video.hpp"  // GSFrame, LumaToLinear
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Runs a loop over [0, count) split across a fixed set of threads, the caller's included
+class WorkerPool {
+   public:
+    explicit WorkerPool(int threads);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    int threads() const {
+        return (int)_workers.size() + 1;
+    }
+    // Calls body(begin, end) on disjoint ranges covering [0, count), returns when all are done
+    void run(int count, const std::function<void(int, int)>& body);
+
+   private:
+    std::vector<std::thread> _workers;
+    std::mutex _lock;
+    std::condition_variable _start, _done;
+    const std::function<void(int, int)>* _body = nullptr;
+    int _count = 0;
+    unsigned long _generation = 0;
+    int _pending = 0;
+    bool _stop = false;
+
+    void range(int part, int& begin, int& end) const {
+        begin = (int)((long)_count * part / threads());
+        end = (int)((long)_count * (part + 1) / threads());
+    }
+};
+
+struct SolverOptions {
+    int cells_per_led = 4;        // The panel is modelled on a grid this much finer than the LEDs
+    float spread_sigma = 0.8f;    // Light spread of one LED, a Gaussian, in LED pitches
+    float spread_radius = 2.5f;   // Cut off beyond this many LED pitches
+    float power_weight = 0.01f;   // Cost of the mean LED level, against the mean squared clipping
+    float leak_weight = 0.1f;     // Cost of the mean squared light beyond the targets, which shows as halos
+    int iterations = 20;
+    int threads = 1;
+};
+
+// Picks the LED levels that minimise clipping plus power under a light-spread model:
+//     cost = mean over cells of (max(0, target - light)^2 + leak_weight * max(0, light - target)^2)
+//            + power_weight * mean LED level
+// where light = A * levels, and A, the spread of every LED over the cells, is computed once.
+// Each solve() runs a few accelerated projected-gradient steps, starting from the previous frame's levels,
+// so that a still picture converges over several frames and a changing one stays close.
+class BacklightSolver {
+   public:
+    explicit BacklightSolver(const SolverOptions& options = SolverOptions());
+
+    int cellsX() const {
+        return SCREEN_SIZE_X * _options.cells_per_led;
+    }
+    int cellsY() const {
+        return SCREEN_SIZE_Y * _options.cells_per_led;
+    }
+
+    // The light each cell needs, in [0, 1], cellsX() rows of cellsY()
+    // e.g. the peak of the pixels it covers, so that the LCD doesn't have to open beyond fully
+    void setTargets(const float* targets);
+
+    // Solve, and write the LED levels to out, as setLED() values
+    void solve(GSFrame& out);
+    // Start the next solve() from dark
+    void reset();
+
+    // The model, e.g. to evaluate other LED levels: light of every cell for levels in [0, 1] in frame order
+    void light(const float* levels, float* cell_light) const;
+    const std::vector<float>& levels() const {
+        return _levels;
+    }
+    double cost() const;
+
+   private:
+    SolverOptions _options;
+    int _cellCount;
+
+    // A in both orders, each in one array: per cell the LEDs reaching it, per LED the cells it reaches
+    // The entries of row i are [start[i], start[i + 1])
+    struct Entry {
+        int index;
+        float weight;
+    };
+    std::vector<Entry> _byCell, _byLed;
+    std::vector<int> _cellStart, _ledStart;
+    float _step;  // 1 / Lipschitz constant of the gradient
+
+    std::vector<float> _targets, _levels, _momentum, _residual, _probe;
+    mutable WorkerPool _pool;
+
+    void residual(const float* levels);
+};
+
+// Light each solver cell needs: the peak over the pixels it covers
+void peakCells(const uint8_t* luma, int width, int height, size_t stride, int bytes_per_sample, const LumaToLinear& to_linear,
+               int cells_x, int cells_y, float* targets);
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+WorkerPool::WorkerPool(int threads) {
+    for (int part = 1; part < threads; part++) {
+        _workers.emplace_back([this, part] {
+            unsigned long generation = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> guard(_lock);
+                    _start.wait(guard, [&] { return _stop || _generation != generation; });
+                    if (_stop) {
+                        return;
+                    }
+                    generation = _generation;
+                }
+                int begin, end;
+                range(part, begin, end);
+                (*_body)(begin, end);
+                std::lock_guard<std::mutex> guard(_lock);
+                if (--_pending == 0) {
+                    _done.notify_one();
+                }
+            }
+        });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+        _start.notify_all();
+    }
+    for (std::thread& worker : _workers) {
+        worker.join();
+    }
+}
+
+void WorkerPool::run(int count, const std::function<void(int, int)>& body) {
+    if (_workers.empty()) {
+        body(0, count);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _body = &body;
+        _count = count;
+        _pending = (int)_workers.size();
+        _generation++;
+        _start.notify_all();
+    }
+    int begin, end;
+    range(0, begin, end);
+    body(begin, end);
+    std::unique_lock<std::mutex> guard(_lock);
+    _done.wait(guard, [this] { return _pending == 0; });
+}
+
+BacklightSolver::BacklightSolver(const SolverOptions& options) : _options(options), _pool(std::max(1, options.threads)) {
+    const int per_led = std::max(1, _options.cells_per_led);
+    _options.cells_per_led = per_led;
+    _cellCount = cellsX() * cellsY();
+    std::vector<std::vector<Entry>> by_cell(_cellCount), by_led(TLC_FRAME_VALUE_COUNT);
+
+    // Gaussian spread around each LED, cut off at spread_radius
+    const float sigma = _options.spread_sigma * per_led;
+    const float radius = _options.spread_radius * per_led;
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            int led = tlc_frame_index(x, y);
+            float center_x = (x + 0.5f) * per_led, center_y = (y + 0.5f) * per_led;
+            for (int cx = std::max(0, (int)(center_x - radius)); cx < std::min(cellsX(), (int)(center_x + radius) + 1); cx++) {
+                for (int cy = std::max(0, (int)(center_y - radius)); cy < std::min(cellsY(), (int)(center_y + radius) + 1); cy++) {
+                    float dx = cx + 0.5f - center_x, dy = cy + 0.5f - center_y;
+                    float distance_squared = dx * dx + dy * dy;
+                    if (distance_squared <= radius * radius) {
+                        by_cell[cx * cellsY() + cy].push_back({led, std::exp(-distance_squared / (2 * sigma * sigma))});
+                    }
+                }
+            }
+        }
+    }
+    // Scaled so that all the LEDs at full light up the middle of the panel to 1
+    float middle = 0;
+    for (const Entry& entry : by_cell[(cellsX() / 2) * cellsY() + cellsY() / 2]) {
+        middle += entry.weight;
+    }
+    for (int cell = 0; cell < _cellCount; cell++) {
+        _cellStart.push_back((int)_byCell.size());
+        for (Entry& entry : by_cell[cell]) {
+            entry.weight /= middle;
+            _byCell.push_back(entry);
+            by_led[entry.index].push_back({cell, entry.weight});
+        }
+    }
+    _cellStart.push_back((int)_byCell.size());
+    for (int led = 0; led < TLC_FRAME_VALUE_COUNT; led++) {
+        _ledStart.push_back((int)_byLed.size());
+        _byLed.insert(_byLed.end(), by_led[led].begin(), by_led[led].end());
+    }
+    _ledStart.push_back((int)_byLed.size());
+
+    // The gradient of the clipping and leak terms is (2 / cells) * A^T * residual, so its Lipschitz constant
+    // is (2 / cells) * max(1, leak_weight) * |A|^2; power iteration on A^T A finds |A|^2
+    std::vector<float> v(TLC_FRAME_VALUE_COUNT, 1.0f), cell_light(_cellCount);
+    double norm_squared = 1;
+    for (int round = 0; round < 30; round++) {
+        light(v.data(), cell_light.data());
+        double length = 0;
+        for (int led = 0; led < TLC_FRAME_VALUE_COUNT; led++) {
+            float sum = 0;
+            for (int e = _ledStart[led]; e < _ledStart[led + 1]; e++) {
+                sum += _byLed[e].weight * cell_light[_byLed[e].index];
+            }
+            v[led] = sum;
+            length += (double)sum * sum;
+        }
+        length = std::sqrt(length);
+        norm_squared = length;  // |A^T A v| with |v| = 1
+        for (float& value : v) {
+            value = (float)(value / length);
+        }
+    }
+    _step = (float)(_cellCount / (2 * std::max(1.0f, _options.leak_weight) * norm_squared));
+
+    _targets.assign(_cellCount, 0);
+    _residual.assign(_cellCount, 0);
+    _levels.assign(TLC_FRAME_VALUE_COUNT, 0);
+    _momentum.assign(TLC_FRAME_VALUE_COUNT, 0);
+    _probe.assign(TLC_FRAME_VALUE_COUNT, 0);
+}
+
+void BacklightSolver::setTargets(const float* targets) {
+    _targets.assign(targets, targets + _cellCount);
+}
+
+void BacklightSolver::reset() {
+    std::fill(_levels.begin(), _levels.end(), 0.0f);
+}
+
+void BacklightSolver::light(const float* levels, float* cell_light) const {
+    _pool.run(_cellCount, [&](int begin, int end) {
+        for (int cell = begin; cell < end; cell++) {
+            float sum = 0;
+            for (int e = _cellStart[cell]; e < _cellStart[cell + 1]; e++) {
+                sum += _byCell[e].weight * levels[_byCell[e].index];
+            }
+            cell_light[cell] = sum;
+        }
+    });
+}
+
+void BacklightSolver::residual(const float* levels) {
+    // How far each cell falls short of its target, or, weighed by leak_weight, goes beyond it
+    const float leak = _options.leak_weight;
+    _pool.run(_cellCount, [&](int begin, int end) {
+        for (int cell = begin; cell < end; cell++) {
+            float sum = 0;
+            for (int e = _cellStart[cell]; e < _cellStart[cell + 1]; e++) {
+                sum += _byCell[e].weight * levels[_byCell[e].index];
+            }
+            float shortfall = _targets[cell] - sum;
+            _residual[cell] = shortfall > 0 ? shortfall : leak * shortfall;
+        }
+    });
+}
+
+void BacklightSolver::solve(GSFrame& out) {
+    // FISTA: the gradient is taken at a point ahead of the levels, along the last step
+    _momentum = _levels;
+    float t = 1;
+    const float clipping_scale = 2.0f / _cellCount;
+    const float power_gradient = _options.power_weight / TLC_FRAME_VALUE_COUNT;
+    for (int iteration = 0; iteration < _options.iterations; iteration++) {
+        residual(_momentum.data());
+        _pool.run(TLC_FRAME_VALUE_COUNT, [&](int begin, int end) {
+            for (int led = begin; led < end; led++) {
+                float sum = 0;
+                for (int e = _ledStart[led]; e < _ledStart[led + 1]; e++) {
+                    sum += _byLed[e].weight * _residual[_byLed[e].index];
+                }
+                float gradient = power_gradient - clipping_scale * sum;
+                _probe[led] = std::min(1.0f, std::max(0.0f, _momentum[led] - _step * gradient));  // Projected onto [0, 1]
+            }
+        });
+        float t_next = (1 + std::sqrt(1 + 4 * t * t)) / 2;
+        for (int led = 0; led < TLC_FRAME_VALUE_COUNT; led++) {
+            float previous = _levels[led];
+            _levels[led] = _probe[led];
+            _momentum[led] = std::min(1.0f, std::max(0.0f, _probe[led] + (t - 1) / t_next * (_probe[led] - previous)));
+        }
+        t = t_next;
+    }
+
+    uint16_t* values = &out.gs[0][0][0];
+    for (int led = 0; led < TLC_FRAME_VALUE_COUNT; led++) {
+        values[led] = (uint16_t)std::lround(_levels[led] * 0xFFFF);
+    }
+}
+
+double BacklightSolver::cost() const {
+    std::vector<float> cell_light(_cellCount);
+    light(_levels.data(), cell_light.data());
+    double clipping = 0, power = 0;
+    for (int cell = 0; cell < _cellCount; cell++) {
+        double shortfall = _targets[cell] - cell_light[cell];
+        clipping += shortfall * shortfall * (shortfall > 0 ? 1 : _options.leak_weight);
+    }
+    for (float level : _levels) {
+        power += level;
+    }
+    return clipping / _cellCount + _options.power_weight * power / TLC_FRAME_VALUE_COUNT;
+}
+
+void peakCells(const uint8_t* luma, int width, int height, size_t stride, int bytes_per_sample, const LumaToLinear& to_linear,
+               int cells_x, int cells_y, float* targets) {
+    for (int cx = 0; cx < cells_x; cx++) {
+        for (int cy = 0; cy < cells_y; cy++) {
+            float peak = 0;
+            for (int row = (int)((long)height * cx / cells_x); row < (long)height * (cx + 1) / cells_x; row++) {
+                const uint8_t* line = luma + row * stride;
+                for (int column = (int)((long)width * cy / cells_y); column < (long)width * (cy + 1) / cells_y; column++) {
+                    uint16_t code = bytes_per_sample == 1 ? line[column] : (uint16_t)(line[2 * column] | line[2 * column + 1] << 8);
+                    peak = std::max(peak, to_linear[code]);
+                }
+            }
+            targets[cx * cells_y + cy] = peak;
+        }
+    }
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_SOLVER_H
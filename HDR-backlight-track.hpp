@@ -0,0 +1,389 @@
+/* Binary backlight tracks for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_TRACK_H
+#define HDR_BACKLIGHT_TRACK_H
+
+#include <iostream>   // std::cerr, std::endl
+#include <cstdio>     // FILE, fopen(), fwrite()
+#include <cstring>    // std::memcpy, std::memcmp
+#include <vector>     // std::vector
+#include <algorithm>  // std::upper_bound
+
+#ifdef _WIN32
+#include <fstream>  // std::ifstream
+#else
+#include <fcntl.h>     // open()
+#include <unistd.h>    // close()
+#include <sys/mman.h>  // mmap()
+#include <sys/stat.h>  // fstat()
+#endif
+
+#include "HDR-backlight-driver.hpp"  // GSFrame
+
+// A track is a precomputed sequence of frames, played back at a fixed rate:
+//     TrackHeader
+//     Frame records, one per frame:
+//         TRACK_FRAME_KEY, followed by TLC_FRAME_VALUE_COUNT 16-bit values (higher byte first),
+//             the payload of a 'G', 'O' command
+//         TRACK_FRAME_DELTA, followed by 1 byte run count and the runs of values changed
+//             since the previous frame: 1 byte values skipped, 1 byte run length, the values
+//             A frame equal to the previous one is a delta with no runs, two bytes
+//     Index, one TrackIndexEntry per key frame, aligned to 8 bytes
+// There is a key frame at least every keyframe_interval frames, so seek() decodes at most that many records.
+// The header and the index are stored in the host's byte order, which is checked with the version.
+#define TRACK_MAGIC "HBLT"
+#define TRACK_VERSION 1
+#define TRACK_FRAME_KEY 'K'
+#define TRACK_FRAME_DELTA 'D'
+#define TRACK_FRAME_BYTES (TLC_FRAME_VALUE_COUNT * 2)
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+struct TrackHeader {
+    char magic[4];
+    uint16_t version;
+    uint8_t size_x;  // SCREEN_SIZE_X
+    uint8_t size_y;  // SCREEN_SIZE_Y
+    uint32_t value_count;  // TLC_FRAME_VALUE_COUNT
+    uint32_t keyframe_interval;
+    double fps;
+    uint64_t frame_count;
+    uint64_t index_offset;
+    uint64_t index_count;
+};
+
+struct TrackIndexEntry {
+    uint64_t frame;
+    uint64_t offset;  // Of the frame record, from the start of the file
+};
+
+// Writes a track frame by frame; the index and the header are written by close()
+class TrackWriter {
+   public:
+    TrackWriter(const char* path, double fps, uint32_t keyframe_interval = 120);
+    ~TrackWriter() {
+        close();
+    }
+    TrackWriter(const TrackWriter&) = delete;
+    TrackWriter& operator=(const TrackWriter&) = delete;
+
+    bool isOpen() const {
+        return _file != nullptr;
+    }
+    // The frame is stored as it is, without calibration, like updateFrame(const GSFrame&) sends it
+    bool append(const GSFrame& frame);
+    bool close();
+
+   private:
+    FILE* _file = nullptr;
+    TrackHeader _header = {};
+    uint64_t _offset = 0;  // Bytes written so far
+    std::vector<TrackIndexEntry> _index;
+    uint8_t _previous[TRACK_FRAME_BYTES];
+    uint8_t _record[1 + 1 + TLC_FRAME_VALUE_COUNT * 4];  // Worst case delta, one run per value
+    bool _ok = true;
+
+    bool write(const void* data, size_t size);
+};
+
+// Maps a track into memory; opening costs the same for a few seconds and for hours of frames.
+// next() hands out frames in wire order, ready for TLCdriver::updateFrameWire()
+class TrackReader {
+   public:
+    explicit TrackReader(const char* path);
+    ~TrackReader();
+    TrackReader(const TrackReader&) = delete;
+    TrackReader& operator=(const TrackReader&) = delete;
+
+    bool isOpen() const {
+        return _data != nullptr;
+    }
+    double fps() const {
+        return _header.fps;
+    }
+    uint64_t frameCount() const {
+        return _header.frame_count;
+    }
+    // Number of the frame the next call to next() returns
+    uint64_t position() const {
+        return _position;
+    }
+
+    // Move to any frame, returns false if it is past the end
+    bool seek(uint64_t frame);
+    // The next frame, TRACK_FRAME_BYTES bytes valid until the next call; nullptr at the end or on a corrupt record
+    const uint8_t* next();
+
+   private:
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+    TrackHeader _header = {};
+    const TrackIndexEntry* _index = nullptr;
+    uint64_t _position = 0;
+    uint64_t _offset = 0;  // Of the next record
+    uint8_t _frame[TRACK_FRAME_BYTES] = {0};
+#ifdef _WIN32
+    std::vector<uint8_t> _contents;
+#endif
+
+    bool fail(const char* message);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+TrackWriter::TrackWriter(const char* path, double fps, uint32_t keyframe_interval) {
+    _file = fopen(path, "wb");
+    if (_file == nullptr) {
+        perror("TrackWriter::TrackWriter():\n\tError");
+        return;
+    }
+    std::memcpy(_header.magic, TRACK_MAGIC, 4);
+    _header.version = TRACK_VERSION;
+    _header.size_x = SCREEN_SIZE_X;
+    _header.size_y = SCREEN_SIZE_Y;
+    _header.value_count = TLC_FRAME_VALUE_COUNT;
+    _header.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+    _header.fps = fps;
+    // Placeholder until close() knows the frame count and where the index is
+    write(&_header, sizeof(_header));
+}
+
+bool TrackWriter::append(const GSFrame& frame) {
+    if (_file == nullptr) {
+        return false;
+    }
+    uint8_t wire[TRACK_FRAME_BYTES];
+    const uint16_t* values = &frame.gs[0][0][0];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        wire[2 * i] = (uint8_t)(values[i] >> 8);  // The higher byte first, as on the serial link
+        wire[2 * i + 1] = (uint8_t)values[i];
+    }
+
+    // Runs of changed values; a single unchanged value between two runs is cheaper copied than skipped
+    size_t size = 2;
+    int runs = 0;
+    int i = 0;
+    bool keyframe = _header.frame_count % _header.keyframe_interval == 0;
+    while (!keyframe && i < TLC_FRAME_VALUE_COUNT) {
+        int start = i;
+        while (start < TLC_FRAME_VALUE_COUNT && std::memcmp(&wire[2 * start], &_previous[2 * start], 2) == 0) {
+            start++;
+        }
+        if (start == TLC_FRAME_VALUE_COUNT) {
+            break;
+        }
+        int end = start + 1;
+        while (end < TLC_FRAME_VALUE_COUNT &&
+               (std::memcmp(&wire[2 * end], &_previous[2 * end], 2) != 0 ||
+                (end + 1 < TLC_FRAME_VALUE_COUNT && std::memcmp(&wire[2 * end + 2], &_previous[2 * end + 2], 2) != 0))) {
+            end++;
+        }
+        _record[size++] = (uint8_t)(start - i);
+        _record[size++] = (uint8_t)(end - start);
+        std::memcpy(&_record[size], &wire[2 * start], 2 * (end - start));
+        size += 2 * (end - start);
+        runs++;
+        i = end;
+    }
+    if (keyframe || size >= 1 + TRACK_FRAME_BYTES) {
+        _index.push_back({_header.frame_count, _offset});
+        _record[0] = TRACK_FRAME_KEY;
+        std::memcpy(&_record[1], wire, TRACK_FRAME_BYTES);
+        size = 1 + TRACK_FRAME_BYTES;
+    } else {
+        _record[0] = TRACK_FRAME_DELTA;
+        _record[1] = (uint8_t)runs;
+    }
+    std::memcpy(_previous, wire, TRACK_FRAME_BYTES);
+    _header.frame_count++;
+    return write(_record, size);
+}
+
+bool TrackWriter::close() {
+    if (_file == nullptr) {
+        return _ok;
+    }
+    // Aligned, so that the reader can use the index in place
+    const uint8_t padding[alignof(TrackIndexEntry)] = {0};
+    write(padding, (alignof(TrackIndexEntry) - _offset % alignof(TrackIndexEntry)) % alignof(TrackIndexEntry));
+    _header.index_offset = _offset;
+    _header.index_count = _index.size();
+    write(_index.data(), _index.size() * sizeof(TrackIndexEntry));
+    if (fseek(_file, 0, SEEK_SET) != 0 || fwrite(&_header, sizeof(_header), 1, _file) != 1) {
+        _ok = false;
+    }
+    if (fclose(_file) != 0) {
+        _ok = false;
+    }
+    _file = nullptr;
+    if (!_ok) {
+        std::cerr << "TrackWriter::close():\n\tError: couldn't write the track" << std::endl;
+    }
+    return _ok;
+}
+
+bool TrackWriter::write(const void* data, size_t size) {
+    if (size > 0 && fwrite(data, size, 1, _file) != 1) {
+        _ok = false;
+    }
+    _offset += size;
+    return _ok;
+}
+
+TrackReader::TrackReader(const char* path) {
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary);
+    _contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (_contents.empty()) {
+        std::cerr << "TrackReader::TrackReader():\n\tError: couldn't read " << path << std::endl;
+        return;
+    }
+    _data = _contents.data();
+    _size = _contents.size();
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) != 0) {
+        perror("TrackReader::TrackReader():\n\tError");
+        if (fd != -1) {
+            ::close(fd);
+        }
+        return;
+    }
+    _size = file_stat.st_size;
+    void* data = _size > 0 ? mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);  // The mapping stays valid
+    if (data == MAP_FAILED) {
+        perror("TrackReader::TrackReader():\n\tError");
+        return;
+    }
+    // Played from start to end, let the kernel read ahead
+    madvise(data, _size, MADV_SEQUENTIAL);
+    _data = (const uint8_t*)data;
+#endif
+
+    if (_size < sizeof(TrackHeader)) {
+        fail("not a track");
+        return;
+    }
+    std::memcpy(&_header, _data, sizeof(TrackHeader));
+    if (std::memcmp(_header.magic, TRACK_MAGIC, 4) != 0 || _header.version != TRACK_VERSION) {
+        fail("not a track, or a different version");
+        return;
+    }
+    if (_header.size_x != SCREEN_SIZE_X || _header.size_y != SCREEN_SIZE_Y || _header.value_count != TLC_FRAME_VALUE_COUNT) {
+        fail("the track is for a different screen");
+        return;
+    }
+    if (_header.index_offset > _size || _header.index_count > (_size - _header.index_offset) / sizeof(TrackIndexEntry) ||
+        _header.index_offset % alignof(TrackIndexEntry) != 0) {
+        fail("the index is corrupt");
+        return;
+    }
+    _index = (const TrackIndexEntry*)(_data + _header.index_offset);
+    _offset = sizeof(TrackHeader);
+}
+
+TrackReader::~TrackReader() {
+#ifndef _WIN32
+    if (_data != nullptr) {
+        munmap((void*)_data, _size);
+    }
+#endif
+}
+
+bool TrackReader::fail(const char* message) {
+    std::cerr << "TrackReader:\n\tError: " << message << std::endl;
+#ifndef _WIN32
+    if (_data != nullptr) {
+        munmap((void*)_data, _size);
+    }
+#endif
+    _data = nullptr;
+    return false;
+}
+
+bool TrackReader::seek(uint64_t frame) {
+    if (_data == nullptr || frame >= _header.frame_count || _header.index_count == 0) {
+        return false;
+    }
+    // The last key frame at or before the frame, then the deltas up to it
+    const TrackIndexEntry* key = std::upper_bound(_index, _index + _header.index_count, frame,
+                                                  [](uint64_t f, const TrackIndexEntry& entry) { return f < entry.frame; }) - 1;
+    _position = key->frame;
+    _offset = key->offset;
+    while (_position < frame) {
+        if (next() == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const uint8_t* TrackReader::next() {
+    if (_data == nullptr || _position >= _header.frame_count) {
+        return nullptr;
+    }
+    const uint8_t* end = _data + _header.index_offset;
+    const uint8_t* record = _data + _offset;
+    if (record + 2 > end) {
+        return nullptr;
+    }
+    if (record[0] == TRACK_FRAME_KEY) {
+        if (record + 1 + TRACK_FRAME_BYTES > end) {
+            return nullptr;
+        }
+        std::memcpy(_frame, record + 1, TRACK_FRAME_BYTES);
+        record += 1 + TRACK_FRAME_BYTES;
+    } else if (record[0] == TRACK_FRAME_DELTA) {
+        int runs = record[1];
+        record += 2;
+        int value = 0;
+        for (int run = 0; run < runs; run++) {
+            if (record + 2 > end) {
+                return nullptr;
+            }
+            value += record[0];
+            int length = record[1];
+            if (value + length > TLC_FRAME_VALUE_COUNT || record + 2 + 2 * length > end) {
+                return nullptr;
+            }
+            std::memcpy(&_frame[2 * value], record + 2, 2 * length);
+            value += length;
+            record += 2 + 2 * length;
+        }
+    } else {
+        return nullptr;
+    }
+    _offset = record - _data;
+    _position++;
+    return _frame;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_TRACK_H
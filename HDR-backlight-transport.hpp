@@ -0,0 +1,589 @@
+/* Transports between the HDR backlight driver library and the Teensy
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_TRANSPORT_H
+#define HDR_BACKLIGHT_TRANSPORT_H
+
+#include <iostream>  // std::cerr, std::clog, std::endl
+#include <cstdio>    // FILE, fopen(), fwrite()
+#include <ctime>     // clock()
+#include <vector>    // std::vector
+#include <chrono>    // std::chrono::steady_clock
+#include <thread>    // std::this_thread::sleep_for()
+#include <deque>     // std::deque
+#include <cstdint>   // uint64_t
+#include <cstdlib>   // atof()
+#include <algorithm>  // std::max
+
+#if defined(__MINGW32__) || defined(_WIN32)
+#define USING_SERIAL_WINDOWS_LIBRARY
+// use the library for Windows
+#include "serialWindows/serialWindows.cpp"
+
+//*****************************************************
+// Change the default serial port name here (for Windows)
+// Note that if the port number is larger than 9, e.g. COM10,
+// "\\\\.\\COM10" has to be used.
+// "COM10" won't work. (Well, it's Windows)
+#define DEFAULT_SERIAL_PORT "\\\\.\\COM4"
+//*****************************************************
+
+#else
+
+#include "arduino-serial/arduino-serial-lib.c"
+#define INVALID_HANDLE_VALUE -1
+
+#include <fcntl.h>    // open()
+#include <unistd.h>   // read(), write(), access()
+#include <poll.h>     // poll()
+#include <termios.h>  // cfmakeraw()
+#include <cerrno>     // errno
+
+//*****************************************************
+// Change the default serial port name here (for Mac OS X / Linux)
+#define DEFAULT_SERIAL_PORT "/dev/cu.usbmodem3355431"
+//*****************************************************
+
+#endif
+
+// The firmware emulator behind the loopback and capture transports
+#include "HDR-backlight-sim.hpp"
+
+// A transport carries the bytes between BasicTLCdriver and the Teensy. The driver calls it directly,
+// so a transport is any class with these members, no base class and no virtual functions:
+//     bool open(const char* port, int baud)    Connect; false, with a message, if it can't
+//     void close()
+//     bool isOpen() const
+//     bool write(const uint8_t* data, int size)  All the bytes, or false
+//     int readByte(int timeout_ms)             The next byte from the Teensy, -1 on error, -2 on timeout
+//     bool reboot(const char* port, int baud)  Send 'R', 'T' and reconnect once the Teensy is back
+//     handle() const                           The file descriptor or HANDLE, for get_fd()
+// The driver times the link with linkClockUs(), steady_clock unless a transport has a clock of its own
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// The Teensy's USB serial port, through arduino-serial-lib (termios) or serialWindows
+class SerialTransport
+#ifdef USING_SERIAL_WINDOWS_LIBRARY
+    // Use the same function signatures as arduino-serial-lib
+    : private SerialPortWindows
+#endif
+{
+   public:
+    ~SerialTransport() {
+        close();
+    }
+
+    bool open(const char* port, int baud) {
+        _fd = serialport_init(port, baud);
+        return _fd != INVALID_HANDLE_VALUE;
+    }
+    void close() {
+        if (_fd != INVALID_HANDLE_VALUE) {
+            serialport_close(_fd);
+            _fd = INVALID_HANDLE_VALUE;
+        }
+    }
+    bool isOpen() const {
+        return _fd != INVALID_HANDLE_VALUE;
+    }
+    bool write(const uint8_t* data, int size) {
+#ifdef USING_SERIAL_WINDOWS_LIBRARY
+        return serialport_writeBuffer(_fd, data, size);
+#else
+        return serialport_writeBuffer(_fd, data, size) == 0;
+#endif
+    }
+    int readByte(int timeout_ms) {
+        return serialport_readByte(_fd, timeout_ms);
+    }
+    // The Teensy drops off USB while it reboots: at least one attempt to reopen the port must fail
+    bool reboot(const char* port, int baud);
+    auto handle() const {  // The types are different on Windows and POSIX systems
+        return _fd;
+    }
+
+   private:
+#ifdef USING_SERIAL_WINDOWS_LIBRARY
+    HANDLE _fd = INVALID_HANDLE_VALUE;
+#else
+    int _fd = INVALID_HANDLE_VALUE;
+#endif
+};
+
+#ifndef USING_SERIAL_WINDOWS_LIBRARY
+// After 'R', 'T': wait for the port to go, then for it to come back, so that the old one isn't opened again
+bool waitForPortReboot(const char* port);
+
+// A pseudo-terminal, e.g. the one simboard links from /tmp/tlc-sim. No baud rate, and readByte()
+// sleeps in poll() until the answer arrives, rather than checking every millisecond
+class PtyTransport {
+   public:
+    ~PtyTransport() {
+        close();
+    }
+
+    bool open(const char* port, int baud);
+    void close() {
+        if (_fd != -1) {
+            ::close(_fd);
+            _fd = -1;
+        }
+        _readStart = _readEnd = 0;
+    }
+    bool isOpen() const {
+        return _fd != -1;
+    }
+    bool write(const uint8_t* data, int size);
+    int readByte(int timeout_ms);
+    // The other end goes away and comes back, like simboard does
+    bool reboot(const char* port, int baud);
+    int handle() const {
+        return _fd;
+    }
+
+   private:
+    int _fd = -1;
+    uint8_t _readBuffer[256];  // Read in chunks, handed out a byte at a time
+    int _readStart = 0, _readEnd = 0;
+};
+#endif
+
+// The firmware in memory: TLCfirmwareEmulator parses the bytes and answers like the sketch.
+// No system calls, so benchmarks through it measure the host side alone
+class LoopbackTransport {
+   public:
+    LoopbackTransport() {
+        _reply.reserve(64);  // Nothing allocated per frame
+    }
+
+    bool open(const char*, int) {
+        _open = true;
+        return true;
+    }
+    void close() {
+        _open = false;
+    }
+    bool isOpen() const {
+        return _open;
+    }
+    bool write(const uint8_t* data, int size);
+    int readByte(int) {  // Answers are there at once, or never
+        if (_replyStart < _reply.size()) {
+            return _reply[_replyStart++];
+        }
+        _reply.clear();
+        _replyStart = 0;
+        return _open ? -2 : -1;
+    }
+    bool reboot(const char* port, int baud) {
+        const uint8_t command[2] = {'R', 'T'};
+        return write(command, 2) && open(port, baud);
+    }
+    int handle() const {
+        return -1;
+    }
+
+    // The emulated Teensy, to check what it received
+    const TLCfirmwareEmulator& board() const {
+        return _board;
+    }
+
+   private:
+    TLCfirmwareEmulator _board;
+    std::vector<uint8_t> _reply;
+    size_t _replyStart = 0;
+    bool _open = false;
+};
+
+// Appends every byte sent to a file, the port name being its path, exactly as it would go over the wire,
+// e.g. to replay into a port later or to compare the output of two builds. The answers come from a loopback
+class CaptureTransport {
+   public:
+    ~CaptureTransport() {
+        close();
+    }
+
+    bool open(const char* path, int baud);
+    void close();
+    bool isOpen() const {
+        return _file != nullptr;
+    }
+    bool write(const uint8_t* data, int size) {
+        return _file != nullptr && fwrite(data, 1, size, _file) == (size_t)size && _loopback.write(data, size);
+    }
+    int readByte(int timeout_ms) {
+        return _loopback.readByte(timeout_ms);
+    }
+    // The reboot command is captured too; the file stays open
+    bool reboot(const char* port, int baud) {
+        const uint8_t command[2] = {'R', 'T'};
+        return write(command, 2) && _loopback.open(port, baud);
+    }
+    int handle() const {
+        return _file != nullptr ? fileno(_file) : -1;
+    }
+
+    const TLCfirmwareEmulator& board() const {
+        return _loopback.board();
+    }
+
+   private:
+    FILE* _file = nullptr;
+    LoopbackTransport _loopback;
+};
+
+// USB full speed: 12 Mbit/s, and at most 19 bulk packets of 64 bytes per 1 ms frame,
+// the rest going to the token, handshake and gaps of every packet. Each write ends with a short packet
+#define SIMULATED_LINK_BYTE_US (8.0 / 12)
+#define SIMULATED_LINK_PACKET_US (1000.0 / 19 - TLC_USB_PACKET_SIZE * SIMULATED_LINK_BYTE_US)
+// Time the Teensy takes to execute a command, mostly shifting a frame out to the TLC5955s
+#define SIMULATED_LINK_COMMAND_US 100.0
+
+// The emulated Teensy at the end of a link with a round trip time, the port name in microseconds, e.g. "1000".
+// Time is simulated, not waited for: every byte takes SIMULATED_LINK_BYTE_US on the wire, each way,
+// and every USB packet SIMULATED_LINK_PACKET_US more,
+// every command SIMULATED_LINK_COMMAND_US on the board, one after the other, and readByte() moves the clock
+// on to the answer, or by the timeout. For benchmarks of the protocol rather than of the host.
+// setFaults() makes it a bad link, the same one on every run
+class SimulatedLinkTransport {
+   public:
+    bool open(const char* port, int) {
+        _rttUs = std::max(0.0, atof(port));
+        _open = true;
+        return true;
+    }
+    void close() {
+        _open = false;
+    }
+    bool isOpen() const {
+        return _open;
+    }
+    bool write(const uint8_t* data, int size);
+    int readByte(int timeout_ms);
+    bool reboot(const char* port, int baud) {
+        const uint8_t command[2] = {'R', 'T'};
+        return write(command, 2) && open(port, baud);
+    }
+    int handle() const {
+        return -1;
+    }
+
+    // Simulated time since open(), in microseconds
+    double elapsedUs() const {
+        return _now;
+    }
+    // Most commands sent and not executed yet at any one time
+    size_t maxInFlight() const {
+        return _maxInFlight;
+    }
+    // Calls to write(), and the USB packets they took
+    unsigned long writes() const {
+        return _writes;
+    }
+    unsigned long packets() const {
+        return _packets;
+    }
+    const TLCfirmwareEmulator& board() const {
+        return _board;
+    }
+
+    // Each write is lost with probability loss and each answer has a byte flipped with probability corruption,
+    // answers take extra_rtt_us more. All 0 is a clean link
+    void setFaults(double loss, double corruption, double extra_rtt_us = 0) {
+        _loss = loss;
+        _corruption = corruption;
+        _extraRttUs = extra_rtt_us;
+    }
+    // The host waits until us of simulated time, as if it slept
+    void advance(double us) {
+        _now = std::max(_now, us);
+    }
+
+   private:
+    TLCfirmwareEmulator _board;
+    bool _open = false;
+    double _rttUs = 0;
+    double _loss = 0, _corruption = 0, _extraRttUs = 0;
+    uint64_t _random = 0x9E3779B97F4A7C15ull;
+    double random_uniform() {  // xorshift64, in [0, 1)
+        _random ^= _random << 13;
+        _random ^= _random >> 7;
+        _random ^= _random << 17;
+        return (_random >> 11) * (1.0 / 9007199254740992.0);
+    }
+    double _now = 0;             // The host's clock
+    double _wireFree = 0;        // When the last byte sent has left the host
+    double _boardFree = 0;       // When the Teensy is done with the last command sent
+    double _replyArrival = 0;    // When the last answer has reached the host
+    std::deque<double> _inFlight;  // When the commands not executed yet will be
+    size_t _maxInFlight = 0;
+    unsigned long _writes = 0, _packets = 0;
+    static double wire_us(size_t size) {
+        return size * SIMULATED_LINK_BYTE_US + (size + TLC_USB_PACKET_SIZE - 1) / TLC_USB_PACKET_SIZE * SIMULATED_LINK_PACKET_US;
+    }
+    std::vector<uint8_t> _reply;
+    std::deque<double> _replyTimes;  // Arrival of each byte of _reply not read yet
+    size_t _replyStart = 0;
+};
+
+// The host's clock as the driver sees it, in microseconds
+template <class Transport>
+double linkClockUs(const Transport&) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline double linkClockUs(const SimulatedLinkTransport& link) {
+    return link.elapsedUs();
+}
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+bool SerialTransport::reboot(const char* port, int baud) {
+    // Tell teensy to reset
+    serialport_writebyte(_fd, 'R');
+    serialport_writebyte(_fd, 'T');
+
+    std::clog << "Resetting Teensy..." << std::endl;
+
+    close();
+
+    int connect_count = 0;
+    while (1) {
+        clock_t timer_start = clock();
+        while (clock() - timer_start < 0.1 * CLOCKS_PER_SEC)
+            // Wait 0.1s before reconnecting
+            ;
+
+        open(port, baud);
+        connect_count++;
+        if (isOpen()) {
+            if (connect_count > 1) {
+                // Expected at least one reconnection attempt
+                break;
+            } else {
+                std::clog << "\n\nReboot failed. Please reconnect the cable and retry." << std::endl;
+                return false;
+            }
+        } else {
+            std::clog << "\n\nTeensy still rebooting..." << std::endl;
+        }
+    }
+
+    std::clog << "\n\nThe error messages above are expected.\n";
+    std::clog << "Reboot complete!" << std::endl;
+    return true;
+}
+
+#ifndef USING_SERIAL_WINDOWS_LIBRARY
+bool PtyTransport::open(const char* port, int) {
+    _fd = ::open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (_fd == -1) {
+        perror("PtyTransport::open():\n\tError");
+        return false;
+    }
+    struct termios options;
+    if (tcgetattr(_fd, &options) == 0) {
+        cfmakeraw(&options);
+        tcsetattr(_fd, TCSANOW, &options);
+    }
+    _readStart = _readEnd = 0;
+    return true;
+}
+
+bool PtyTransport::write(const uint8_t* data, int size) {
+    while (size > 0) {
+        ssize_t n = ::write(_fd, data, size);
+        if (n > 0) {
+            data += n;
+            size -= n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd fds = {_fd, POLLOUT, 0};
+            poll(&fds, 1, 100);
+        } else if (!(n == -1 && errno == EINTR)) {
+            perror("PtyTransport::write():\n\tError");
+            return false;
+        }
+    }
+    return true;
+}
+
+int PtyTransport::readByte(int timeout_ms) {
+    if (_readStart < _readEnd) {
+        return _readBuffer[_readStart++];
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (1) {
+        ssize_t n = read(_fd, _readBuffer, sizeof(_readBuffer));
+        if (n > 0) {
+            _readStart = 1;
+            _readEnd = (int)n;
+            return _readBuffer[0];
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return -1;  // End of file: the other end hung up
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) {
+            return -2;
+        }
+        struct pollfd fds = {_fd, POLLIN, 0};
+        if (poll(&fds, 1, (int)left + 1) == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+bool PtyTransport::reboot(const char* port, int baud) {
+    const uint8_t command[2] = {'R', 'T'};
+    if (!write(command, 2)) {
+        return false;
+    }
+    std::clog << "Resetting Teensy..." << std::endl;
+    close();
+    if (!waitForPortReboot(port) || !open(port, baud)) {
+        return false;
+    }
+    std::clog << "Reboot complete!" << std::endl;
+    return true;
+}
+
+bool waitForPortReboot(const char* port) {
+    auto start = std::chrono::steady_clock::now();
+    while (access(port, F_OK) == 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    while (access(port, F_OK) != 0) {
+        if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10)) {
+            std::cerr << "waitForPortReboot():\n\tError: " << port << " didn't come back" << std::endl;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+#endif
+
+bool LoopbackTransport::write(const uint8_t* data, int size) {
+    if (!_open) {
+        return false;
+    }
+    _board.receive(data, size, _reply);
+    if (_board.rebootRequested()) {
+        // The port goes away with the answers not read yet
+        _reply.clear();
+        _replyStart = 0;
+        _open = false;
+    }
+    return true;
+}
+
+bool SimulatedLinkTransport::write(const uint8_t* data, int size) {
+    if (!_open) {
+        return false;
+    }
+    // The bytes go out behind those sent before, then take half a round trip to the board
+    _writes++;
+    _packets += (size + TLC_USB_PACKET_SIZE - 1) / TLC_USB_PACKET_SIZE;
+    _wireFree = std::max(_now, _wireFree) + wire_us(size);
+    double arrival = _wireFree + _rttUs / 2;
+    if (_loss > 0 && random_uniform() < _loss) {
+        return true;  // Gone on the way
+    }
+
+    unsigned long commands = _board.commands(), frames = _board.frames();
+    size_t reply_size = _reply.size();
+    _board.receive(data, size, _reply);
+    if (_board.rebootRequested()) {
+        _reply.clear();
+        _replyTimes.clear();
+        _replyStart = 0;
+        _inFlight.clear();
+        _open = false;
+        return true;
+    }
+    unsigned long executed = _board.commands() - commands;
+    if (executed > 0) {
+        // SIMULATED_LINK_COMMAND_US per command, or per frame for a batch
+        unsigned long steps = std::max(executed, _board.frames() - frames);
+        _boardFree = std::max(arrival, _boardFree) + steps * SIMULATED_LINK_COMMAND_US;
+        _inFlight.insert(_inFlight.end(), executed, _boardFree);
+    }
+    while (!_inFlight.empty() && _inFlight.front() <= _now) {
+        _inFlight.pop_front();
+    }
+    _maxInFlight = std::max(_maxInFlight, _inFlight.size());
+
+    // The answers come back half a round trip after the last command that was executed
+    if (_reply.size() > reply_size) {
+        if (_corruption > 0 && random_uniform() < _corruption) {
+            _reply[reply_size + (size_t)(random_uniform() * (_reply.size() - reply_size))] ^= 0x5A;
+        }
+        _replyArrival = std::max(_replyArrival, _boardFree + _rttUs / 2 + _extraRttUs) + wire_us(_reply.size() - reply_size);
+        _replyTimes.insert(_replyTimes.end(), _reply.size() - reply_size, _replyArrival);
+    }
+    return true;
+}
+
+int SimulatedLinkTransport::readByte(int timeout_ms) {
+    if (!_open) {
+        return -1;
+    }
+    if (_replyStart == _reply.size() || _replyTimes.front() > _now + timeout_ms * 1000.0) {
+        _now += timeout_ms * 1000.0;
+        return -2;
+    }
+    _now = std::max(_now, _replyTimes.front());
+    _replyTimes.pop_front();
+    int b = _reply[_replyStart++];
+    if (_replyStart == _reply.size()) {
+        _reply.clear();
+        _replyStart = 0;
+    }
+    return b;
+}
+
+bool CaptureTransport::open(const char* path, int baud) {
+    _file = fopen(path, "wb");
+    if (_file == nullptr) {
+        perror("CaptureTransport::open():\n\tError");
+        return false;
+    }
+    return _loopback.open(path, baud);
+}
+
+void CaptureTransport::close() {
+    if (_file != nullptr) {
+        if (fclose(_file) != 0) {
+            perror("CaptureTransport::close():\n\tError");
+        }
+        _file = nullptr;
+    }
+    _loopback.close();
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_TRANSPORT_H
@@ -0,0 +1,472 @@
+/* io_uring transport for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_URING_H
+#define HDR_BACKLIGHT_URING_H
+
+#include "HDR-backlight-transport.hpp"  // PtyTransport, the fallback
+
+// Linux 5.11 or later for the ring itself; without it, or with HDR_BACKLIGHT_NO_URING defined, UringTransport is PtyTransport
+#if defined(__linux__) && defined(__has_include) && !defined(HDR_BACKLIGHT_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define HDR_BACKLIGHT_URING
+#endif
+#endif
+#endif
+
+#ifdef HDR_BACKLIGHT_URING
+#include <cstring>        // std::memset
+#include <sys/syscall.h>  // __NR_io_uring_setup, __NR_io_uring_enter
+#include <sys/mman.h>     // mmap()
+#endif
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+#ifdef HDR_BACKLIGHT_URING
+// The parts of io_uring the transport needs, through the system calls (no liburing)
+class IoUring {
+   public:
+    explicit IoUring(unsigned entries = 256);
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // False if the kernel doesn't have io_uring, it is older than 5.11, or it is disabled (e.g. by a seccomp profile)
+    bool isAvailable() const {
+        return _fd != -1;
+    }
+    // A cleared submission entry, submitted by the next enter(); nullptr if the queue is full
+    io_uring_sqe* getSqe();
+    // Submit what is queued, and wait until there are wait_for completions or timeout_ms has passed (0: don't wait)
+    bool enter(int timeout_ms, unsigned wait_for = 1);
+    // Hand every completion to handler(user_data, result), returns how many there were
+    template <class Handler>
+    unsigned reap(Handler handler);
+    // io_uring_enter() calls so far
+    unsigned long enters() const {
+        return _enters;
+    }
+
+    // One ring per thread, shared by the transports opened on that thread
+    static IoUring& threadRing();
+
+   private:
+    int _fd = -1;
+    void* _ring = MAP_FAILED;
+    size_t _ringSize = 0;
+    io_uring_sqe* _sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t _sqesSize = 0;
+    unsigned *_sqHead, *_sqTail, *_cqHead, *_cqTail;
+    unsigned _sqMask, _sqEntries, _cqMask;
+    unsigned _sqQueued = 0;  // Tail of the entries filled in, published by enter()
+    io_uring_cqe* _cqes;
+    unsigned long _enters = 0;
+
+    // Unmaps and closes whatever of the ring was set up
+    void release();
+};
+
+// The serial port through io_uring: write() queues the frame and, linked behind it, the read of the feedback;
+// readByte() submits both and waits for the answer in one io_uring_enter(). That is one system call per frame,
+// in place of a write() and a read() per byte with the 1 ms sleeps of arduino-serial-lib.
+// Transports opened on the same thread share its ring, so with sendFrame() to several boards followed by
+// readFeedback() from each, the frames to all the boards go out in the same system call.
+// Falls back to PtyTransport when the kernel doesn't have io_uring
+class UringTransport {
+   public:
+    ~UringTransport() {
+        close();
+    }
+
+    bool open(const char* port, int baud);
+    void close();
+    bool isOpen() const {
+        return _fd != -1 || _fallback.isOpen();
+    }
+    bool write(const uint8_t* data, int size);
+    int readByte(int timeout_ms);
+    bool reboot(const char* port, int baud);
+    int handle() const {
+        return _fd != -1 ? _fd : _fallback.handle();
+    }
+    bool usingFallback() const {
+        return _fallback.isOpen();
+    }
+
+   private:
+    // In the low bits of the user data, next to the address of the transport
+    enum Operation { OPERATION_WRITE = 1, OPERATION_READ = 2, OPERATION_CANCEL = 3, OPERATION_MASK = 3 };
+
+    int _fd = -1;  // Blocking: the ring polls it, and a read() never sees EAGAIN
+    IoUring* _ring = nullptr;
+    PtyTransport _fallback;
+    uint8_t _writeBuffer[4096];  // The kernel reads it until the write completes
+    int _writeSize = 0, _written = 0;  // Of what is in _writeBuffer, a short write goes on with the rest
+    uint8_t _readBuffer[256];
+    int _readStart = 0, _readEnd = 0;
+    bool _writing = false, _reading = false, _failed = false;
+    int _cancelling = 0;
+
+    static void dispatch(uint64_t user_data, int result);
+    void complete(int operation, int result);
+    io_uring_sqe* get_sqe();
+    io_uring_sqe* queue_write();
+    void queue_read();
+    // Submit and handle completions until done() or timeout_ms has passed, returns done().
+    // Each call into the kernel waits for as many completions, or everything in flight if 0
+    template <class Done>
+    bool wait(Done done, int timeout_ms, unsigned completions = 0);
+};
+#else
+typedef PtyTransport UringTransport;
+#endif
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+#ifdef HDR_BACKLIGHT_URING
+IoUring::IoUring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    _fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0) {
+        _fd = -1;
+        return;
+    }
+    // One mapping for both rings (5.4), and timeouts in io_uring_enter() (5.11)
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        ::close(_fd);
+        _fd = -1;
+        return;
+    }
+    _ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    _ring = mmap(nullptr, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe*)mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_ring == MAP_FAILED || _sqes == (io_uring_sqe*)MAP_FAILED) {
+        perror("IoUring::IoUring():\n\tError");
+        release();
+        return;
+    }
+    uint8_t* ring = (uint8_t*)_ring;
+    _sqHead = (unsigned*)(ring + params.sq_off.head);
+    _sqTail = (unsigned*)(ring + params.sq_off.tail);
+    _sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    _sqEntries = *(unsigned*)(ring + params.sq_off.ring_entries);
+    _cqHead = (unsigned*)(ring + params.cq_off.head);
+    _cqTail = (unsigned*)(ring + params.cq_off.tail);
+    _cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    _cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+    // Submission entry i always sits in slot i of the array
+    unsigned* array = (unsigned*)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; i++) {
+        array[i] = i;
+    }
+    _sqQueued = *_sqTail;
+}
+
+IoUring::~IoUring() {
+    release();
+}
+
+void IoUring::release() {
+    if (_sqes != (io_uring_sqe*)MAP_FAILED) {
+        munmap(_sqes, _sqesSize);
+        _sqes = (io_uring_sqe*)MAP_FAILED;
+    }
+    if (_ring != MAP_FAILED) {
+        munmap(_ring, _ringSize);
+        _ring = MAP_FAILED;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+IoUring& IoUring::threadRing() {
+    thread_local IoUring ring;
+    return ring;
+}
+
+io_uring_sqe* IoUring::getSqe() {
+    if (_sqQueued - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+        return nullptr;
+    }
+    io_uring_sqe* sqe = &_sqes[_sqQueued & _sqMask];
+    _sqQueued++;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool IoUring::enter(int timeout_ms, unsigned wait_for) {
+    unsigned to_submit = _sqQueued - *_sqTail;
+    __atomic_store_n(_sqTail, _sqQueued, __ATOMIC_RELEASE);
+    if (to_submit == 0 && timeout_ms <= 0) {
+        return true;
+    }
+    __kernel_timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+    io_uring_getevents_arg arg;
+    std::memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&timeout;
+    unsigned flags = timeout_ms > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    long result = syscall(__NR_io_uring_enter, _fd, to_submit, timeout_ms > 0 ? wait_for : 0, flags, timeout_ms > 0 ? &arg : nullptr,
+                          timeout_ms > 0 ? sizeof(arg) : 0);
+    _enters++;
+    if (result < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("IoUring::enter():\n\tError");
+        return false;
+    }
+    return true;
+}
+
+template <class Handler>
+unsigned IoUring::reap(Handler handler) {
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != tail; i++) {
+        const io_uring_cqe& cqe = _cqes[i & _cqMask];
+        handler(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(_cqHead, tail, __ATOMIC_RELEASE);
+    return tail - head;
+}
+
+bool UringTransport::open(const char* port, int baud) {
+    _ring = &IoUring::threadRing();
+    if (!_ring->isAvailable()) {
+        std::clog << "UringTransport: io_uring is not available, using PtyTransport" << std::endl;
+        return _fallback.open(port, baud);
+    }
+    // The same terminal settings as SerialTransport, then blocking
+    _fd = serialport_init(port, baud);
+    if (_fd == -1) {
+        return false;
+    }
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_NONBLOCK);
+    _readStart = _readEnd = 0;
+    _failed = false;
+    return true;
+}
+
+void UringTransport::close() {
+    if (_fallback.isOpen()) {
+        _fallback.close();
+        return;
+    }
+    if (_fd == -1) {
+        return;
+    }
+    // The kernel must be done with the buffers before they go
+    for (int operation : {OPERATION_WRITE, OPERATION_READ}) {
+        if (operation == OPERATION_WRITE ? _writing : _reading) {
+            io_uring_sqe* sqe = get_sqe();
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (uint64_t)(uintptr_t)this | operation;
+                sqe->user_data = (uint64_t)(uintptr_t)this | OPERATION_CANCEL;
+                _cancelling++;
+            }
+        }
+    }
+    if (!wait([this] { return !_writing && !_reading && _cancelling == 0; }, 1000)) {
+        std::cerr << "UringTransport::close():\n\tError: the kernel didn't cancel the transfers" << std::endl;
+    }
+    ::close(_fd);
+    _fd = -1;
+}
+
+void UringTransport::dispatch(uint64_t user_data, int result) {
+    UringTransport* transport = (UringTransport*)(uintptr_t)(user_data & ~(uint64_t)OPERATION_MASK);
+    transport->complete((int)(user_data & OPERATION_MASK), result);
+}
+
+void UringTransport::complete(int operation, int result) {
+    if (operation == OPERATION_WRITE) {
+        _writing = false;
+        if (result < 0 && result != -ECANCELED) {
+            std::cerr << "UringTransport::write():\n\tError: " << strerror(-result) << std::endl;
+            _failed = true;  // The next write or read says so, rather than a timeout
+        } else if (result >= 0 && _written + result < _writeSize) {
+            // Short write: the Teensy would wait for the rest of the command
+            _written += result;
+            if (result == 0 || queue_write() == nullptr) {
+                std::cerr << "UringTransport::write():\n\tError: couldn't write the whole command" << std::endl;
+                _failed = true;
+            }
+        }
+    } else if (operation == OPERATION_READ) {
+        _reading = false;
+        if (result > 0) {
+            _readStart = 0;
+            _readEnd = result;
+        } else if (result != -ECANCELED) {
+            // The port is gone: end of file, or EIO from a pseudo-terminal whose other end closed
+            _failed = true;
+        }
+    } else {
+        _cancelling--;
+    }
+}
+
+io_uring_sqe* UringTransport::get_sqe() {
+    io_uring_sqe* sqe = _ring->getSqe();
+    if (sqe == nullptr) {
+        // Full: submit what the other transports queued, and try again
+        _ring->enter(0);
+        sqe = _ring->getSqe();
+    }
+    return sqe;
+}
+
+io_uring_sqe* UringTransport::queue_write() {
+    io_uring_sqe* sqe = get_sqe();
+    if (sqe == nullptr) {
+        return nullptr;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = _fd;
+    sqe->addr = (uint64_t)(uintptr_t)(_writeBuffer + _written);
+    sqe->len = _writeSize - _written;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = (uint64_t)(uintptr_t)this | OPERATION_WRITE;
+    _writing = true;
+    return sqe;
+}
+
+void UringTransport::queue_read() {
+    io_uring_sqe* sqe = get_sqe();
+    if (sqe == nullptr) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = _fd;
+    sqe->addr = (uint64_t)(uintptr_t)_readBuffer;
+    sqe->len = sizeof(_readBuffer);
+    sqe->off = (uint64_t)-1;  // The file position; a terminal has none
+    sqe->user_data = (uint64_t)(uintptr_t)this | OPERATION_READ;
+    _reading = true;
+}
+
+template <class Done>
+bool UringTransport::wait(Done done, int timeout_ms, unsigned completions) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done()) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        // Everything in flight, e.g. the write and the read behind it, so that one call does
+        unsigned in_flight = completions > 0 ? completions : _writing + _reading + _cancelling;
+        if (left <= 0 || !_ring->enter((int)left, std::max(1u, in_flight))) {
+            return done();
+        }
+        _ring->reap(dispatch);
+    }
+    return true;
+}
+
+bool UringTransport::write(const uint8_t* data, int size) {
+    if (_fallback.isOpen()) {
+        return _fallback.write(data, size);
+    }
+    if (_fd == -1 || _failed) {
+        return false;
+    }
+    // The previous write has the buffer until it completes, which is at once unless the port is stuck
+    // Only the write: the read behind it may wait for an answer to what is written next
+    if (_writing && !wait([this] { return !_writing; }, 100, 1)) {
+        std::cerr << "UringTransport::write():\n\tError: the previous write didn't complete" << std::endl;
+        return false;
+    }
+    if (size > (int)sizeof(_writeBuffer)) {
+        // Larger than anything the driver sends; write it through
+        return serialport_writeBuffer(_fd, data, size) == 0;
+    }
+    std::memcpy(_writeBuffer, data, size);
+    _writeSize = size;
+    _written = 0;
+    io_uring_sqe* sqe = queue_write();
+    if (sqe == nullptr) {
+        return false;
+    }
+    if (!_reading && _readStart == _readEnd) {
+        // The read of the feedback starts once the write is done
+        // (Not while answers are left in the buffer, e.g. acknowledgements with flow control, which it would overwrite)
+        sqe->flags |= IOSQE_IO_LINK;
+        queue_read();
+    }
+    return true;
+}
+
+int UringTransport::readByte(int timeout_ms) {
+    if (_fallback.isOpen()) {
+        return _fallback.readByte(timeout_ms);
+    }
+    if (_fd == -1) {
+        return -1;
+    }
+    auto available = [this] { return _readStart < _readEnd || _failed; };
+    if (!available()) {
+        if (!_reading) {
+            queue_read();
+        }
+        // Reading again if the read was cancelled, e.g. behind a write that failed
+        wait([this, &available] {
+            if (!_reading && !available()) {
+                queue_read();
+            }
+            return available();
+        },
+             timeout_ms);
+    }
+    if (_readStart < _readEnd) {
+        return _readBuffer[_readStart++];
+    }
+    return _failed ? -1 : -2;
+}
+
+bool UringTransport::reboot(const char* port, int baud) {
+    if (_fallback.isOpen()) {
+        return _fallback.reboot(port, baud);
+    }
+    const uint8_t command[2] = {'R', 'T'};
+    if (!write(command, 2)) {
+        return false;
+    }
+    _ring->enter(0);
+    wait([this] { return !_writing; }, 100, 1);
+    std::clog << "Resetting Teensy..." << std::endl;
+    close();
+    if (!waitForPortReboot(port) || !open(port, baud)) {
+        return false;
+    }
+    std::clog << "Reboot complete!" << std::endl;
+    return true;
+}
+#endif
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_URING_H
@@ -0,0 +1,346 @@
+/* Video to backlight conversion for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_VIDEO_H
+#define HDR_BACKLIGHT_VIDEO_H
+
+#include <iostream>  // std::cerr, std::endl
+#include <cstdio>    // FILE, fread()
+#include <cstring>   // strncmp()
+#include <cmath>     // std::pow, std::exp, std::lround
+#include <cstdlib>   // atoi()
+#include <cctype>    // isdigit()
+#include <string>    // std::string
+#include <vector>    // std::vector
+#include <algorithm>  // std::max, std::min
+
+#include "HDR-backlight-driver.hpp"  // GSFrame
+
+// The LEDs cover the picture as a grid: x runs down SCREEN_SIZE_X rows,
+// y runs across SCREEN_SIZE_Y columns, so the 9 x 16 grid matches a 16:9 picture
+#define TRANSFER_SDR 0     // BT.1886, gamma 2.4
+#define TRANSFER_PQ 1      // SMPTE ST 2084
+#define TRANSFER_LINEAR 2  // Code values proportional to light
+#define TRANSFER_HLG 3     // ARIB STD-B67, shown on a 1000 nits display
+#define HLG_SYSTEM_GAMMA 1.2
+#define HLG_NOMINAL_PEAK_NITS 1000.0
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Light of a non-linear signal in [0, 1], relative to peak_nits and clipped to 1
+// For TRANSFER_HLG this is scene light, the display's system gamma applies to the luminance, see hlgDisplayLight()
+double signalToLight(double signal, int transfer, double peak_nits);
+double hlgDisplayLight(double scene_luminance, double peak_nits);
+
+// Linear light in [0, 1] for every luma code value, so that the zone reduction is one lookup per pixel.
+// The table covers every value a sample can hold, 1 byte up to 8 bits and 2 bytes above: a sample above
+// the bit depth, from a broken stream, is clamped to white instead of read past the table
+class LumaToLinear {
+   public:
+    // peak_nits: the light that maps to 1 for TRANSFER_PQ, which encodes up to 10000 nits
+    LumaToLinear(int bit_depth, bool full_range, int transfer, double peak_nits = 1000);
+
+    float operator[](uint16_t code) const {
+        return _table[std::min((size_t)code, _table.size() - 1)];
+    }
+    const float* table() const {
+        return _table.data();
+    }
+
+   private:
+    std::vector<float> _table;
+};
+
+// Light of every zone of one picture, reduced from its luma plane
+// Samples are 1 byte if bytes_per_sample is 1, little-endian 16-bit otherwise, as in Y4M.
+// Only every subsample-th row and column is read.
+// mix chooses between the mean (0) and the peak (1) of each zone: the mean keeps the backlight
+// low in mostly dark zones, the peak keeps small highlights from clipping.
+void reduceZones(const uint8_t* luma, int width, int height, size_t stride, int bytes_per_sample,
+                 const LumaToLinear& to_linear, int subsample, float mix, GSFrame& out);
+
+// Temporal filter over the zone frames in display order, against flicker and pumping:
+// a zone brightens with time constant attack_s and dims with time constant release_s
+class TemporalFilter {
+   public:
+    TemporalFilter(double fps, double attack_s = 0, double release_s = 0.25);
+    void apply(GSFrame& frame);
+    // Continue from a frame shown without going through apply(), e.g. one from a FrameCache
+    void prime(const GSFrame& frame);
+
+   private:
+    float _attack, _release;  // Fraction of the gap closed per frame
+    float _state[TLC_FRAME_VALUE_COUNT];
+    bool _first = true;
+};
+
+// Y4M (YUV4MPEG2) frames, or raw planar frames of a known size, from a file or stdin.
+// Only the luma plane is kept.
+class VideoReader {
+   public:
+    // Y4M, from the stream header
+    explicit VideoReader(FILE* file);
+    // Raw planar frames; chroma is "420", "422", "444" or "mono"
+    VideoReader(FILE* file, int width, int height, int bit_depth, const std::string& chroma = "420");
+
+    bool isOpen() const {
+        return _width > 0;
+    }
+    int width() const {
+        return _width;
+    }
+    int height() const {
+        return _height;
+    }
+    int bitDepth() const {
+        return _bitDepth;
+    }
+    int bytesPerSample() const {
+        return _bitDepth > 8 ? 2 : 1;
+    }
+    size_t lumaSize() const {
+        return (size_t)_width * _height * bytesPerSample();
+    }
+    double fps() const {
+        return _fps;
+    }
+    bool fullRange() const {
+        return _fullRange;
+    }
+
+    // "420", "422", "444" or "mon"
+    const std::string& chroma() const {
+        return _chroma;
+    }
+    size_t chromaSize() const {
+        return _chromaSize;
+    }
+
+    // Read the next frame's luma plane into lumaSize() bytes, false at the end of the stream
+    // The chroma planes go to chromaSize() bytes at chroma, if it isn't nullptr
+    bool readFrame(uint8_t* luma, uint8_t* chroma = nullptr);
+
+   private:
+    FILE* _file;
+    bool _y4m;
+    int _width = 0, _height = 0, _bitDepth = 8;
+    double _fps = 24;
+    bool _fullRange = false;
+    std::string _chroma;
+    size_t _chromaSize = 0;
+    std::vector<uint8_t> _skip;  // Chroma planes, read and dropped, since stdin can't seek
+
+    // Sets the size, or leaves the reader closed if the chroma format is unknown
+    bool setChroma(int width, int height, const std::string& chroma);
+};
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+LumaToLinear::LumaToLinear(int bit_depth, bool full_range, int transfer, double peak_nits) : _table(bit_depth <= 8 ? 256 : 65536) {
+    const double max_code = (1 << bit_depth) - 1;
+    // Limited range: black at 16, white at 235, scaled to the bit depth
+    const double black = full_range ? 0 : 16 << (bit_depth - 8);
+    const double white = full_range ? max_code : 235 << (bit_depth - 8);
+    for (size_t code = 0; code < _table.size(); code++) {
+        double v = std::min(1.0, std::max(0.0, (code - black) / (white - black)));  // Clamps the codes above max_code too
+        double light = signalToLight(v, transfer, peak_nits);
+        // Luma alone: the system gamma goes on the luma's light, as if it were the luminance
+        _table[code] = (float)(transfer == TRANSFER_HLG ? hlgDisplayLight(light, peak_nits) : light);
+    }
+}
+
+double signalToLight(double signal, int transfer, double peak_nits) {
+    double v = std::min(1.0, std::max(0.0, signal));
+    if (transfer == TRANSFER_PQ) {
+        const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+        const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+        double p = std::pow(v, 1 / m2);
+        double nits = 10000 * std::pow(std::max(p - c1, 0.0) / (c2 - c3 * p), 1 / m1);
+        return std::min(1.0, nits / peak_nits);
+    }
+    if (transfer == TRANSFER_HLG) {
+        // Inverse OETF
+        const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+        return v <= 0.5 ? v * v / 3 : (std::exp((v - c) / a) + b) / 12;
+    }
+    if (transfer == TRANSFER_LINEAR) {
+        return v;
+    }
+    return std::pow(v, 2.4);
+}
+
+double hlgDisplayLight(double scene_luminance, double peak_nits) {
+    double nits = HLG_NOMINAL_PEAK_NITS * std::pow(std::max(0.0, scene_luminance), HLG_SYSTEM_GAMMA);
+    return std::min(1.0, nits / peak_nits);
+}
+
+void reduceZones(const uint8_t* luma, int width, int height, size_t stride, int bytes_per_sample,
+                 const LumaToLinear& to_linear, int subsample, float mix, GSFrame& out) {
+    subsample = std::max(1, subsample);
+    // The first column of every zone column, and the end
+    int column_start[SCREEN_SIZE_Y + 1];
+    for (int y = 0; y <= SCREEN_SIZE_Y; y++) {
+        column_start[y] = (int)((long)width * y / SCREEN_SIZE_Y);
+    }
+    const float* table = to_linear.table();
+
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        float sum[SCREEN_SIZE_Y] = {0};
+        float peak[SCREEN_SIZE_Y] = {0};
+        int rows = 0;
+        for (int row = (int)((long)height * x / SCREEN_SIZE_X); row < (long)height * (x + 1) / SCREEN_SIZE_X; row += subsample) {
+            const uint8_t* line = luma + row * stride;
+            for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+                // Summed per row in float, which is exact enough for a few thousand samples
+                float row_sum = 0, row_peak = peak[y];
+                for (int column = column_start[y]; column < column_start[y + 1]; column += subsample) {
+                    uint16_t code = bytes_per_sample == 1 ? line[column] : (uint16_t)(line[2 * column] | line[2 * column + 1] << 8);
+                    float light = table[code];
+                    row_sum += light;
+                    row_peak = std::max(row_peak, light);
+                }
+                sum[y] += row_sum;
+                peak[y] = row_peak;
+            }
+            rows++;
+        }
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            int columns = (column_start[y + 1] - column_start[y] + subsample - 1) / subsample;
+            float mean = rows * columns > 0 ? sum[y] / (rows * columns) : 0;
+            float light = mean + mix * (peak[y] - mean);
+            out.set(x, y, (uint16_t)std::lround(std::min(1.0f, light) * 0xFFFF));
+        }
+    }
+}
+
+TemporalFilter::TemporalFilter(double fps, double attack_s, double release_s) {
+    _attack = attack_s > 0 ? (float)(1 - std::exp(-1 / (fps * attack_s))) : 1;
+    _release = release_s > 0 ? (float)(1 - std::exp(-1 / (fps * release_s))) : 1;
+}
+
+void TemporalFilter::apply(GSFrame& frame) {
+    uint16_t* values = &frame.gs[0][0][0];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        if (_first) {
+            _state[i] = values[i];
+        } else {
+            _state[i] += (values[i] - _state[i]) * (values[i] > _state[i] ? _attack : _release);
+        }
+        values[i] = (uint16_t)std::lround(_state[i]);
+    }
+    _first = false;
+}
+
+void TemporalFilter::prime(const GSFrame& frame) {
+    const uint16_t* values = &frame.gs[0][0][0];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        _state[i] = values[i];
+    }
+    _first = false;
+}
+
+VideoReader::VideoReader(FILE* file) : _file(file), _y4m(true) {
+    // YUV4MPEG2 W<width> H<height> F<num>:<den> C<chroma> ... up to the newline
+    char header[1024];
+    if (fgets(header, sizeof(header), file) == nullptr || strncmp(header, "YUV4MPEG2 ", 10) != 0) {
+        std::cerr << "VideoReader::VideoReader():\n\tError: not a Y4M stream" << std::endl;
+        return;
+    }
+    std::string chroma = "420";
+    int width = 0, height = 0;
+    for (char* tag = strtok(header + 10, " \n"); tag != nullptr; tag = strtok(nullptr, " \n")) {
+        int num, den;
+        if (tag[0] == 'W') {
+            width = atoi(tag + 1);
+        } else if (tag[0] == 'H') {
+            height = atoi(tag + 1);
+        } else if (tag[0] == 'F' && sscanf(tag + 1, "%d:%d", &num, &den) == 2 && num > 0 && den > 0) {
+            _fps = (double)num / den;
+        } else if (tag[0] == 'C') {
+            chroma = tag + 1;
+        } else if (!strcmp(tag, "XCOLORRANGE=FULL")) {
+            _fullRange = true;
+        }
+    }
+    // C420p10, C422p12, C444p16...: the bit depth follows the 'p'
+    size_t p = chroma.find('p');
+    if (p != std::string::npos && p + 1 < chroma.size() && isdigit(chroma[p + 1])) {
+        _bitDepth = atoi(chroma.c_str() + p + 1);
+    }
+    if (width <= 0 || height <= 0 || _bitDepth < 8 || _bitDepth > 16 || !setChroma(width, height, chroma.substr(0, 3))) {
+        std::cerr << "VideoReader::VideoReader():\n\tError: unsupported Y4M stream" << std::endl;
+    }
+}
+
+VideoReader::VideoReader(FILE* file, int width, int height, int bit_depth, const std::string& chroma)
+    : _file(file), _y4m(false), _bitDepth(bit_depth) {
+    if (width <= 0 || height <= 0 || bit_depth < 8 || bit_depth > 16 || !setChroma(width, height, chroma.substr(0, 3))) {
+        std::cerr << "VideoReader::VideoReader():\n\tError: unsupported raw format" << std::endl;
+    }
+}
+
+bool VideoReader::setChroma(int width, int height, const std::string& chroma) {
+    // Samples of both chroma planes
+    size_t samples;
+    if (chroma == "420") {
+        samples = 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    } else if (chroma == "422") {
+        samples = 2 * (size_t)((width + 1) / 2) * height;
+    } else if (chroma == "444") {
+        samples = 2 * (size_t)width * height;
+    } else if (chroma == "mon") {  // mono, cut to 3 letters with the bit depth
+        samples = 0;
+    } else {
+        return false;
+    }
+    _width = width;
+    _height = height;
+    _chroma = chroma;
+    _chromaSize = samples * bytesPerSample();
+    _skip.resize(_chromaSize);
+    return true;
+}
+
+bool VideoReader::readFrame(uint8_t* luma, uint8_t* chroma) {
+    if (!isOpen()) {
+        return false;
+    }
+    if (_y4m) {
+        // FRAME, optionally with parameters, up to the newline
+        char marker[256];
+        if (fgets(marker, sizeof(marker), _file) == nullptr || strncmp(marker, "FRAME", 5) != 0) {
+            return false;
+        }
+    }
+    if (fread(luma, 1, lumaSize(), _file) != lumaSize()) {
+        return false;
+    }
+    return _chromaSize == 0 || fread(chroma != nullptr ? chroma : _skip.data(), 1, _chromaSize, _file) == _chromaSize;
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_VIDEO_H
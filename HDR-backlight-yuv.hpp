@@ -0,0 +1,362 @@
+/* Vectorized 10-bit YUV to backlight conversion for the HDR backlight driver library
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef HDR_BACKLIGHT_YUV_H
+#define HDR_BACKLIGHT_YUV_H
+
+#include <cstring>    // std::memcpy
+#include <vector>     // std::vector
+#include <algorithm>  // std::max, std::min
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "HDR-backlight-video.hpp"  // reduceZones(), signalToLight()
+
+// 10-bit Y'CbCr pictures, limited range, reduced to the light of every LED zone in one pass:
+// unpack a row, convert every pixel to R'G'B', look up the light of each channel,
+// weigh it into the luminance, and add it to the zone's mean and peak.
+// Only one row is unpacked at a time; the picture in linear light is never stored.
+// The kernels are chosen when compiling: AVX2 with -mavx2 (8 pixels at a time, with gathers
+// for the lookups), SSE4.1 with -msse4.1 (4 pixels at a time), plain C++ otherwise.
+#if defined(__AVX2__)
+#define YUV_KERNEL "AVX2"
+#elif defined(__SSE4_1__)
+#define YUV_KERNEL "SSE4.1"
+#else
+#define YUV_KERNEL "scalar"
+#endif
+
+// Entries of the transfer function tables, more than the 1024 codes, since R'G'B' falls between them
+#define YUV_LIGHT_TABLE_SIZE 4096
+
+// Class interface
+namespace hdrbacklightdriverjli {
+
+// Y'CbCr codes to display luminance in [0, 1], relative to peak_nits
+class YuvToLight {
+   public:
+    // bt2020: BT.2020 colours, BT.709 otherwise
+    YuvToLight(int transfer, double peak_nits = 1000, bool bt2020 = true);
+
+    // Luminance of one pixel, 10-bit codes
+    float pixel(uint16_t y, uint16_t cb, uint16_t cr) const;
+
+    // Add the luminance of pixels [begin, end) of a row to sum and peak
+    // The chroma rows have one sample per two pixels
+    void accumulate(const uint16_t* y, const uint16_t* cb, const uint16_t* cr, int begin, int end, float& sum, float& peak) const;
+
+   private:
+    // R'G'B' as table positions: y * _yScale + _yOffset, (c - 512) * _cScale, times the matrix
+    float _yScale, _yOffset, _cScale;
+    float _crToR, _cbToG, _crToG, _cbToB;
+    float _weightR, _weightG, _weightB;  // Luminance
+    bool _hlg;
+    std::vector<float> _light;    // Light of each channel's signal
+    std::vector<float> _display;  // HLG only: display light of the scene luminance
+
+    void accumulateScalar(const uint16_t* y, const uint16_t* cb, const uint16_t* cr, int begin, int end, float& sum, float& peak) const;
+};
+
+// Planar 4:2:0, 16-bit little-endian samples (yuv420p10le); nothing is copied
+// Strides are in bytes. Every subsample-th row is read, all the columns are.
+void reduceZonesYuv420p10(const uint8_t* y, size_t y_stride, const uint8_t* cb, size_t cb_stride, const uint8_t* cr, size_t cr_stride,
+                          int width, int height, const YuvToLight& to_light, int subsample, float mix, GSFrame& out);
+// P010: the luma plane, then interleaved CbCr at half height, 10 bits in the upper bits of 16-bit little-endian words
+void reduceZonesP010(const uint8_t* y, size_t y_stride, const uint8_t* cbcr, size_t cbcr_stride, int width, int height,
+                     const YuvToLight& to_light, int subsample, float mix, GSFrame& out);
+// v210: packed 4:2:2, three 10-bit samples per 32-bit little-endian word, 6 pixels per 16 bytes
+// The stride is usually ((width + 47) / 48) * 128 bytes
+void reduceZonesV210(const uint8_t* data, size_t stride, int width, int height, const YuvToLight& to_light, int subsample, float mix,
+                     GSFrame& out);
+}  //namespace: hdrbacklightdriverjli
+
+// Implementation
+namespace hdrbacklightdriverjli {
+
+YuvToLight::YuvToLight(int transfer, double peak_nits, bool bt2020)
+    : _hlg(transfer == TRANSFER_HLG), _light(YUV_LIGHT_TABLE_SIZE), _display(transfer == TRANSFER_HLG ? YUV_LIGHT_TABLE_SIZE : 0) {
+    const float last = YUV_LIGHT_TABLE_SIZE - 1;
+    // Limited range: Y' from 64 to 940, Cb and Cr from 64 to 960 around 512
+    _yScale = last / 876;
+    _yOffset = -64 * _yScale;
+    _cScale = last / 896;
+    const double kr = bt2020 ? 0.2627 : 0.2126;
+    const double kb = bt2020 ? 0.0593 : 0.0722;
+    const double kg = 1 - kr - kb;
+    _crToR = (float)(2 * (1 - kr));
+    _cbToB = (float)(2 * (1 - kb));
+    _cbToG = (float)(-2 * kb * (1 - kb) / kg);
+    _crToG = (float)(-2 * kr * (1 - kr) / kg);
+    _weightR = (float)kr;
+    _weightG = (float)kg;
+    _weightB = (float)kb;
+
+    for (int i = 0; i < YUV_LIGHT_TABLE_SIZE; i++) {
+        // HLG: scene light relative to the signal's peak, the display light comes after the luminance
+        _light[i] = (float)signalToLight(i / last, transfer, _hlg ? HLG_NOMINAL_PEAK_NITS : peak_nits);
+        if (_hlg) {
+            _display[i] = (float)hlgDisplayLight(i / last, peak_nits);
+        }
+    }
+}
+
+float YuvToLight::pixel(uint16_t y, uint16_t cb, uint16_t cr) const {
+    float sum = 0, peak = 0;
+    uint16_t cb_row[1] = {cb}, cr_row[1] = {cr};
+    accumulateScalar(&y, cb_row, cr_row, 0, 1, sum, peak);
+    return sum;
+}
+
+void YuvToLight::accumulateScalar(const uint16_t* y, const uint16_t* cb, const uint16_t* cr, int begin, int end, float& sum, float& peak) const {
+    const float last = YUV_LIGHT_TABLE_SIZE - 1;
+    for (int i = begin; i < end; i++) {
+        float luma = y[i] * _yScale + _yOffset;
+        float blue = (cb[i / 2] - 512.0f) * _cScale;
+        float red = (cr[i / 2] - 512.0f) * _cScale;
+        // Table positions, rounded and clamped to the table
+        int r = (int)(std::min(std::max(luma + _crToR * red, 0.0f), last) + 0.5f);
+        int g = (int)(std::min(std::max(luma + _cbToG * blue + _crToG * red, 0.0f), last) + 0.5f);
+        int b = (int)(std::min(std::max(luma + _cbToB * blue, 0.0f), last) + 0.5f);
+        float light = _weightR * _light[r] + _weightG * _light[g] + _weightB * _light[b];
+        if (_hlg) {
+            light = _display[(int)(std::min(light, 1.0f) * last + 0.5f)];
+        }
+        sum += light;
+        peak = std::max(peak, light);
+    }
+}
+
+void YuvToLight::accumulate(const uint16_t* y, const uint16_t* cb, const uint16_t* cr, int begin, int end, float& sum, float& peak) const {
+    // The vectors start on even pixels, which begin a chroma sample
+    if (begin < end && begin % 2) {
+        accumulateScalar(y, cb, cr, begin, begin + 1, sum, peak);
+        begin++;
+    }
+    int i = begin;
+#if defined(__AVX2__)
+    const __m256 y_scale = _mm256_set1_ps(_yScale), y_offset = _mm256_set1_ps(_yOffset);
+    const __m256 c_scale = _mm256_set1_ps(_cScale), c_offset = _mm256_set1_ps(-512 * _cScale);
+    const __m256 zero = _mm256_setzero_ps(), last = _mm256_set1_ps(YUV_LIGHT_TABLE_SIZE - 1), half = _mm256_set1_ps(0.5f);
+    __m256 sums = _mm256_setzero_ps(), peaks = _mm256_setzero_ps();
+    for (; i + 8 <= end; i += 8) {
+        __m256 luma = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(y + i))));
+        // 4 chroma samples, each used by two pixels
+        __m128i cb4 = _mm_loadl_epi64((const __m128i*)(cb + i / 2));
+        __m128i cr4 = _mm_loadl_epi64((const __m128i*)(cr + i / 2));
+        __m256 blue = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_unpacklo_epi16(cb4, cb4)));
+        __m256 red = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_unpacklo_epi16(cr4, cr4)));
+        luma = _mm256_add_ps(_mm256_mul_ps(luma, y_scale), y_offset);
+        blue = _mm256_add_ps(_mm256_mul_ps(blue, c_scale), c_offset);
+        red = _mm256_add_ps(_mm256_mul_ps(red, c_scale), c_offset);
+        __m256 r = _mm256_add_ps(luma, _mm256_mul_ps(red, _mm256_set1_ps(_crToR)));
+        __m256 g = _mm256_add_ps(luma, _mm256_add_ps(_mm256_mul_ps(blue, _mm256_set1_ps(_cbToG)), _mm256_mul_ps(red, _mm256_set1_ps(_crToG))));
+        __m256 b = _mm256_add_ps(luma, _mm256_mul_ps(blue, _mm256_set1_ps(_cbToB)));
+        __m256i r_index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_min_ps(_mm256_max_ps(r, zero), last), half));
+        __m256i g_index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_min_ps(_mm256_max_ps(g, zero), last), half));
+        __m256i b_index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_min_ps(_mm256_max_ps(b, zero), last), half));
+        __m256 light = _mm256_mul_ps(_mm256_i32gather_ps(_light.data(), r_index, 4), _mm256_set1_ps(_weightR));
+        light = _mm256_add_ps(light, _mm256_mul_ps(_mm256_i32gather_ps(_light.data(), g_index, 4), _mm256_set1_ps(_weightG)));
+        light = _mm256_add_ps(light, _mm256_mul_ps(_mm256_i32gather_ps(_light.data(), b_index, 4), _mm256_set1_ps(_weightB)));
+        if (_hlg) {
+            __m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(light, _mm256_set1_ps(1.0f)), last), half));
+            light = _mm256_i32gather_ps(_display.data(), index, 4);
+        }
+        sums = _mm256_add_ps(sums, light);
+        peaks = _mm256_max_ps(peaks, light);
+    }
+    alignas(32) float lane_sums[8], lane_peaks[8];
+    _mm256_store_ps(lane_sums, sums);
+    _mm256_store_ps(lane_peaks, peaks);
+    for (int lane = 0; lane < 8; lane++) {
+        sum += lane_sums[lane];
+        peak = std::max(peak, lane_peaks[lane]);
+    }
+#elif defined(__SSE4_1__)
+    const __m128 y_scale = _mm_set1_ps(_yScale), y_offset = _mm_set1_ps(_yOffset);
+    const __m128 c_scale = _mm_set1_ps(_cScale), c_offset = _mm_set1_ps(-512 * _cScale);
+    const __m128 zero = _mm_setzero_ps(), last = _mm_set1_ps(YUV_LIGHT_TABLE_SIZE - 1), half = _mm_set1_ps(0.5f);
+    __m128 sums = _mm_setzero_ps(), peaks = _mm_setzero_ps();
+    alignas(16) int32_t r_index[4], g_index[4], b_index[4];
+    for (; i + 4 <= end; i += 4) {
+        __m128 luma = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(y + i))));
+        // 2 chroma samples, each used by two pixels
+        int32_t cb2, cr2;
+        std::memcpy(&cb2, cb + i / 2, 4);
+        std::memcpy(&cr2, cr + i / 2, 4);
+        __m128i cb_pair = _mm_cvtsi32_si128(cb2), cr_pair = _mm_cvtsi32_si128(cr2);
+        __m128 blue = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_unpacklo_epi16(cb_pair, cb_pair)));
+        __m128 red = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_unpacklo_epi16(cr_pair, cr_pair)));
+        luma = _mm_add_ps(_mm_mul_ps(luma, y_scale), y_offset);
+        blue = _mm_add_ps(_mm_mul_ps(blue, c_scale), c_offset);
+        red = _mm_add_ps(_mm_mul_ps(red, c_scale), c_offset);
+        __m128 r = _mm_add_ps(luma, _mm_mul_ps(red, _mm_set1_ps(_crToR)));
+        __m128 g = _mm_add_ps(luma, _mm_add_ps(_mm_mul_ps(blue, _mm_set1_ps(_cbToG)), _mm_mul_ps(red, _mm_set1_ps(_crToG))));
+        __m128 b = _mm_add_ps(luma, _mm_mul_ps(blue, _mm_set1_ps(_cbToB)));
+        _mm_store_si128((__m128i*)r_index, _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(r, zero), last), half)));
+        _mm_store_si128((__m128i*)g_index, _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(g, zero), last), half)));
+        _mm_store_si128((__m128i*)b_index, _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(b, zero), last), half)));
+        // No gathers before AVX2: look up lane by lane
+        const float* table = _light.data();
+        __m128 light = _mm_mul_ps(_mm_setr_ps(table[r_index[0]], table[r_index[1]], table[r_index[2]], table[r_index[3]]), _mm_set1_ps(_weightR));
+        light = _mm_add_ps(light, _mm_mul_ps(_mm_setr_ps(table[g_index[0]], table[g_index[1]], table[g_index[2]], table[g_index[3]]), _mm_set1_ps(_weightG)));
+        light = _mm_add_ps(light, _mm_mul_ps(_mm_setr_ps(table[b_index[0]], table[b_index[1]], table[b_index[2]], table[b_index[3]]), _mm_set1_ps(_weightB)));
+        if (_hlg) {
+            _mm_store_si128((__m128i*)r_index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(light, _mm_set1_ps(1.0f)), last), half)));
+            light = _mm_setr_ps(_display[r_index[0]], _display[r_index[1]], _display[r_index[2]], _display[r_index[3]]);
+        }
+        sums = _mm_add_ps(sums, light);
+        peaks = _mm_max_ps(peaks, light);
+    }
+    alignas(16) float lane_sums[4], lane_peaks[4];
+    _mm_store_ps(lane_sums, sums);
+    _mm_store_ps(lane_peaks, peaks);
+    for (int lane = 0; lane < 4; lane++) {
+        sum += lane_sums[lane];
+        peak = std::max(peak, lane_peaks[lane]);
+    }
+#endif
+    accumulateScalar(y, cb, cr, i, end, sum, peak);
+}
+
+// The zone loop shared by the layouts: row(r, y, cb, cr) points y, cb and cr at the samples of row r
+template <class RowSource>
+void reduceZonesYuvRows(int width, int height, const YuvToLight& to_light, int subsample, float mix, GSFrame& out, RowSource row) {
+    subsample = std::max(1, subsample);
+    int column_start[SCREEN_SIZE_Y + 1];
+    for (int zone = 0; zone <= SCREEN_SIZE_Y; zone++) {
+        column_start[zone] = (int)((long)width * zone / SCREEN_SIZE_Y);
+    }
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        float sum[SCREEN_SIZE_Y] = {0};
+        float peak[SCREEN_SIZE_Y] = {0};
+        int rows = 0;
+        for (int r = (int)((long)height * x / SCREEN_SIZE_X); r < (long)height * (x + 1) / SCREEN_SIZE_X; r += subsample) {
+            const uint16_t *y, *cb, *cr;
+            row(r, y, cb, cr);
+            for (int zone = 0; zone < SCREEN_SIZE_Y; zone++) {
+                float row_sum = 0;
+                to_light.accumulate(y, cb, cr, column_start[zone], column_start[zone + 1], row_sum, peak[zone]);
+                sum[zone] += row_sum;
+            }
+            rows++;
+        }
+        for (int zone = 0; zone < SCREEN_SIZE_Y; zone++) {
+            int pixels = rows * (column_start[zone + 1] - column_start[zone]);
+            float mean = pixels > 0 ? sum[zone] / pixels : 0;
+            float light = mean + mix * (peak[zone] - mean);
+            out.set(x, zone, (uint16_t)std::lround(std::min(1.0f, light) * 0xFFFF));
+        }
+    }
+}
+
+void reduceZonesYuv420p10(const uint8_t* y, size_t y_stride, const uint8_t* cb, size_t cb_stride, const uint8_t* cr, size_t cr_stride,
+                          int width, int height, const YuvToLight& to_light, int subsample, float mix, GSFrame& out) {
+    // Little-endian hosts read the samples in place
+    reduceZonesYuvRows(width, height, to_light, subsample, mix, out, [&](int r, const uint16_t*& y_row, const uint16_t*& cb_row, const uint16_t*& cr_row) {
+        y_row = (const uint16_t*)(y + r * y_stride);
+        cb_row = (const uint16_t*)(cb + (r / 2) * cb_stride);
+        cr_row = (const uint16_t*)(cr + (r / 2) * cr_stride);
+    });
+}
+
+void reduceZonesP010(const uint8_t* y, size_t y_stride, const uint8_t* cbcr, size_t cbcr_stride, int width, int height,
+                     const YuvToLight& to_light, int subsample, float mix, GSFrame& out) {
+    std::vector<uint16_t> y_row(width + 8), cb_row(width / 2 + 8), cr_row(width / 2 + 8);
+    reduceZonesYuvRows(width, height, to_light, subsample, mix, out, [&](int r, const uint16_t*& y_out, const uint16_t*& cb_out, const uint16_t*& cr_out) {
+        const uint16_t* y_in = (const uint16_t*)(y + r * y_stride);
+        const uint16_t* cbcr_in = (const uint16_t*)(cbcr + (r / 2) * cbcr_stride);
+        const int chroma_count = (width + 1) / 2;
+        int i = 0, c = 0;
+#if defined(__SSE4_1__)
+        // 8 luma samples, and 4 CbCr pairs, at a time
+        for (; i + 8 <= width; i += 8) {
+            _mm_storeu_si128((__m128i*)&y_row[i], _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(y_in + i)), 6));
+        }
+        const __m128i low_half = _mm_set1_epi32(0xFFFF);
+        for (; c + 4 <= chroma_count; c += 4) {
+            __m128i pairs = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(cbcr_in + 2 * c)), 6);
+            __m128i blue = _mm_and_si128(pairs, low_half);
+            __m128i red = _mm_srli_epi32(pairs, 16);
+            _mm_storel_epi64((__m128i*)&cb_row[c], _mm_packus_epi32(blue, blue));
+            _mm_storel_epi64((__m128i*)&cr_row[c], _mm_packus_epi32(red, red));
+        }
+#endif
+        for (; i < width; i++) {
+            y_row[i] = y_in[i] >> 6;
+        }
+        for (; c < chroma_count; c++) {
+            cb_row[c] = cbcr_in[2 * c] >> 6;
+            cr_row[c] = cbcr_in[2 * c + 1] >> 6;
+        }
+        y_out = y_row.data();
+        cb_out = cb_row.data();
+        cr_out = cr_row.data();
+    });
+}
+
+void reduceZonesV210(const uint8_t* data, size_t stride, int width, int height, const YuvToLight& to_light, int subsample, float mix,
+                     GSFrame& out) {
+    std::vector<uint16_t> y_row(width + 6), cb_row(width / 2 + 3), cr_row(width / 2 + 3);
+    reduceZonesYuvRows(width, height, to_light, subsample, mix, out, [&](int r, const uint16_t*& y_out, const uint16_t*& cb_out, const uint16_t*& cr_out) {
+        const uint8_t* in = data + r * stride;
+        // Per 16 bytes: Cb0 Y0 Cr0 | Y1 Cb1 Y2 | Cr1 Y3 Cb2 | Y4 Cr2 Y5, the first sample in the lowest bits
+        for (int pixel = 0, c = 0; pixel < width; pixel += 6, c += 3, in += 16) {
+            uint32_t low[4], middle[4], high[4];
+#if defined(__SSE4_1__)
+            __m128i words = _mm_loadu_si128((const __m128i*)in);
+            const __m128i mask = _mm_set1_epi32(0x3FF);
+            _mm_storeu_si128((__m128i*)low, _mm_and_si128(words, mask));
+            _mm_storeu_si128((__m128i*)middle, _mm_and_si128(_mm_srli_epi32(words, 10), mask));
+            _mm_storeu_si128((__m128i*)high, _mm_and_si128(_mm_srli_epi32(words, 20), mask));
+#else
+            for (int w = 0; w < 4; w++) {
+                uint32_t word = in[4 * w] | in[4 * w + 1] << 8 | in[4 * w + 2] << 16 | (uint32_t)in[4 * w + 3] << 24;
+                low[w] = word & 0x3FF;
+                middle[w] = (word >> 10) & 0x3FF;
+                high[w] = (word >> 20) & 0x3FF;
+            }
+#endif
+            y_row[pixel] = middle[0];
+            y_row[pixel + 1] = low[1];
+            y_row[pixel + 2] = high[1];
+            y_row[pixel + 3] = middle[2];
+            y_row[pixel + 4] = low[3];
+            y_row[pixel + 5] = high[3];
+            cb_row[c] = low[0];
+            cb_row[c + 1] = middle[1];
+            cb_row[c + 2] = high[2];
+            cr_row[c] = high[0];
+            cr_row[c + 1] = low[2];
+            cr_row[c + 2] = middle[3];
+        }
+        y_out = y_row.data();
+        cb_out = cb_row.data();
+        cr_out = cr_row.data();
+    });
+}
+}  //namespace: hdrbacklightdriverjli
+
+#endif  // !HDR_BACKLIGHT_YUV_H
@@ -0,0 +1,232 @@
+// Serial protocol shared by Teensy_TLC_Control.ino and HDR-backlight-driver.hpp
+// Plain C++ without Arduino headers, so that the host build compiles the same code
+
+#ifndef TLC_PROTOCOL_H
+#define TLC_PROTOCOL_H
+
+#include <stdint.h>
+
+// Number of grayscale values in one frame: TLC_COUNT * LEDS_PER_CHIP * COLOR_CHANNEL_COUNT
+// The values are sent chip by chip, channel by channel, color by color
+#define TLC_FRAME_VALUE_COUNT 144
+
+// The LEDs on the PCB, one per grayscale value
+#define SCREEN_SIZE_X 9
+#define SCREEN_SIZE_Y 16
+
+// Convert PCB LED coordinate to the indices of the grayscale data [chip][channel][color]
+static const uint8_t tlc_index_chip[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
+    {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
+    {2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 0, 0, 0, 0, 0, 0},
+};
+
+static const uint8_t tlc_index_channel[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
+    {9, 9, 9, 12, 12, 12, 8, 8, 4, 4, 0, 2, 6, 11, 11, 11},
+    {10, 14, 14, 14, 13, 13, 13, 8, 4, 0, 0, 6, 6, 15, 15, 15},
+    {10, 10, 15, 15, 15, 11, 11, 11, 7, 5, 5, 3, 3, 10, 10, 10},
+    {9, 12, 12, 12, 0, 0, 0, 5, 7, 1, 5, 7, 3, 14, 14, 14},
+    {13, 9, 9, 8, 4, 5, 5, 1, 7, 2, 1, 7, 7, 13, 13, 13},
+    {14, 13, 13, 8, 4, 1, 1, 2, 3, 2, 1, 4, 4, 9, 9, 9},
+    {10, 14, 14, 8, 4, 2, 2, 6, 3, 2, 2, 5, 0, 4, 12, 12},
+    {15, 10, 10, 11, 7, 6, 6, 3, 3, 6, 2, 5, 5, 0, 12, 8},
+    {15, 15, 11, 11, 7, 7, 3, 3, 6, 6, 1, 1, 1, 0, 8, 8},
+};
+
+// Quick check: Adjacent LEDs in the same channel must have different color
+static const uint8_t tlc_index_color[SCREEN_SIZE_X][SCREEN_SIZE_Y] = {
+    {1, 0, 2, 1, 0, 2, 1, 0, 0, 1, 2, 1, 2, 1, 0, 2},
+    {2, 1, 0, 2, 1, 0, 2, 2, 2, 1, 0, 0, 1, 1, 0, 2},
+    {0, 1, 2, 0, 1, 2, 0, 1, 1, 1, 2, 0, 2, 1, 0, 2},
+    {2, 1, 2, 0, 2, 0, 1, 2, 0, 2, 0, 2, 1, 1, 0, 2},
+    {2, 1, 0, 1, 1, 0, 1, 2, 2, 2, 0, 1, 0, 1, 0, 2},
+    {2, 1, 0, 0, 0, 0, 1, 2, 1, 0, 1, 2, 0, 1, 0, 2},
+    {2, 1, 0, 2, 2, 0, 1, 2, 0, 1, 0, 2, 1, 1, 1, 0},
+    {2, 1, 0, 1, 1, 0, 1, 2, 2, 2, 2, 1, 0, 2, 2, 1},
+    {0, 1, 2, 0, 0, 2, 1, 0, 1, 0, 1, 0, 2, 0, 0, 2},
+};
+
+// Position of the LED at (x, y) in a frame
+static inline int tlc_frame_index(int x, int y) {
+    return (tlc_index_chip[x][y] * 16 + tlc_index_channel[x][y]) * 3 + tlc_index_color[x][y];
+}
+
+// Every command starts with two ASCII bytes
+// 'G', 'O': grayscale frame, followed by TLC_FRAME_VALUE_COUNT 16-bit values (higher byte first)
+// 'G', '8': grayscale frame at half the bytes, followed by TLC_FRAME_VALUE_COUNT 8-bit values, see tlc_expand_8bit()
+// 'G', 'B': batch of grayscale frames, followed by 1 byte frame count, 1 byte padding size, 4 bytes frame interval (us),
+//           the frames as in 'G', 'O', then as many padding bytes, which are ignored. The Teensy queues the frames
+//           and shifts one out every interval (as soon as it can if 0). While the queue is full it waits for room,
+//           so it answers once the last frame is queued. Any other command that changes the LEDs drops the queue
+// 'R', 'T': reboot the Teensy
+// 'I', 'P': keyframe interpolation mode, followed by
+//           1 byte enable flag, 4 bytes keyframe interval (us), 4 bytes refresh interval (us)
+// Procedural effects, expanded into a frame on the Teensy:
+// 'F', 'L': fill, followed by a 16-bit value
+// 'Z', 'N': set zone, followed by a ZONE_MASK_SIZE bytes LED mask and a 16-bit value
+// 'F', 'D': fade, followed by 16-bit from and to values and a 16-bit number of refresh intervals
+// 'G', 'D': gradient, followed by 1 byte axis (GRADIENT_AXIS_X or _Y) and 16-bit from and to values
+// 'B', 'C': control register, followed by 7-bit global brightness (red, green, blue)
+//           and 3-bit max current (red, green, blue), one byte each. The grayscale data is left alone
+// 'D', 'C': dot correction, followed by TLC_FRAME_VALUE_COUNT 7-bit values in frame order
+//           and 1 byte persist flag. If set, the Teensy stores them in EEPROM and loads them at startup
+// 'C', 'R': credit-based flow control, followed by 1 byte enable flag.
+//           The Teensy answers 'C', 'R' and the number of commands it can buffer (0 when disabled)
+// 'T', 'S': timestamps in the feedback, followed by 1 byte enable flag. Once enabled, the Teensy answers
+//           'D', 'T' instead of 'D', 'N', followed by its micros() when it started receiving the command (4 bytes),
+//           then the microseconds from there to the command received, from there to the frame shifted out,
+//           and from there to the frame latched (2 bytes each, at most 65535). The last two are 0 if nothing was shifted
+// 'H', 'I': hello, followed by 1 byte protocol version of the host. The Teensy answers right away with 'H', 'I' and
+//           HELLO_FEEDBACK_SIZE bytes: its protocol version, TLC count, LEDs per chip, color channels,
+//           the TLC_FEATURE_* it supports (2 bytes), its credit depth, frame queue depth and batch size.
+//           A new host starts from the state of setup() without a reboot: flow control, timestamps, interpolation,
+//           fades and queued frames are off, and the control register and dot correction are those of setup().
+//           The frame on the LEDs stays
+// The Teensy answers 'D', 'N' after every command except 'R', 'T', 'C', 'R' and 'H', 'I'.
+// With flow control enabled, the host may have up to that many commands in flight instead of one:
+// every command takes a credit, and the Teensy gives them back in batches with 'A', 'K' and a count,
+// once TLC_CREDIT_ACK_BATCH commands are done or when it runs out of input, instead of 'D', 'N'
+// All multi-byte values are sent higher byte first
+#define INTERPOLATION_PAYLOAD_SIZE 9
+#define FRAME8_PAYLOAD_SIZE TLC_FRAME_VALUE_COUNT
+#define FILL_PAYLOAD_SIZE 2
+#define ZONE_PAYLOAD_SIZE (ZONE_MASK_SIZE + 2)
+#define FADE_PAYLOAD_SIZE 6
+#define GRADIENT_PAYLOAD_SIZE 5
+#define CONTROL_PAYLOAD_SIZE 6
+#define DOT_CORRECTION_PAYLOAD_SIZE (TLC_FRAME_VALUE_COUNT + 1)
+#define FLOW_CONTROL_PAYLOAD_SIZE 1
+#define TIMESTAMPS_PAYLOAD_SIZE 1
+#define TIMESTAMP_FEEDBACK_SIZE 10  // After 'D', 'T'
+#define BATCH_HEADER_SIZE 6  // Before the frames of 'G', 'B'
+#define HELLO_PAYLOAD_SIZE 1
+#define HELLO_FEEDBACK_SIZE 9  // After 'H', 'I'
+
+// The longest command, 'G', 'O'
+#define TLC_MAX_COMMAND_SIZE (2 + 2 * TLC_FRAME_VALUE_COUNT)
+
+// Commands the Teensy buffers with flow control enabled. USB full speed carries about 4 frames per ms,
+// so 8 keep the link busy over a round trip of up to 2 ms
+#define TLC_CREDIT_DEPTH 8
+#define TLC_CREDIT_ACK_BATCH 4
+
+// Frames the Teensy queues from 'G', 'B'. The host sends at most TLC_BATCH_MAX_FRAMES at once,
+// so that the next batch fits while the Teensy shows the previous one
+#define TLC_FRAME_QUEUE_DEPTH 16
+#define TLC_BATCH_MAX_FRAMES 8
+
+// Bulk packets of USB full speed
+#define TLC_USB_PACKET_SIZE 64
+
+// The host sends this many zeros before 'H', 'I': they complete any command a previous host cut short,
+// a whole aligned batch at most, and the sketch skips the rest while it resynchronizes
+#define TLC_HELLO_FILLER_SIZE (2 + BATCH_HEADER_SIZE + TLC_BATCH_MAX_FRAMES * 2 * TLC_FRAME_VALUE_COUNT + TLC_USB_PACKET_SIZE)
+
+// Answered in 'H', 'I'. Each version of the protocol keeps the commands of the ones before
+#define TLC_PROTOCOL_VERSION 1
+
+// What a sketch answering 'H', 'I' may support, besides 'G', 'O', 'R', 'T' and 'H', 'I' themselves
+#define TLC_FEATURE_BATCH 0x01           // 'G', 'B'
+#define TLC_FEATURE_INTERPOLATION 0x02   // 'I', 'P'
+#define TLC_FEATURE_EFFECTS 0x04         // 'F', 'L', 'Z', 'N', 'F', 'D' and 'G', 'D'
+#define TLC_FEATURE_CONTROL 0x08         // 'B', 'C'
+#define TLC_FEATURE_DOT_CORRECTION 0x10  // 'D', 'C'
+#define TLC_FEATURE_FLOW_CONTROL 0x20    // 'C', 'R'
+#define TLC_FEATURE_TIMESTAMPS 0x40      // 'T', 'S'
+#define TLC_FEATURE_FRAME8 0x80          // 'G', '8'
+#define TLC_FEATURES_ALL 0xFF            // This version of the sketch
+
+// Padding that makes a batch of frames a whole number of USB packets
+static inline int tlc_batch_padding(int frames) {
+    int size = 2 + BATCH_HEADER_SIZE + frames * 2 * TLC_FRAME_VALUE_COUNT;
+    return (TLC_USB_PACKET_SIZE - size % TLC_USB_PACKET_SIZE) % TLC_USB_PACKET_SIZE;
+}
+
+// Ranges of the TLC5955 control register
+// Global brightness scales the current from 10% (0) to 100% (127) of the max current
+#define BRIGHTNESS_CONTROL_MAX 127
+#define MAX_CURRENT_MAX 7
+
+// Dot correction scales the current of one LED from 26.2% (0) to 100% (127) of the max current
+#define DOT_CORRECTION_MAX 127
+#define DOT_CORRECTION_MIN_FRACTION 0.262
+
+// One bit per LED, bit (x * SCREEN_SIZE_Y + y), most significant bit of the first byte first
+#define ZONE_MASK_SIZE ((SCREEN_SIZE_X * SCREEN_SIZE_Y + 7) / 8)
+
+#define GRADIENT_AXIS_X 0
+#define GRADIENT_AXIS_Y 1
+
+// Fixed-point weight of the linear interpolation, 16 fractional bits
+#define INTERPOLATION_WEIGHT_ONE 65536UL
+
+// Weight of the newest keyframe elapsed_us after it arrived
+// Clamped to INTERPOLATION_WEIGHT_ONE once the keyframe interval has passed
+static inline uint32_t tlc_interpolation_weight(uint32_t elapsed_us, uint32_t keyframe_interval_us) {
+    if (keyframe_interval_us == 0 || elapsed_us >= keyframe_interval_us) {
+        return INTERPOLATION_WEIGHT_ONE;
+    }
+    // One 64-bit division per refresh tick, not per LED
+    return (uint32_t)(((uint64_t)elapsed_us << 16) / keyframe_interval_us);
+}
+
+// out = from + (to - from) * weight / 65536, for every value of the frame
+// from * (65536 - weight) + to * weight <= 65535 * 65536, which fits in 32 bits,
+// so the Cortex-M4 needs two multiply-accumulates and a shift per value
+static inline void tlc_interpolate_frame(uint16_t* out, const uint16_t* from, const uint16_t* to, uint32_t weight) {
+    const uint32_t inverse_weight = INTERPOLATION_WEIGHT_ONE - weight;
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        out[i] = (uint16_t)(((uint32_t)from[i] * inverse_weight + (uint32_t)to[i] * weight) >> 16);
+    }
+}
+
+// The 8-bit values of 'G', '8' span the whole grayscale range: 0 is 0, and 255 is 65535
+#define FRAME8_STEP 257
+
+static inline void tlc_expand_8bit(uint16_t* frame, const uint8_t* values) {
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        frame[i] = (uint16_t)(values[i] * FRAME8_STEP);
+    }
+}
+
+static inline void tlc_fill_frame(uint16_t* frame, uint16_t value) {
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        frame[i] = value;
+    }
+}
+
+static inline void tlc_zone_mask_set(uint8_t* mask, int x, int y) {
+    int bit = x * SCREEN_SIZE_Y + y;
+    mask[bit / 8] |= (uint8_t)(0x80 >> (bit % 8));
+}
+
+// Set the LEDs selected by the mask to value
+static inline void tlc_fill_zone(uint16_t* frame, const uint8_t* mask, uint16_t value) {
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            int bit = x * SCREEN_SIZE_Y + y;
+            if (mask[bit / 8] & (0x80 >> (bit % 8))) {
+                frame[tlc_frame_index(x, y)] = value;
+            }
+        }
+    }
+}
+
+// Linear gradient from the first to the last LED along the axis
+static inline void tlc_gradient_frame(uint16_t* frame, uint8_t axis, uint16_t from, uint16_t to) {
+    const int steps = (axis == GRADIENT_AXIS_X ? SCREEN_SIZE_X : SCREEN_SIZE_Y) - 1;
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            int position = axis == GRADIENT_AXIS_X ? x : y;
+            frame[tlc_frame_index(x, y)] = (uint16_t)(((uint32_t)from * (steps - position) + (uint32_t)to * position) / steps);
+        }
+    }
+}
+
+#endif  // TLC_PROTOCOL_H
@@ -3,8 +3,11 @@
 // Updated 01/09/2017
 
 #include <SPI.h>
+#include <EEPROM.h>
 #include <TLC5955.h>
 
+#include "TLCprotocol.h"
+
 TLC5955 tlc;
 
 #define GSCLK 10  // On Teensy 3.2
@@ -18,16 +21,76 @@ TLC5955 tlc;
 
 #define GSCLK_FREQUENCY 2 * 60 * 65535  // Multiple of FPS * brightness PWM resolution
 
+// Dot correction stored by the host: 2 bytes 'D', 'C', then TLC_FRAME_VALUE_COUNT bytes
+#define DOT_CORRECTION_EEPROM_ADDRESS 0
+
 // Unused pins that are connected to other pins to simplify the PCB layout
 const int passive_pins[] = {2, 3, 4, 5, 16, 20, 21, 22};
 
 elapsedMicros timer_0;  // automatically incremented, must be global
 
+// The frame on the LEDs, in the order of the serial protocol
+uint16_t frame_shown[TLC_FRAME_VALUE_COUNT] = {0};
+
+// Keyframe interpolation: the LEDs are refreshed every refresh_interval_us
+// with a frame interpolated between the last two keyframes from the host
+bool interpolation_enabled = false;
+uint32_t keyframe_interval_us = 16667;  // 60 keyframes per second
+uint32_t refresh_interval_us = 4167;    // 240 FPS
+uint16_t keyframe_from[TLC_FRAME_VALUE_COUNT] = {0};
+uint16_t keyframe_to[TLC_FRAME_VALUE_COUNT] = {0};
+elapsedMicros keyframe_timer;  // Time since the newest keyframe arrived
+elapsedMicros refresh_timer;   // Time since the last interpolated frame was shifted out
+
+// Fades run from keyframe_from to keyframe_to over fade_refresh_count refresh intervals
+// Not fading if fade_refresh_count is 0
+uint16_t fade_refresh_count = 0;
+uint16_t fade_refresh_index = 0;
+
+// The commands from the host are moved from the USB buffers into this ring as soon as they arrive,
+// so that the host can have TLC_CREDIT_DEPTH of them in flight with flow control
+#define INPUT_RING_SIZE (TLC_CREDIT_DEPTH * TLC_MAX_COMMAND_SIZE)
+uint8_t input_ring[INPUT_RING_SIZE];
+uint16_t input_head = 0;
+uint16_t input_count = 0;
+
+// Frames from 'G', 'B', shifted out one every queue_interval_us[] after the previous one
+uint16_t frame_queue[TLC_FRAME_QUEUE_DEPTH][TLC_FRAME_VALUE_COUNT];
+uint32_t queue_interval_us[TLC_FRAME_QUEUE_DEPTH];
+uint8_t queue_head = 0;
+uint8_t queue_count = 0;
+elapsedMicros queue_timer;  // Time since the last queued frame was shifted out
+
+// Credit-based flow control, see TLCprotocol.h
+bool flow_control_enabled = false;
+uint8_t acks_pending = 0;  // Commands done, not acknowledged yet
+
+// micros() at each step of the command being executed, for the feedback with timestamps
+bool timestamps_enabled = false;
+bool stamped = false;  // Set once the command is received
+uint32_t stamp_start, stamp_received, stamp_shifted, stamp_latched;
+
 void serial_control();
 void PWM_control(int mDelay = 10, int led1 = 4, int led2 = 8 + LEDS_PER_CHIP);  // Default configurations for testing
 int getSerialInt();
 void testing_program();
 void receiveFrameUpdate();
+void receiveInterpolationMode();
+void receiveFade();
+void receiveControl();
+void receiveDotCorrection();
+void loadDotCorrection();
+void setDotCorrection(const uint8_t *dc);
+void interpolationTick();
+void receiveFlowControl();
+void receiveTimestamps();
+void receiveHello();
+void stampReceived();
+void receiveBatch();
+void queueTick();
+void refreshTick();
+void acknowledge();
+int inputAvailable();
 
 void setup() {
     // USB is always 12 Mbit/sec for Teensy
@@ -64,6 +127,8 @@ void setup() {
 
     // We must set dot correction values, so set them all to the brightest adjustment
     tlc.setAllDcData(127);
+    // Unless the host has stored a uniformity calibration, see receiveDotCorrection()
+    loadDotCorrection();
 
     // Perform Dot Correction (DC) here
     // Dot Correction controls the maximum current of each OUT pin
@@ -98,7 +163,19 @@ void setup() {
 }
 
 void loop() {
+    inputAvailable();  // Keep the USB buffers empty
     receiveFrameUpdate();
+    refreshTick();
+}
+
+void refreshTick() {
+    // What loop() does besides receiving commands, also done while waiting for room in the frame queue
+    if (queue_count > 0) {
+        queueTick();
+    }
+    if (interpolation_enabled || fade_refresh_count > 0) {
+        interpolationTick();
+    }
 }
 
 void testing_program() {
@@ -203,56 +280,54 @@ int getSerialInt() {
     return i;
 }
 
-void receiveFrameUpdate() {
-    while (1) {
-        // Detect the start of update
-        int a, b;
-        while (!Serial.available())
-            ;
-        a = Serial.read();  // Read the first byte
-        while (!Serial.available())
-            ;
-        b = Serial.peek();  // Peek the second byte
-        if (a == 'G' && b == 'O') {
-            // The start of the update
-            // Pop the second byte from the stream
-            Serial.read();
-            break;
-        }
-        if (a == 'R' && b == 'T') {
-            // Just connected
-            // Need to reboot to boost serial speed for some reason
+int inputAvailable() {
+    // Move what has arrived into the ring, as much as fits
+    while (input_count < INPUT_RING_SIZE && Serial.available()) {
+        input_ring[(input_head + input_count) % INPUT_RING_SIZE] = Serial.read();
+        input_count++;
+    }
+    return input_count;
+}
 
-            // Write the value for restart to the Application Interrupt and Reset Control location
-            (*(volatile uint32_t *)0xE000ED0C) = 0x05FA0004;
-            // _reboot_Teensyduino_();  // Much slower
-        }
+int inputPeek() {
+    return input_count > 0 ? input_ring[input_head] : -1;
+}
+
+int inputRead() {
+    if (input_count == 0) {
+        return -1;
+    }
+    uint8_t b = input_ring[input_head];
+    input_head = (input_head + 1) % INPUT_RING_SIZE;
+    input_count--;
+    return b;
+}
+
+int readSerialByte() {
+    while (!inputAvailable())
+        ;
+    return inputRead();
+}
+
+uint32_t readSerialUint32() {
+    // Higher byte first, as the grayscale values
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value = (value << 8) | (uint32_t)(readSerialByte() & 0xFF);
     }
+    return value;
+}
 
-    uint16_t bright;
-    int high_byte, low_byte;  // May be -1 if not available
+void shiftFrame(const uint16_t *frame) {
+    int index = 0;
     for (int i = 0; i < TLC_COUNT; i++) {
         for (int j = 0; j < LEDS_PER_CHIP; j++) {
             for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
-                while (!Serial.available())
-                    ;
-                high_byte = Serial.read();  // Receive the higher byte first
-                while (!Serial.available())
-                    ;
-                low_byte = Serial.read();  // Then the lower byte
-                bright = ((uint16_t)high_byte) << 8;
-                bright |= (uint16_t)(low_byte & 0x00FF);
-                tlc.setLEDpin(i, j, k, bright);
+                tlc.setLEDpin(i, j, k, frame[index++]);
             }
         }
     }
 
-    // Optional, for driver chips' testing.
-    // Because the drivers are not well connected at startup, i.e. void setup(),
-    // Teensy needs to make sure the control bits are configured after connection
-    // It will lower the frame rate significantly
-    // tlc.updateControl();
-
     // tlc.updateLeds();
     // This will upload the data and immediately update LEDs
     // The latency is not guaranteed
@@ -260,11 +335,413 @@ void receiveFrameUpdate() {
     // For synchronization with LCD screen, use the no_latch version
     // The data is uploaded, but the LEDs won't be updated until latch() is called
     tlc.updateLeds_no_latch();
+    stamp_shifted = micros();
     // Wait for synchronization signal from LCD screen (currently not implemented)
     tlc.latch();
+    stamp_latched = micros();
     // Refer to the data sheet for timing diagrams
+}
+
+uint16_t readSerialUint16() {
+    uint16_t value = ((uint16_t)readSerialByte()) << 8;  // Receive the higher byte first
+    value |= (uint16_t)(readSerialByte() & 0x00FF);        // Then the lower byte
+    return value;
+}
+
+uint16_t *beginFrame(bool queued = false) {
+    // Returns the frame that the following command should fill in
+    // Any new frame cancels a fade, and any frame not from the queue drops the queued frames
+    fade_refresh_count = 0;
+    if (!queued) {
+        queue_count = 0;
+    }
+    if (interpolation_enabled) {
+        // Interpolate from what is on the LEDs right now rather than from the previous keyframe,
+        // so that a late or early keyframe doesn't make the LEDs jump
+        memcpy(keyframe_from, frame_shown, sizeof(frame_shown));
+        memcpy(keyframe_to, frame_shown, sizeof(frame_shown));
+        return keyframe_to;
+    }
+    return frame_shown;
+}
+
+void endFrame() {
+    stampReceived();
+    if (interpolation_enabled) {
+        // The first interpolated frame is shifted out by interpolationTick()
+        keyframe_timer = 0;
+        refresh_timer = refresh_interval_us;
+    } else {
+        shiftFrame(frame_shown);
+    }
+}
+
+void receiveFrameUpdate() {
+    // Non-blocking: return if no command has arrived,
+    // so that loop() can keep shifting out interpolated frames
+    if (inputAvailable() < 2) {
+        return;
+    }
+
+    // Detect the start of update
+    int a, b;
+    a = inputRead();  // Read the first byte
+    b = inputPeek();  // Peek the second byte
+    stamp_start = micros();
+    stamped = false;
+    if (a == 'R' && b == 'T') {
+        // Just connected
+        // Need to reboot to boost serial speed for some reason
+        // (The driver only sends it when 'H', 'I' isn't answered, e.g. by an older sketch)
+
+        // Write the value for restart to the Application Interrupt and Reset Control location
+        (*(volatile uint32_t *)0xE000ED0C) = 0x05FA0004;
+        // _reboot_Teensyduino_();  // Much slower
+    }
+
+    uint16_t *frame;
+    if (a == 'G' && b == 'O') {
+        // The start of the update
+        // Pop the second byte from the stream
+        inputRead();
+        frame = beginFrame();
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            frame[i] = readSerialUint16();
+        }
+
+        // Optional, for driver chips' testing.
+        // Because the drivers are not well connected at startup, i.e. void setup(),
+        // Teensy needs to make sure the control bits are configured after connection
+        // It will lower the frame rate significantly
+        // tlc.updateControl();
+
+        endFrame();
+    } else if (a == 'G' && b == '8') {
+        inputRead();
+        uint8_t values[TLC_FRAME_VALUE_COUNT];
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            values[i] = readSerialByte();
+        }
+        frame = beginFrame();
+        tlc_expand_8bit(frame, values);
+        endFrame();
+    } else if (a == 'G' && b == 'B') {
+        inputRead();
+        receiveBatch();
+    } else if (a == 'I' && b == 'P') {
+        inputRead();
+        receiveInterpolationMode();
+    } else if (a == 'F' && b == 'L') {
+        inputRead();
+        uint16_t bright = readSerialUint16();
+        frame = beginFrame();
+        tlc_fill_frame(frame, bright);
+        endFrame();
+    } else if (a == 'Z' && b == 'N') {
+        inputRead();
+        uint8_t mask[ZONE_MASK_SIZE];
+        for (int i = 0; i < ZONE_MASK_SIZE; i++) {
+            mask[i] = readSerialByte();
+        }
+        uint16_t bright = readSerialUint16();
+        frame = beginFrame();
+        tlc_fill_zone(frame, mask, bright);
+        endFrame();
+    } else if (a == 'G' && b == 'D') {
+        inputRead();
+        uint8_t axis = readSerialByte();
+        uint16_t from = readSerialUint16();
+        uint16_t to = readSerialUint16();
+        frame = beginFrame();
+        tlc_gradient_frame(frame, axis, from, to);
+        endFrame();
+    } else if (a == 'F' && b == 'D') {
+        inputRead();
+        receiveFade();
+    } else if (a == 'B' && b == 'C') {
+        inputRead();
+        receiveControl();
+    } else if (a == 'D' && b == 'C') {
+        inputRead();
+        receiveDotCorrection();
+    } else if (a == 'C' && b == 'R') {
+        inputRead();
+        receiveFlowControl();
+        return;  // Answered with the credits
+    } else if (a == 'T' && b == 'S') {
+        inputRead();
+        receiveTimestamps();
+    } else if (a == 'H' && b == 'I') {
+        inputRead();
+        receiveHello();
+        return;  // Answered with what the sketch supports
+    } else {
+        // Not the start of a command, resynchronize on the next byte
+        return;
+    }
+
+    acknowledge();
+}
+
+void stampReceived() {
+    // Nothing shifted out yet: shiftFrame() moves the other two on
+    stamp_received = stamp_shifted = stamp_latched = micros();
+    stamped = true;
+}
+
+void writeSerialUint16(uint32_t value) {
+    // Saturated, higher byte first
+    if (value > 0xFFFF) {
+        value = 0xFFFF;
+    }
+    Serial.write((uint8_t)(value >> 8));
+    Serial.write((uint8_t)value);
+}
+
+void acknowledge() {
+    if (!stamped) {
+        stampReceived();
+    }
+    if (!flow_control_enabled && timestamps_enabled) {
+        // Feedback: done, and when
+        Serial.write('D');
+        Serial.write('T');
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            Serial.write((uint8_t)(stamp_start >> shift));
+        }
+        writeSerialUint16(stamp_received - stamp_start);
+        writeSerialUint16(stamp_shifted - stamp_received);
+        writeSerialUint16(stamp_latched - stamp_shifted);
+        return;
+    }
+    if (!flow_control_enabled) {
+        // Feedback: done
+        Serial.write('D');
+        Serial.write('N');
+        return;
+    }
+    // Give the credits back in batches, but don't keep them while the host waits for them
+    acks_pending++;
+    if (acks_pending >= TLC_CREDIT_ACK_BATCH || inputAvailable() == 0) {
+        Serial.write('A');
+        Serial.write('K');
+        Serial.write(acks_pending);
+        Serial.send_now();  // Rather than when the USB transmit timer runs out
+        acks_pending = 0;
+    }
+}
+
+void receiveTimestamps() {
+    timestamps_enabled = readSerialByte() != 0;
+}
+
+void receiveFlowControl() {
+    flow_control_enabled = readSerialByte() != 0;
+    acks_pending = 0;
+    Serial.write('C');
+    Serial.write('R');
+    Serial.write(flow_control_enabled ? TLC_CREDIT_DEPTH : 0);
+    Serial.send_now();
+}
+
+void receiveHello() {
+    // Every version of the protocol keeps the commands of the ones before, so the host adapts to this one
+    readSerialByte();
+
+    // Back to the state of setup() for the new host, without rebooting, and without touching the frame on the LEDs
+    flow_control_enabled = false;
+    acks_pending = 0;
+    timestamps_enabled = false;
+    interpolation_enabled = false;
+    fade_refresh_count = 0;
+    queue_count = 0;
+    tlc.setAllDcData(127);
+    loadDotCorrection();
+    tlc.setMaxCurrent(4, 4, 4);
+    tlc.setBrightnessCurrent(127, 127, 127);
+    tlc.updateControl();
+
+    Serial.write('H');
+    Serial.write('I');
+    Serial.write(TLC_PROTOCOL_VERSION);
+    Serial.write(TLC_COUNT);
+    Serial.write(LEDS_PER_CHIP);
+    Serial.write(COLOR_CHANNEL_COUNT);
+    Serial.write((uint8_t)(TLC_FEATURES_ALL >> 8));
+    Serial.write((uint8_t)TLC_FEATURES_ALL);
+    Serial.write(TLC_CREDIT_DEPTH);
+    Serial.write(TLC_FRAME_QUEUE_DEPTH);
+    Serial.write(TLC_BATCH_MAX_FRAMES);
+    Serial.send_now();
+}
+
+void receiveBatch() {
+    uint8_t count = readSerialByte();
+    uint8_t padding = readSerialByte();
+    uint32_t interval = readSerialUint32();
+    for (int n = 0; n < count; n++) {
+        // Keep showing the queued frames while waiting for room
+        while (queue_count == TLC_FRAME_QUEUE_DEPTH) {
+            refreshTick();
+        }
+        int slot = (queue_head + queue_count) % TLC_FRAME_QUEUE_DEPTH;
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            frame_queue[slot][i] = readSerialUint16();
+        }
+        queue_interval_us[slot] = interval;
+        queue_count++;
+    }
+    for (int i = 0; i < padding; i++) {
+        readSerialByte();
+    }
+    // Whatever was shifted out meanwhile came from the queue: the batch itself is only received
+    stamped = false;
+}
+
+void queueTick() {
+    uint32_t interval = queue_interval_us[queue_head];
+    if (queue_timer < interval) {
+        return;
+    }
+    // Keep the cadence of the batch, unless the queue ran dry for more than a frame
+    if (queue_timer >= 2 * interval) {
+        queue_timer = 0;
+    } else {
+        queue_timer -= interval;
+    }
+
+    uint16_t *frame = beginFrame(true);
+    memcpy(frame, frame_queue[queue_head], sizeof(frame_shown));
+    queue_head = (queue_head + 1) % TLC_FRAME_QUEUE_DEPTH;
+    queue_count--;
+    endFrame();
+}
+
+void receiveInterpolationMode() {
+    bool enable = readSerialByte() != 0;
+    uint32_t keyframe_interval = readSerialUint32();
+    uint32_t refresh_interval = readSerialUint32();
+
+    if (enable && keyframe_interval > 0 && refresh_interval > 0) {
+        keyframe_interval_us = keyframe_interval;
+        refresh_interval_us = refresh_interval;
+        if (!interpolation_enabled) {
+            // Hold the current frame until the first keyframe arrives
+            memcpy(keyframe_from, frame_shown, sizeof(frame_shown));
+            memcpy(keyframe_to, frame_shown, sizeof(frame_shown));
+        }
+        interpolation_enabled = true;
+    } else if (interpolation_enabled) {
+        // Jump to the newest keyframe
+        interpolation_enabled = false;
+        fade_refresh_count = 0;
+        memcpy(frame_shown, keyframe_to, sizeof(frame_shown));
+        stampReceived();
+        shiftFrame(frame_shown);
+    }
+}
+
+void receiveFade() {
+    uint16_t from = readSerialUint16();
+    uint16_t to = readSerialUint16();
+    uint16_t refresh_count = readSerialUint16();
+
+    beginFrame();
+    tlc_fill_frame(keyframe_from, from);
+    tlc_fill_frame(keyframe_to, to);
+    if (refresh_count == 0) {
+        // Nothing to fade, jump to the end
+        memcpy(frame_shown, keyframe_to, sizeof(frame_shown));
+        stampReceived();
+        shiftFrame(frame_shown);
+        return;
+    }
+    // Shift out the first frame of the fade right away
+    fade_refresh_count = refresh_count;
+    fade_refresh_index = 0;
+    refresh_timer = refresh_interval_us;
+}
+
+void receiveControl() {
+    uint8_t bright[COLOR_CHANNEL_COUNT], max_current[COLOR_CHANNEL_COUNT];
+    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+        bright[k] = readSerialByte() & BRIGHTNESS_CONTROL_MAX;
+    }
+    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+        max_current[k] = readSerialByte();  // Clamped by setMaxCurrent()
+    }
+
+    tlc.setBrightnessCurrent(bright[0], bright[1], bright[2]);
+    tlc.setMaxCurrent(max_current[0], max_current[1], max_current[2]);
+
+    // Only the control latch is written, the grayscale latch keeps the current frame
+    tlc.updateControl();
+}
+
+void receiveDotCorrection() {
+    uint8_t dc[TLC_FRAME_VALUE_COUNT];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        dc[i] = readSerialByte() & DOT_CORRECTION_MAX;
+    }
+    bool persist = readSerialByte() != 0;
+
+    setDotCorrection(dc);
+    tlc.updateControl();
+
+    if (persist) {
+        // update() only writes the bytes that changed, to save EEPROM wear
+        EEPROM.update(DOT_CORRECTION_EEPROM_ADDRESS, 'D');
+        EEPROM.update(DOT_CORRECTION_EEPROM_ADDRESS + 1, 'C');
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            EEPROM.update(DOT_CORRECTION_EEPROM_ADDRESS + 2 + i, dc[i]);
+        }
+    }
+}
+
+void loadDotCorrection() {
+    // Called in setup(), before the control register is written
+    if (EEPROM.read(DOT_CORRECTION_EEPROM_ADDRESS) != 'D' || EEPROM.read(DOT_CORRECTION_EEPROM_ADDRESS + 1) != 'C') {
+        return;  // Never calibrated
+    }
+    uint8_t dc[TLC_FRAME_VALUE_COUNT];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        dc[i] = EEPROM.read(DOT_CORRECTION_EEPROM_ADDRESS + 2 + i) & DOT_CORRECTION_MAX;
+    }
+    setDotCorrection(dc);
+}
 
-    // Feedback: done
-    Serial.write('D');
-    Serial.write('N');
+void setDotCorrection(const uint8_t *dc) {
+    int index = 0;
+    for (int i = 0; i < TLC_COUNT; i++) {
+        for (int j = 0; j < LEDS_PER_CHIP; j++) {
+            for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                tlc.setLedDc(i, j, k, dc[index++]);
+            }
+        }
+    }
+}
+
+void interpolationTick() {
+    // Shift out one interpolated frame every refresh_interval_us
+    if (refresh_timer < refresh_interval_us) {
+        return;
+    }
+    refresh_timer = 0;
+
+    uint32_t weight;
+    if (fade_refresh_count > 0) {
+        // Fades count refresh intervals instead of time, so that every step is shown
+        weight = tlc_interpolation_weight(fade_refresh_index, fade_refresh_count);
+        if (fade_refresh_index++ == fade_refresh_count) {
+            fade_refresh_count = 0;
+            if (interpolation_enabled) {
+                // Hold the end of the fade until the next keyframe
+                memcpy(keyframe_from, keyframe_to, sizeof(keyframe_to));
+            }
+        }
+    } else {
+        weight = tlc_interpolation_weight(keyframe_timer, keyframe_interval_us);
+    }
+    tlc_interpolate_frame(frame_shown, keyframe_from, keyframe_to, weight);
+    shiftFrame(frame_shown);
 }
@@ -133,6 +133,8 @@ int serialport_readByte(int fd, int timeout)
     char b[1];  // read expects an array, so we give it a 1-byte array
     do { 
         int n = read(fd, b, 1);  // read a char at a time
+        // The port is opened with O_NONBLOCK, so no data yet is EAGAIN rather than 0
+        if( n==-1 && (errno==EAGAIN || errno==EWOULDBLOCK) ) n = 0;
         if( n==-1) return -1;    // couldn't read
         if( n==0 ) {
             usleep( 1 * 1000 );  // wait 1 msec try again
@@ -147,7 +149,7 @@ int serialport_readByte(int fd, int timeout)
         break;
 
     } while(timeout > 0);
-    return b[0];
+    return (unsigned char)b[0];  // Bytes from 0x80 up would read as errors
 }
 
 //
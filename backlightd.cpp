@@ -0,0 +1,346 @@
+/*
+-----------------------Backlight Daemon--------------------------------
+Keeps the Teensy 3.2's serial port open, so that programs showing frames
+on the backlight pay the reboot and the port setup once, when the daemon starts.
+Clients register over a Unix socket and publish frames through shared memory,
+see HDR-backlight-client.hpp. The highest priority client publishing frames
+owns the LEDs; when it stops for --hold ms, the next one takes over.
+
+Usage: backlightd [--port /dev/ttyACM0] [--baud 9600] [--fps 240] [--hold 500]
+                  [--socket /tmp/backlightd.sock] [--group <name>] [--realtime]
+--fps is the rate at which the daemon checks for new frames, not the rate of the frames sent.
+The socket and the shared memory are for the daemon's user only, or with --group, for that group too.
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>  // For wall clock, since c++11
+#include <string>
+#include <algorithm>  // std::max
+#include <csignal>  // SIGINT, SIGTERM
+#include <cstring>  // strcmp()
+#include <new>      // placement new
+#include <cerrno>   // errno
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>  // chmod(), fchmod()
+#include <grp.h>       // getgrnam()
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "HDR-backlight-driver.hpp"
+#include "HDR-backlight-client.hpp"
+
+using hdrbacklightdriverjli::BacklightShm;
+using hdrbacklightdriverjli::BacklightSlot;
+using hdrbacklightdriverjli::FramePacer;
+using hdrbacklightdriverjli::StampedFrame;
+using hdrbacklightdriverjli::TLCdriver;
+
+using std::cerr;
+using std::clog;
+using std::endl;
+
+volatile std::sig_atomic_t stop = 0;
+
+void onSignal(int) {
+    stop = 1;
+}
+
+struct Client {
+    int socket = -1;  // -1: free slot
+    int priority = 0;
+    std::string line;  // Command being received
+    std::chrono::steady_clock::time_point last_frame;
+    bool has_frame = false;
+
+    // Frames shown, and their latency from publish() to the Teensy's feedback
+    unsigned long frames = 0;
+    unsigned long dropped_before = 0;  // By the slot's earlier clients
+    double latency_sum_us = 0;
+    double latency_max_us = 0;
+};
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string answer(int slot, Client& client, BacklightSlot& shared, TLCdriver& TLCteensy, const std::string& command) {
+    int value;
+    if (sscanf(command.c_str(), "HELLO %d", &value) == 1 || sscanf(command.c_str(), "PRIORITY %d", &value) == 1) {
+        client.priority = value;
+        return command[0] == 'H' ? "OK " + std::to_string(slot) + " " + std::to_string(shared.generation.load()) : "OK";
+    }
+    if (sscanf(command.c_str(), "BRIGHTNESS %d", &value) == 1) {
+        if (value < 0 || value > BRIGHTNESS_CONTROL_MAX) {
+            return "ERROR brightness out of range";
+        }
+        TLCteensy.setGlobalBrightness((uint8_t)value);
+        return "OK";
+    }
+    if (command == "STATS") {
+        char stats[160];
+        snprintf(stats, sizeof(stats), "OK frames=%lu dropped=%lu latency_mean_us=%.1f latency_max_us=%.1f", client.frames,
+                 shared.mailbox.dropped() - client.dropped_before, client.frames ? client.latency_sum_us / client.frames : 0.0, client.latency_max_us);
+        return stats;
+    }
+    return "ERROR unknown command";
+}
+
+int main(int argc, char** argv) {
+    const char* port = DEFAULT_SERIAL_PORT;
+    const char* socket_path = BACKLIGHTD_SOCKET_PATH;
+    const char* group = nullptr;
+    int baud = 9600;
+    double fps = 240;
+    int hold_ms = 500;
+    bool realtime = false;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--port") && has_value) {
+            port = argv[++i];
+        } else if (!strcmp(argv[i], "--baud") && has_value) {
+            baud = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--fps") && has_value) {
+            fps = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--hold") && has_value) {
+            hold_ms = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--socket") && has_value) {
+            socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "--group") && has_value) {
+            group = argv[++i];
+        } else if (!strcmp(argv[i], "--realtime")) {
+            realtime = true;
+        } else {
+            cerr << "Usage: backlightd [--port P] [--baud B] [--fps F] [--hold ms] [--socket path] [--group name] [--realtime]" << endl;
+            return 1;
+        }
+    }
+    if (fps <= 0) {
+        cerr << "backlightd: --fps must be positive" << endl;
+        return 1;
+    }
+
+    // Whoever can open the socket and the shared memory drives the backlight
+    mode_t mode = 0600;
+    gid_t gid = (gid_t)-1;
+    if (group != nullptr) {
+        struct group* entry = getgrnam(group);
+        if (entry == nullptr) {
+            cerr << "backlightd: unknown group " << group << endl;
+            return 1;
+        }
+        mode = 0660;
+        gid = entry->gr_gid;
+    }
+
+    // The shared memory, one mailbox per client slot
+    shm_unlink(BACKLIGHTD_SHM_NAME);
+    int shm_fd = shm_open(BACKLIGHTD_SHM_NAME, O_CREAT | O_RDWR, mode);
+    if (shm_fd == -1 || ftruncate(shm_fd, sizeof(BacklightShm)) != 0 || fchown(shm_fd, (uid_t)-1, gid) != 0 || fchmod(shm_fd, mode) != 0) {
+        perror("backlightd: couldn't create the shared memory\n\t");
+        return 1;
+    }
+    void* shm_memory = mmap(NULL, sizeof(BacklightShm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm_memory == MAP_FAILED) {
+        perror("backlightd: couldn't map the shared memory\n\t");
+        return 1;
+    }
+    BacklightShm* shm = (BacklightShm*)shm_memory;
+    shm->max_clients = BACKLIGHTD_MAX_CLIENTS;
+    for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+        new (&shm->slot[slot]) BacklightSlot();
+    }
+
+    // The control socket
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    unlink(socket_path);
+    if (listener == -1 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, BACKLIGHTD_MAX_CLIENTS) != 0) {
+        perror("backlightd: couldn't listen on the socket\n\t");
+        return 1;
+    }
+    if (chown(socket_path, (uid_t)-1, gid) != 0 || chmod(socket_path, mode) != 0) {
+        perror("backlightd: couldn't set the permissions of the socket\n\t");
+        return 1;
+    }
+
+    // Pays the reboot once, for every client
+    TLCdriver TLCteensy(port, baud);
+    if (TLCteensy.error() != TLC_OK) {
+        return 1;
+    }
+    TLCteensy.setAutoReconnect(true);  // The clients keep streaming through a glitch of the USB cable
+    TLCteensy.setAllLED(0);
+    TLCteensy.updateFrame();
+    if (realtime) {
+        TLCteensy.setRealtime();
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);  // A client closing its socket mustn't stop the daemon
+
+    // Clients can only write to a mailbox once they know its slot, so the magic is set last
+    shm->magic = BACKLIGHTD_MAGIC;
+    clog << "backlightd: listening on " << socket_path << endl;
+
+    Client clients[BACKLIGHTD_MAX_CLIENTS];
+    // When each slot was retired: a new client takes the slot retired the longest ago
+    std::chrono::steady_clock::time_point retired[BACKLIGHTD_MAX_CLIENTS];
+    for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+        retired[slot] = std::chrono::steady_clock::time_point::min();
+    }
+    // The slot's client is gone: a client still holding the slot's generation sees that it isn't connected anymore
+    auto retire = [&](int slot) {
+        close(clients[slot].socket);
+        clients[slot] = Client();
+        shm->slot[slot].generation.fetch_add(1, std::memory_order_release);
+        retired[slot] = std::chrono::steady_clock::now();
+    };
+    int owner = -1;
+    struct pollfd fds[BACKLIGHTD_MAX_CLIENTS + 1];
+    FramePacer pacer(fps);
+    while (!stop) {
+        // Control channel, without blocking the frame loop
+        fds[0] = {listener, POLLIN, 0};
+        for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+            fds[slot + 1] = {clients[slot].socket, POLLIN, 0};  // Negative fds are ignored by poll()
+        }
+        if (poll(fds, BACKLIGHTD_MAX_CLIENTS + 1, 0) > 0) {
+            if (fds[0].revents & POLLIN) {
+                // Non-blocking, so that a client that doesn't read its replies can't stall the frame loop
+                int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+                int slot = BACKLIGHTD_MAX_CLIENTS;
+                for (int free_slot = 0; free_slot < BACKLIGHTD_MAX_CLIENTS; free_slot++) {
+                    if (clients[free_slot].socket == -1 && (slot == BACKLIGHTD_MAX_CLIENTS || retired[free_slot] < retired[slot])) {
+                        slot = free_slot;
+                    }
+                }
+                if (fd != -1 && slot == BACKLIGHTD_MAX_CLIENTS) {
+                    const char full[] = "ERROR too many clients\n";
+                    (void)!write(fd, full, sizeof(full) - 1);
+                    close(fd);
+                } else if (fd != -1) {
+                    // Nothing left over from the previous client of the slot, retired when it left
+                    shm->slot[slot].mailbox.acquire();
+                    clients[slot] = Client();
+                    clients[slot].socket = fd;
+                    clients[slot].dropped_before = shm->slot[slot].mailbox.dropped();
+                }
+            }
+            for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+                Client& client = clients[slot];
+                if (client.socket == -1 || !(fds[slot + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                char buffer[256];
+                ssize_t n = read(client.socket, buffer, sizeof(buffer));
+                if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;  // Nothing after all
+                }
+                if (n <= 0) {
+                    retire(slot);
+                    continue;
+                }
+                for (ssize_t i = 0; i < n; i++) {
+                    if (buffer[i] != '\n') {
+                        client.line += buffer[i];
+                        if (client.line.size() > BACKLIGHTD_MAX_LINE) {
+                            cerr << "backlightd: client in slot " << slot << " sent a command too long, disconnected" << endl;
+                            retire(slot);
+                            break;
+                        }
+                        continue;
+                    }
+                    std::string reply = answer(slot, client, shm->slot[slot], TLCteensy, client.line) + '\n';
+                    if (write(client.socket, reply.data(), reply.size()) != (ssize_t)reply.size()) {
+                        cerr << "backlightd: client in slot " << slot << " doesn't read its replies, disconnected" << endl;
+                        retire(slot);
+                        break;
+                    }
+                    client.line.clear();
+                }
+            }
+        }
+
+        // Take the newest frame of every client, then show the owner's
+        auto now = std::chrono::steady_clock::now();
+        int new_owner = -1;
+        bool owner_fresh = false;
+        for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+            Client& client = clients[slot];
+            if (client.socket == -1) {
+                continue;
+            }
+            bool fresh = shm->slot[slot].mailbox.acquire();
+            // The indices are in the client's memory too, and a slot out of range would be read past the mailbox
+            if (shm->slot[slot].mailbox.checkedFront() == nullptr) {
+                cerr << "backlightd: client in slot " << slot << " broke its mailbox, disconnected" << endl;
+                shm->slot[slot].mailbox.reset();
+                retire(slot);
+                continue;
+            }
+            if (fresh) {
+                client.has_frame = true;
+                client.last_frame = now;
+            }
+            bool active = client.has_frame && now - client.last_frame < std::chrono::milliseconds(hold_ms);
+            if (active && (new_owner == -1 || client.priority > clients[new_owner].priority)) {
+                new_owner = slot;
+                owner_fresh = fresh;
+            }
+        }
+        // A new owner's frame is shown right away, even if it was published a while ago
+        // Checked again: the client may have changed the indices since
+        const StampedFrame* frame = new_owner != -1 ? shm->slot[new_owner].mailbox.checkedFront() : nullptr;
+        if (frame != nullptr && (owner_fresh || new_owner != owner)) {
+            TLCteensy.updateFrame(frame->frame);
+            if (owner_fresh) {
+                Client& client = clients[new_owner];
+                double latency_us = (nowNs() - frame->publish_ns) / 1000.0;
+                client.frames++;
+                client.latency_sum_us += latency_us;
+                client.latency_max_us = std::max(client.latency_max_us, latency_us);
+            }
+        }
+        owner = new_owner;
+
+        pacer.wait();
+    }
+
+    for (int slot = 0; slot < BACKLIGHTD_MAX_CLIENTS; slot++) {
+        if (clients[slot].socket != -1) {
+            close(clients[slot].socket);
+        }
+    }
+    close(listener);
+    unlink(socket_path);
+    shm_unlink(BACKLIGHTD_SHM_NAME);
+    clog << "backlightd: stopped, " << pacer.missed() << " missed ticks" << endl;
+}
@@ -26,11 +26,55 @@ SOFTWARE.
 */
 
 #include <iostream>
-#include <chrono>  // For wall clock, since c++11
+#include <chrono>     // For wall clock, since c++11
+#include <algorithm>  // std::max
+#include <cmath>      // std::abs
+#include <ctime>      // std::clock, for CPU time
+#include <thread>     // std::thread
+#include <atomic>     // std::atomic
+#include <mutex>      // std::mutex, the baseline for ConcurrentFrame
+#include <vector>     // std::vector
+#include <memory>     // std::unique_ptr
+#include <fstream>    // std::ifstream, for /proc
+#include <sstream>    // std::ostringstream
+#include <random>     // std::mt19937, for the delays of testTimestamps()
 
+#include "HDR-backlight-cache.hpp"
 #include "HDR-backlight-driver.hpp"
+#include "HDR-backlight-track.hpp"
+#include "HDR-backlight-yuv.hpp"
+#include "HDR-backlight-solver.hpp"
+#include "HDR-backlight-uring.hpp"
 
+#include <sys/resource.h>  // getrusage()
+
+using hdrbacklightdriverjli::BacklightSolver;
+using hdrbacklightdriverjli::BasicTLCdriver;
+using hdrbacklightdriverjli::ClockSync;
+using hdrbacklightdriverjli::BoundedQueue;
+using hdrbacklightdriverjli::CaptureTransport;
+using hdrbacklightdriverjli::ChangeGate;
+using hdrbacklightdriverjli::ConcurrentFrame;
+using hdrbacklightdriverjli::FrameCache;
+using hdrbacklightdriverjli::FrameMailbox;
+using hdrbacklightdriverjli::FramePacer;
+using hdrbacklightdriverjli::GSFrame;
+using hdrbacklightdriverjli::hashFrame;
+using hdrbacklightdriverjli::hlgDisplayLight;
+using hdrbacklightdriverjli::LinkHealth;
+using hdrbacklightdriverjli::LoopbackTransport;
+using hdrbacklightdriverjli::PtyBoard;
+using hdrbacklightdriverjli::PtyTransport;
+using hdrbacklightdriverjli::SerialTransport;
+using hdrbacklightdriverjli::signalToLight;
+using hdrbacklightdriverjli::SimulatedLinkTransport;
+using hdrbacklightdriverjli::SolverOptions;
+using hdrbacklightdriverjli::TemporalDither;
 using hdrbacklightdriverjli::TLCdriver;
+using hdrbacklightdriverjli::TrackReader;
+using hdrbacklightdriverjli::TrackWriter;
+using hdrbacklightdriverjli::UringTransport;
+using hdrbacklightdriverjli::YuvToLight;
 
 using std::clog;
 using std::endl;
@@ -78,15 +122,13 @@ void testLEDs(TLCdriver& TLCteensy) {
     // because the thread (CPU time) sleeps during communication for synchronization
     // Use wall time instead
     auto timer_start = std::chrono::system_clock::now();
-    auto time_step = std::chrono::microseconds(0);  // No delay, update as fast as possible
+    FramePacer pacer(0);  // No delay, update as fast as possible
     TLCteensy.setAllLED(0);
     TLCteensy.updateFrame();
     for (int x = 0; x < SCREEN_SIZE_X; x++) {
         for (int y = 0; y < SCREEN_SIZE_Y; y++) {
-            // Delay time_step microseconds
             auto temp_start = std::chrono::system_clock::now();
-            while (std::chrono::system_clock::now() - temp_start < time_step)
-                ;
+            pacer.wait();
 
             TLCteensy.setAllLED(0);
             TLCteensy.setLED(x, y, 0xFFFF);
@@ -105,12 +147,1350 @@ void testLEDs(TLCdriver& TLCteensy) {
     clog << (1 + SCREEN_SIZE_X * SCREEN_SIZE_Y) / wall_time_elapsed.count() << " frames per sec." << endl;
 }
 
+void testInterpolationKernel() {
+    // The Teensy runs the same fixed-point code from TLCprotocol.h
+    // Check it against floating point and time it on the host
+    uint16_t from[TLC_FRAME_VALUE_COUNT], to[TLC_FRAME_VALUE_COUNT], out[TLC_FRAME_VALUE_COUNT];
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        from[i] = (uint16_t)(i * 0x1C7);
+        to[i] = (uint16_t)(0xFFFF - i * 0x1C7);
+    }
+
+    double max_error = 0;
+    for (uint32_t elapsed = 0; elapsed <= 16667; elapsed += 97) {
+        uint32_t weight = tlc_interpolation_weight(elapsed, 16667);
+        tlc_interpolate_frame(out, from, to, weight);
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            double expected = from[i] + (to[i] - from[i]) * (elapsed / 16667.0);
+            max_error = std::max(max_error, std::abs(out[i] - expected));
+        }
+    }
+    clog << "Interpolation kernel: max error " << max_error << " LSB" << endl;
+
+    const int rounds = 100000;
+    volatile uint16_t sink = 0;  // Keep the loop from being optimized away
+    auto timer_start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        tlc_interpolate_frame(out, from, to, tlc_interpolation_weight(r % 16667, 16667));
+        sink = out[r % TLC_FRAME_VALUE_COUNT];
+    }
+    (void)sink;
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - timer_start;
+    clog << "Interpolation kernel: " << elapsed.count() / rounds << " ns per frame on the host" << endl;
+}
+
+void testPacer() {
+    // Pace 120 FPS for one second, sleeping in between
+    FramePacer pacer(120);
+    std::clock_t cpu_start = std::clock();
+    auto timer_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 120; i++) {
+        pacer.wait();
+    }
+    std::chrono::duration<double> wall_time_elapsed = std::chrono::steady_clock::now() - timer_start;
+    double cpu_time_elapsed = (double)(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    clog << "Frame pacer: 120 frames in " << wall_time_elapsed.count() << " s, " << pacer.missed() << " missed, ";
+    clog << "max " << std::chrono::duration<double, std::micro>(pacer.max_lateness()).count() << " us late, ";
+    clog << 100 * cpu_time_elapsed / wall_time_elapsed.count() << "% CPU" << endl;
+}
+
+void printJitter(TLCdriver& TLCteensy) {
+    TLCdriver::FrameStats stats = TLCteensy.stats();
+    clog << "updateFrame() over " << stats.frames << " frames: mean " << stats.mean_us << " us, jitter (stddev) " << stats.stddev_us;
+    clog << " us, min " << stats.min_us << " us, max " << stats.max_us << " us" << endl;
+    TLCteensy.resetStats();
+}
+
+void testMailbox() {
+    // Stress the lock-free mailbox: a render thread publishes frames as fast as it can,
+    // a transmit thread picks the newest one. Every frame is filled with its sequence number,
+    // so a torn frame or a frame going backwards shows up.
+    // Build with -fsanitize=thread to check for data races
+    static FrameMailbox mailbox;  // Static: aligned to cache lines even before C++17
+    const unsigned long frame_count = 0xFFFF;  // The sequence number fits in a grayscale value
+    std::atomic<bool> done{false};
+    unsigned long errors = 0;
+
+    std::thread transmitter([&]() {
+        uint16_t last = 0;
+        while (1) {
+            bool finished = done.load(std::memory_order_acquire);
+            if (!mailbox.acquire()) {
+                if (finished) {
+                    break;
+                }
+                continue;
+            }
+            const GSFrame& frame = mailbox.front();
+            uint16_t sequence = frame.gs[0][0][0];
+            for (int i = 0; i < TLC_COUNT; i++) {
+                for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+                    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                        errors += frame.gs[i][j][k] != sequence;
+                    }
+                }
+            }
+            errors += sequence <= last;  // Went backwards
+            last = sequence;
+        }
+    });
+
+    auto timer_start = std::chrono::steady_clock::now();
+    for (unsigned long n = 1; n <= frame_count; n++) {
+        mailbox.back().setAll((uint16_t)n);
+        mailbox.publish();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - timer_start;
+    done.store(true, std::memory_order_release);
+    transmitter.join();
+
+    clog << "Frame mailbox: " << elapsed.count() / frame_count << " ns per published frame (fill included), ";
+    clog << mailbox.acquired() << " acquired, " << mailbox.dropped() << " dropped, " << mailbox.coalesced() << " coalesced, ";
+    clog << errors << " errors" << endl;
+}
+
+template <class Frame, class SetChip, class Snapshot>
+void runConcurrentWriters(const char* name, int writer_count, Frame& frame, SetChip setChip, Snapshot snapshot) {
+    // Each writer owns a chip and keeps setting all its LEDs to a counter,
+    // while a transmit thread snapshots the frame: a chip with different values is a torn frame
+    std::atomic<bool> done{false};
+    std::atomic<unsigned long> updates{0};
+    unsigned long snapshots = 0, torn = 0;
+
+    std::vector<std::thread> writers;
+    for (int w = 0; w < writer_count; w++) {
+        writers.emplace_back([&, w]() {
+            unsigned long n = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                setChip(frame, w, (uint16_t)++n);
+            }
+            updates += n;
+        });
+    }
+    std::thread transmitter([&]() {
+        GSFrame copy;
+        while (!done.load(std::memory_order_relaxed)) {
+            snapshot(frame, copy);
+            snapshots++;
+            for (int i = 0; i < TLC_COUNT; i++) {
+                for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+                    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                        torn += copy.gs[i][j][k] != copy.gs[i][0][0];
+                    }
+                }
+            }
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    done = true;
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    transmitter.join();
+    clog << name << ", " << writer_count << " writers: " << updates / 0.3 / 1e6 << " M chip updates per sec, ";
+    clog << snapshots / 0.3 / 1e3 << " k snapshots per sec, " << torn << " torn values" << endl;
+}
+
+void testBoundedQueue() {
+    // Two producers push numbered items, half of them dropping the oldest when the queue is full,
+    // two consumers pop. Every item must come out exactly once, either popped or dropped.
+    // Build with -fsanitize=thread to check for data races
+    static BoundedQueue<unsigned long> queue(8);
+    const unsigned long item_count = 200000;  // Per producer
+    std::atomic<unsigned long> popped_sum{0}, dropped_sum{0}, popped{0}, dropped{0};
+    std::atomic<int> producers_left{2};
+
+    auto timer_start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < 2; p++) {
+        threads.emplace_back([&, p]() {
+            for (unsigned long i = 1; i <= item_count; i++) {
+                unsigned long item = p * item_count + i;
+                if (i % 2) {
+                    queue.pushDropOldest(item, [&](unsigned long oldest) {
+                        dropped_sum += oldest;
+                        dropped++;
+                    });
+                } else {
+                    while (!queue.push(item)) {
+                        std::this_thread::yield();  // Backpressure
+                    }
+                }
+            }
+            producers_left--;
+        });
+    }
+    for (int c = 0; c < 2; c++) {
+        threads.emplace_back([&]() {
+            unsigned long item;
+            while (true) {
+                bool finished = producers_left == 0;
+                if (queue.pop(item)) {
+                    popped_sum += item;
+                    popped++;
+                } else if (finished) {
+                    break;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - timer_start;
+
+    const unsigned long total = 2 * item_count;
+    bool complete = popped + dropped == total && popped_sum + dropped_sum == total * (total + 1) / 2;
+    clog << "Bounded queue: " << popped << " popped, " << dropped << " dropped, " << (complete ? "none" : "some") << " lost or duplicated, ";
+    clog << total / elapsed.count() / 1e6 << " M items per sec." << endl;
+}
+
+void testConcurrentFrame() {
+    // Lock-free per-chip sequence locks against one mutex around the whole frame
+    struct LockedFrame {
+        std::mutex lock;
+        GSFrame frame;
+    };
+    for (int writer_count = 1; writer_count <= TLC_COUNT; writer_count++) {
+        static ConcurrentFrame frame;
+        runConcurrentWriters(
+            "ConcurrentFrame", writer_count, frame,
+            [](ConcurrentFrame& f, int chip, uint16_t bright) { f.setLEDChip(chip, bright); },
+            [](ConcurrentFrame& f, GSFrame& copy) { f.snapshot(copy); });
+
+        static LockedFrame locked;
+        runConcurrentWriters(
+            "std::mutex", writer_count, locked,
+            [](LockedFrame& f, int chip, uint16_t bright) {
+                std::lock_guard<std::mutex> guard(f.lock);
+                for (int j = 0; j < LED_CHANNELS_PER_CHIP; j++) {
+                    for (int k = 0; k < COLOR_CHANNEL_COUNT; k++) {
+                        f.frame.gs[chip][j][k] = bright;
+                    }
+                }
+            },
+            [](LockedFrame& f, GSFrame& copy) {
+                std::lock_guard<std::mutex> guard(f.lock);
+                copy = f.frame;
+            });
+    }
+}
+
+// Frame n of a test track: a dim background, with a bright band moving down one row every 4 frames
+void trackFrame(uint64_t n, GSFrame& frame) {
+    frame.setAll(0x0400);
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        frame.set(x, (n / 4) % SCREEN_SIZE_Y, (uint16_t)(0x8000 + n % 0x7FFF));
+    }
+}
+
+void testTrack() {
+    // Ten minutes at 60 FPS, written, opened, played and seeked without the board
+    const char* path = "/tmp/benchmark-track.hblt";
+    const uint64_t frame_count = 60 * 60 * 10;
+    GSFrame frame;
+    {
+        TrackWriter writer(path, 60);
+        for (uint64_t n = 0; n < frame_count; n++) {
+            trackFrame(n, frame);
+            writer.append(frame);
+        }
+    }
+
+    auto timer_start = std::chrono::steady_clock::now();
+    TrackReader track(path);
+    std::chrono::duration<double, std::micro> open_time = std::chrono::steady_clock::now() - timer_start;
+    if (!track.isOpen() || track.frameCount() != frame_count) {
+        clog << "Track: couldn't read back " << path << endl;
+        return;
+    }
+
+    // Play it through, comparing with the frames written
+    uint64_t mismatches = 0;
+    std::chrono::duration<double> decode_time(0);
+    for (uint64_t n = 0; n < frame_count; n++) {
+        auto decode_start = std::chrono::steady_clock::now();
+        const uint8_t* wire = track.next();
+        decode_time += std::chrono::steady_clock::now() - decode_start;
+        trackFrame(n, frame);
+        const uint16_t* values = &frame.gs[0][0][0];
+        for (int i = 0; wire != nullptr && i < TLC_FRAME_VALUE_COUNT; i++) {
+            if (wire[2 * i] != (uint8_t)(values[i] >> 8) || wire[2 * i + 1] != (uint8_t)values[i]) {
+                wire = nullptr;
+            }
+        }
+        mismatches += wire == nullptr;
+    }
+
+    // Random seeks
+    const int seeks = 1000;
+    std::chrono::duration<double> seek_time(0);
+    for (int i = 0; i < seeks; i++) {
+        uint64_t target = (i * 7919ULL * 7919ULL) % frame_count;
+        auto seek_start = std::chrono::steady_clock::now();
+        bool found = track.seek(target);
+        const uint8_t* wire = track.next();
+        seek_time += std::chrono::steady_clock::now() - seek_start;
+        trackFrame(target, frame);
+        mismatches += !found || wire == nullptr || wire[0] != (uint8_t)(frame.gs[0][0][0] >> 8);
+    }
+
+    struct stat file_stat;
+    stat(path, &file_stat);
+    clog << "Track: " << frame_count << " frames in " << file_stat.st_size / 1024 << " KiB (";
+    clog << 100.0 * file_stat.st_size / (frame_count * TRACK_FRAME_BYTES) << "% of raw), opened in " << open_time.count() << " us, ";
+    clog << decode_time.count() * 1e9 / frame_count << " ns per frame, " << seek_time.count() * 1e6 / seeks << " us per seek, ";
+    clog << mismatches << " mismatches" << endl;
+    remove(path);
+}
+
+// The same 10-bit 4:2:0 picture as yuv420p10le, P010 and v210 (4:2:2, with the chroma of every row pair repeated)
+struct YuvPicture {
+    int width, height;
+    std::vector<uint16_t> y, cb, cr, p010_y, p010_cbcr;
+    std::vector<uint8_t> v210;
+    size_t v210_stride;
+
+    YuvPicture(int w, int h) : width(w), height(h), y(w * h), cb(w / 2 * (h / 2)), cr(w / 2 * (h / 2)), p010_y(w * h), p010_cbcr(w * (h / 2)) {
+        // Dim gradients, with a few small highlights
+        for (int r = 0; r < h; r++) {
+            for (int c = 0; c < w; c++) {
+                bool highlight = (r / 37) % 11 == 0 && (c / 53) % 7 == 0;
+                y[r * w + c] = (uint16_t)(highlight ? 900 : 64 + (r * 400 / h + c * 300 / w) % 600);
+            }
+        }
+        for (int r = 0; r < h / 2; r++) {
+            for (int c = 0; c < w / 2; c++) {
+                cb[r * (w / 2) + c] = (uint16_t)(512 + (c * 200 / w) - 50);
+                cr[r * (w / 2) + c] = (uint16_t)(512 + (r * 300 / h) - 75);
+            }
+        }
+        for (size_t i = 0; i < y.size(); i++) {
+            p010_y[i] = (uint16_t)(y[i] << 6);
+        }
+        for (size_t i = 0; i < cb.size(); i++) {
+            p010_cbcr[2 * i] = (uint16_t)(cb[i] << 6);
+            p010_cbcr[2 * i + 1] = (uint16_t)(cr[i] << 6);
+        }
+        v210_stride = (w + 47) / 48 * 128;
+        v210.assign(v210_stride * h, 0);
+        for (int r = 0; r < h; r++) {
+            const uint16_t* cb_row = &cb[(r / 2) * (w / 2)];
+            const uint16_t* cr_row = &cr[(r / 2) * (w / 2)];
+            const uint16_t* y_row = &y[r * w];
+            for (int pixel = 0; pixel < w; pixel += 6) {
+                int c = pixel / 2;
+                uint32_t words[4] = {
+                    (uint32_t)cb_row[c] | (uint32_t)y_row[pixel] << 10 | (uint32_t)cr_row[c] << 20,
+                    (uint32_t)y_row[pixel + 1] | (uint32_t)cb_row[c + 1] << 10 | (uint32_t)y_row[pixel + 2] << 20,
+                    (uint32_t)cr_row[c + 1] | (uint32_t)y_row[pixel + 3] << 10 | (uint32_t)cb_row[c + 2] << 20,
+                    (uint32_t)y_row[pixel + 4] | (uint32_t)cr_row[c + 2] << 10 | (uint32_t)y_row[pixel + 5] << 20};
+                std::memcpy(&v210[r * v210_stride + pixel / 6 * 16], words, 16);
+            }
+        }
+    }
+};
+
+int maxZoneDifference(const GSFrame& a, const GSFrame& b) {
+    int difference = 0;
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        difference = std::max(difference, std::abs((&a.gs[0][0][0])[i] - (&b.gs[0][0][0])[i]));
+    }
+    return difference;
+}
+
+void testYuvKernels() {
+    // The three layouts must agree, and stay close to the transfer functions computed exactly in double
+    YuvPicture small(1920, 1080);
+    const char* transfer_names[] = {"PQ", "HLG"};
+    const int transfers[] = {TRANSFER_PQ, TRANSFER_HLG};
+    for (int t = 0; t < 2; t++) {
+        YuvToLight to_light(transfers[t], 1000);
+        GSFrame planar, p010, v210, exact;
+        reduceZonesYuv420p10((const uint8_t*)small.y.data(), 2 * small.width, (const uint8_t*)small.cb.data(), small.width,
+                             (const uint8_t*)small.cr.data(), small.width, small.width, small.height, to_light, 1, 0.5f, planar);
+        reduceZonesP010((const uint8_t*)small.p010_y.data(), 2 * small.width, (const uint8_t*)small.p010_cbcr.data(), 2 * small.width,
+                        small.width, small.height, to_light, 1, 0.5f, p010);
+        reduceZonesV210(small.v210.data(), small.v210_stride, small.width, small.height, to_light, 1, 0.5f, v210);
+
+        // The reference: BT.2020 matrix and transfer functions in double, no tables
+        for (int x = 0; x < SCREEN_SIZE_X; x++) {
+            for (int zone = 0; zone < SCREEN_SIZE_Y; zone++) {
+                double sum = 0, peak = 0;
+                int pixels = 0;
+                for (int r = small.height * x / SCREEN_SIZE_X; r < small.height * (x + 1) / SCREEN_SIZE_X; r++) {
+                    for (int c = small.width * zone / SCREEN_SIZE_Y; c < small.width * (zone + 1) / SCREEN_SIZE_Y; c++) {
+                        double luma = (small.y[r * small.width + c] - 64) / 876.0;
+                        double blue = (small.cb[(r / 2) * (small.width / 2) + c / 2] - 512) / 896.0;
+                        double red = (small.cr[(r / 2) * (small.width / 2) + c / 2] - 512) / 896.0;
+                        double peak_nits = transfers[t] == TRANSFER_HLG ? HLG_NOMINAL_PEAK_NITS : 1000;
+                        double light = 0.2627 * signalToLight(luma + 1.4746 * red, transfers[t], peak_nits) +
+                                       0.6780 * signalToLight(luma - 0.16455 * blue - 0.57135 * red, transfers[t], peak_nits) +
+                                       0.0593 * signalToLight(luma + 1.8814 * blue, transfers[t], peak_nits);
+                        if (transfers[t] == TRANSFER_HLG) {
+                            light = hlgDisplayLight(light, 1000);
+                        }
+                        sum += light;
+                        peak = std::max(peak, light);
+                        pixels++;
+                    }
+                }
+                double mean = sum / pixels;
+                exact.set(x, zone, (uint16_t)std::lround(std::min(1.0, mean + 0.5 * (peak - mean)) * 0xFFFF));
+            }
+        }
+        clog << "YUV kernels (" << YUV_KERNEL << ", " << transfer_names[t] << "): layouts differ by up to ";
+        clog << std::max(maxZoneDifference(planar, p010), maxZoneDifference(planar, v210)) << " LSB, ";
+        clog << "off the exact transfer function by up to " << 100.0 * maxZoneDifference(planar, exact) / 0xFFFF << "% of full scale" << endl;
+    }
+
+    // Speed on 4K pictures
+    YuvPicture picture(3840, 2160);
+    YuvToLight to_light(TRANSFER_PQ, 1000);
+    GSFrame zones;
+    const int rounds = 10;
+    double ms[3];
+    for (int layout = 0; layout < 3; layout++) {
+        auto timer_start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            if (layout == 0) {
+                reduceZonesYuv420p10((const uint8_t*)picture.y.data(), 2 * picture.width, (const uint8_t*)picture.cb.data(), picture.width,
+                                     (const uint8_t*)picture.cr.data(), picture.width, picture.width, picture.height, to_light, 1, 0.5f, zones);
+            } else if (layout == 1) {
+                reduceZonesP010((const uint8_t*)picture.p010_y.data(), 2 * picture.width, (const uint8_t*)picture.p010_cbcr.data(),
+                                2 * picture.width, picture.width, picture.height, to_light, 1, 0.5f, zones);
+            } else {
+                reduceZonesV210(picture.v210.data(), picture.v210_stride, picture.width, picture.height, to_light, 1, 0.5f, zones);
+            }
+        }
+        ms[layout] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count() / rounds;
+    }
+    clog << "YUV kernels (" << YUV_KERNEL << "): 4K PQ frame in " << ms[0] << " ms (yuv420p10le), " << ms[1] << " ms (P010), ";
+    clog << ms[2] << " ms (v210) on one core" << endl;
+}
+
+// Clipping (RMS shortfall), halo (mean light spilled on dark cells) and power (mean LED level) of LED levels, in %
+void printBacklightQuality(const char* name, const BacklightSolver& model, const std::vector<float>& targets, const float* levels, double ms) {
+    std::vector<float> cell_light(targets.size());
+    model.light(levels, cell_light.data());
+    double clipping = 0, halo = 0, power = 0;
+    int dark_cells = 0;
+    for (size_t cell = 0; cell < targets.size(); cell++) {
+        double shortfall = std::max(0.0f, targets[cell] - cell_light[cell]);
+        clipping += shortfall * shortfall;
+        if (targets[cell] < 0.05f) {
+            halo += std::max(0.0f, cell_light[cell] - targets[cell]);
+            dark_cells++;
+        }
+    }
+    for (int led = 0; led < TLC_FRAME_VALUE_COUNT; led++) {
+        power += levels[led];
+    }
+    clog << "\t" << name << ": clipping " << 100 * std::sqrt(clipping / targets.size()) << "%, halo " << 100 * halo / std::max(1, dark_cells);
+    clog << "%, power " << 100 * power / TLC_FRAME_VALUE_COUNT << "%";
+    if (ms > 0) {
+        clog << ", " << ms << " ms per frame";
+    }
+    clog << endl;
+}
+
+void testSolver() {
+    // The solver against the zone heuristics, on the light each cell of the panel needs
+    const char* scene_names[] = {"Highlights on black", "Bright window", "Gradient"};
+    for (int scene = 0; scene < 3; scene++) {
+        SolverOptions options;
+        BacklightSolver solver(options);
+        const int cells_x = solver.cellsX(), cells_y = solver.cellsY();
+        std::vector<float> targets(cells_x * cells_y);
+        for (int cx = 0; cx < cells_x; cx++) {
+            for (int cy = 0; cy < cells_y; cy++) {
+                float target;
+                if (scene == 0) {
+                    target = (cx * 7 + cy * 13) % 97 == 0 ? 1.0f : 0.01f;
+                } else if (scene == 1) {
+                    target = cx >= cells_x / 4 && cx < cells_x / 2 && cy >= cells_y / 3 && cy < cells_y * 2 / 3 ? 0.8f : 0.03f;
+                } else {
+                    target = (float)cy / cells_y;
+                }
+                targets[cx * cells_y + cy] = target;
+            }
+        }
+        clog << "Backlight solver, " << scene_names[scene] << ":" << endl;
+
+        // The heuristics: mean, peak and their average over each LED's zone
+        const char* heuristic_names[] = {"Zone mean", "Zone peak", "Zone mean/peak mix"};
+        for (int heuristic = 0; heuristic < 3; heuristic++) {
+            float levels[TLC_FRAME_VALUE_COUNT];
+            for (int x = 0; x < SCREEN_SIZE_X; x++) {
+                for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+                    float sum = 0, peak = 0;
+                    for (int cx = x * options.cells_per_led; cx < (x + 1) * options.cells_per_led; cx++) {
+                        for (int cy = y * options.cells_per_led; cy < (y + 1) * options.cells_per_led; cy++) {
+                            sum += targets[cx * cells_y + cy];
+                            peak = std::max(peak, targets[cx * cells_y + cy]);
+                        }
+                    }
+                    float mean = sum / (options.cells_per_led * options.cells_per_led);
+                    levels[tlc_frame_index(x, y)] = heuristic == 0 ? mean : heuristic == 1 ? peak : (mean + peak) / 2;
+                }
+            }
+            printBacklightQuality(heuristic_names[heuristic], solver, targets, levels, 0);
+        }
+
+        // The solver from dark, then warm-started over the next frames of the same picture
+        GSFrame frame;
+        solver.setTargets(targets.data());
+        auto timer_start = std::chrono::steady_clock::now();
+        solver.solve(frame);
+        double cold_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count();
+        printBacklightQuality("Solver, first frame", solver, targets, solver.levels().data(), cold_ms);
+        const int frames = 10;
+        timer_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++) {
+            solver.solve(frame);
+        }
+        double warm_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count() / frames;
+        printBacklightQuality("Solver, warm-started", solver, targets, solver.levels().data(), warm_ms);
+    }
+
+    // Evaluation split across threads
+    for (int threads = 1; threads <= 4; threads *= 2) {
+        SolverOptions options;
+        options.threads = threads;
+        BacklightSolver solver(options);
+        std::vector<float> targets(solver.cellsX() * solver.cellsY(), 0.5f);
+        solver.setTargets(targets.data());
+        GSFrame frame;
+        const int frames = 50;
+        auto timer_start = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++) {
+            solver.solve(frame);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count() / frames;
+        clog << "Backlight solver: " << ms << " ms per frame on " << threads << " threads (" << std::thread::hardware_concurrency() << " cores)" << endl;
+    }
+}
+
+void testFrameCache() {
+    // A looping clip of small pictures, played three times through a cache that holds it
+    const int clip_frames = 600, width = 480, height = 270;
+    std::vector<uint8_t> picture(width * height);
+    FrameCache cache(1024 * 1024);
+    GSFrame frame;
+    unsigned long wrong = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        for (int n = 0; n < clip_frames; n++) {
+            for (size_t i = 0; i < picture.size(); i++) {
+                picture[i] = (uint8_t)(i / width + n);
+            }
+            std::memcpy(picture.data(), &n, sizeof(n));  // Every picture of the clip different
+            uint64_t key = hashFrame(picture.data(), picture.size());
+            trackFrame(n, frame);
+            const uint8_t* wire = cache.find(key);
+            if (wire == nullptr) {
+                cache.insert(key, frame);
+            } else {
+                wrong += wire[0] != (uint8_t)(frame.gs[0][0][0] >> 8) || wire[1] != (uint8_t)frame.gs[0][0][0];
+            }
+        }
+    }
+    FrameCache::CacheStats stats = cache.stats();
+    clog << "Frame cache: " << cache.capacity() << " frames in 1 MiB, looping clip " << 100 * stats.hit_rate << "% hits (66.7% expected), ";
+    clog << wrong << " wrong frames" << endl;
+
+    // Least recently used out first: touch the oldest, then overflow by one
+    FrameCache small(64 * 1024);
+    uint8_t wire[FRAME_CACHE_BYTES] = {0};
+    for (uint64_t key = 0; key < small.capacity(); key++) {
+        small.insert(key, wire);
+    }
+    small.find(0);
+    small.insert(small.capacity(), wire);
+    bool lru = small.find(0) != nullptr && small.find(1) == nullptr && small.stats().evictions == 1;
+
+    // Across a restart
+    const char* path = "/tmp/benchmark-cache.hblc";
+    bool persisted = cache.save(path);
+    FrameCache restored(1024 * 1024);
+    persisted = persisted && restored.load(path) && restored.size() == cache.size();
+    for (int n = 0; persisted && n < clip_frames; n++) {
+        for (size_t i = 0; i < picture.size(); i++) {
+            picture[i] = (uint8_t)(i / width + n);
+        }
+        std::memcpy(picture.data(), &n, sizeof(n));
+        persisted = restored.find(hashFrame(picture.data(), picture.size())) != nullptr;
+    }
+    remove(path);
+
+    // Hashing a 4K 4:2:0 picture, the cost of a miss on top of the analysis
+    std::vector<uint8_t> uhd(3840 * 2160 * 3 / 2, 16);
+    const int hashes = 20;
+    uint64_t distinct = 0, previous = 0;  // Used, so that the loop isn't optimised away
+    auto timer_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < hashes; i++) {
+        uint64_t hash = hashFrame(uhd.data(), uhd.size(), i);
+        distinct += hash != previous;
+        previous = hash;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count() / hashes;
+    clog << "Frame cache: LRU eviction " << (lru ? "ok" : "FAILED") << ", save and load " << (persisted ? "ok" : "FAILED");
+    clog << ", hashing a 4K frame " << ms << " ms (" << distinct << " of " << hashes << " seeds distinct)" << endl;
+}
+
+// Answers every write without looking at it, so that frames sent through it cost the encoding alone
+class DiscardTransport {
+   public:
+    bool open(const char*, int) {
+        return true;
+    }
+    void close() {}
+    bool isOpen() const {
+        return true;
+    }
+    bool write(const uint8_t*, int) {
+        _answer = 0;
+        return true;
+    }
+    int readByte(int) {
+        return _answer < 2 ? "DN"[_answer++] : -2;
+    }
+    bool reboot(const char*, int) {
+        return true;
+    }
+    int handle() const {
+        return -1;
+    }
+
+   private:
+    int _answer = 2;
+};
+
+template <class Transport>
+double transportFrameTime(BasicTLCdriver<Transport>& driver, int frames) {
+    auto timer_start = std::chrono::steady_clock::now();
+    for (int n = 0; n < frames; n++) {
+        driver.setAllLED((uint16_t)(n * 257));
+        driver.updateFrame();
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - timer_start).count() / frames;
+}
+
+void testTransports() {
+    // Each layer adds its cost to the one before: encoding, the firmware parsing it, a file, a pseudo-terminal
+    const int frames = 20000;
+    BasicTLCdriver<DiscardTransport> discard("discard");
+    BasicTLCdriver<LoopbackTransport> loopback("loopback");
+    const char* capture_path = "/tmp/benchmark-capture.bin";
+    double capture_us;
+    bool captured;
+    {
+        BasicTLCdriver<CaptureTransport> capture(capture_path);
+        capture_us = transportFrameTime(capture, frames);
+        captured = capture.transport().board().frames() == (unsigned long)frames;
+    }
+    struct stat file_stat;
+    captured = captured && stat(capture_path, &file_stat) == 0 && file_stat.st_size == TLC_HELLO_FILLER_SIZE + 2 + HELLO_PAYLOAD_SIZE + frames * (2 + TRACK_FRAME_BYTES);
+    remove(capture_path);
+
+    double discard_us = transportFrameTime(discard, frames);
+    double loopback_us = transportFrameTime(loopback, frames);
+    const uint16_t last = (uint16_t)((frames - 1) * 257);
+    bool received = loopback.transport().board().frames() == (unsigned long)frames && loopback.transport().board().frame()[0] == last &&
+                    loopback.transport().board().frame()[TLC_FRAME_VALUE_COUNT - 1] == last;
+    clog << "Transports, per frame: encoding " << discard_us << " us, loopback " << loopback_us << " us (" << (received ? "ok" : "FAILED");
+    clog << "), capture " << capture_us << " us (" << (captured ? "ok" : "FAILED") << ")" << endl;
+
+    // With simboard running, the pseudo-terminal with poll() against arduino-serial-lib's 1 ms polling
+    const char* sim_port = "/tmp/tlc-sim";
+    if (access(sim_port, F_OK) == 0) {
+        double pty_us, serial_us;
+        {
+            BasicTLCdriver<PtyTransport> pty(sim_port);
+            pty_us = transportFrameTime(pty, 500);
+        }
+        {
+            TLCdriver serial(sim_port);
+            serial_us = transportFrameTime(serial, 500);
+        }
+        clog << "Transports, per frame: pseudo-terminal " << pty_us << " us, serial port library on it " << serial_us << " us" << endl;
+    }
+}
+
+// read() and write() calls of this thread so far
+unsigned long readWriteCalls() {
+    std::ifstream io("/proc/thread-self/io");
+    std::string key;
+    unsigned long value, calls = 0;
+    while (io >> key >> value) {
+        if (key == "syscr:" || key == "syscw:") {
+            calls += value;
+        }
+    }
+    return calls;
+}
+
+double threadCpuMicroseconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+template <class Transport>
+void timeBoards(const char* name, int boards, int frames) {
+    std::vector<std::unique_ptr<BasicTLCdriver<Transport>>> drivers;
+    for (int b = 0; b < boards; b++) {
+        drivers.emplace_back(new BasicTLCdriver<Transport>(("/tmp/benchmark-board-" + std::to_string(b)).c_str()));
+    }
+#ifdef HDR_BACKLIGHT_URING
+    unsigned long enters = hdrbacklightdriverjli::IoUring::threadRing().enters();
+#endif
+    unsigned long calls = readWriteCalls();
+    double cpu = threadCpuMicroseconds();
+    auto timer_start = std::chrono::steady_clock::now();
+    unsigned long failures = 0;
+    for (int n = 0; n < frames; n++) {
+        // Every board's frame out first, then every board's feedback
+        for (auto& driver : drivers) {
+            driver->setAllLED((uint16_t)(n * 257));
+            driver->sendFrame();
+        }
+        for (auto& driver : drivers) {
+            failures += !driver->readFeedback();
+        }
+    }
+    double sent = (double)frames * boards;
+    double wall_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - timer_start).count();
+    clog << "Boards, " << name << ": " << wall_us / sent << " us per frame, " << (threadCpuMicroseconds() - cpu) / sent << " us CPU, ";
+    clog << (readWriteCalls() - calls) / sent << " read/write calls";
+#ifdef HDR_BACKLIGHT_URING
+    clog << ", " << (hdrbacklightdriverjli::IoUring::threadRing().enters() - enters) / sent << " io_uring_enter";
+#endif
+    clog << " per frame, " << failures << " failed" << endl;
+}
+
+void testBoards() {
+    // One thread driving several simulated boards on pseudo-terminals, through each serial transport
+    // (The boards are served by threads of their own, which the CPU times leave out; the 1 ms sleeps
+    // between read() calls of arduino-serial-lib aren't read/write calls either)
+    const int boards = 4, frames = 300;
+    std::vector<std::unique_ptr<PtyBoard>> peers;
+    for (int b = 0; b < boards; b++) {
+        // Long enough a reboot for SerialTransport, which needs its first attempt to reconnect to fail
+        peers.emplace_back(new PtyBoard(("/tmp/benchmark-board-" + std::to_string(b)).c_str(), 150));
+        peers.back()->start();
+    }
+    timeBoards<SerialTransport>("termios", boards, frames);
+    timeBoards<PtyTransport>("pseudo-terminal with poll()", boards, frames);
+    timeBoards<UringTransport>("io_uring", boards, frames);
+}
+
+// Frames sent over a simulated link with the given round trip time, in batches of batch frames ('G', 'B')
+// or one 'G', 'O' each if batch is 0
+struct LinkRun {
+    double fps;
+    int depth;  // Credits, 1 without flow control
+    size_t in_flight;
+    double writes, packets;  // Per frame
+    bool ok;  // Every frame arrived, in order, with no more in flight than credits
+};
+
+LinkRun runLink(int rtt_us, bool flow_control, int batch, bool align, int frames) {
+    BasicTLCdriver<SimulatedLinkTransport> driver(std::to_string(rtt_us).c_str());
+    LinkRun run;
+    run.depth = flow_control ? driver.setFlowControl(true) : 1;
+    const SimulatedLinkTransport& link = driver.transport();
+    double start_us = link.elapsedUs();
+    unsigned long writes = link.writes(), packets = link.packets();
+    std::vector<GSFrame> ahead(std::max(batch, 1));
+    for (int n = 0; n < frames; n += (int)ahead.size()) {
+        for (size_t i = 0; i < ahead.size(); i++) {
+            ahead[i].setAll((uint16_t)((n + i) * 31));
+        }
+        if (batch > 0) {
+            driver.submitFrames(ahead.data(), ahead.size(), 0, align);
+        } else {
+            driver.updateFrame(ahead[0]);
+        }
+    }
+    bool flushed = driver.flush();
+    run.fps = frames / (link.elapsedUs() - start_us) * 1e6;
+    run.in_flight = link.maxInFlight();
+    run.writes = (double)(link.writes() - writes) / frames;
+    run.packets = (double)(link.packets() - packets) / frames;
+    run.ok = flushed && run.depth > 0 && link.board().frames() == (unsigned long)frames && link.board().frame()[0] == (uint16_t)((frames - 1) * 31) &&
+             run.in_flight <= (size_t)run.depth;
+    return run;
+}
+
+// The most frames per second the simulated link carries, with bytes and packets per frame
+double linkLimit(double bytes, double packets) {
+    return 1e6 / (bytes * SIMULATED_LINK_BYTE_US + packets * SIMULATED_LINK_PACKET_US);
+}
+
+void testFlowControl() {
+    // Waiting for 'D', 'N' after every frame against credit-based flow control, over USB links with more and more latency
+    const int frames = 2000;
+    const int rtts_us[] = {125, 1000, 2000, 4000, 16000};
+    std::ostringstream report;
+    for (int rtt_us : rtts_us) {
+        LinkRun ack = runLink(rtt_us, false, 0, false, frames);
+        LinkRun credits = runLink(rtt_us, true, 0, false, frames);
+        report << "\tround trip " << rtt_us << " us: ack per frame " << ack.fps << (ack.ok ? "" : " FAILED");
+        report << ", credits " << credits.fps << " (" << credits.depth << " credits, " << credits.in_flight << " in flight at most)" << (credits.ok ? "" : " FAILED") << "\n";
+    }
+    clog << "Flow control, frames/s on a link of " << linkLimit(TLC_MAX_COMMAND_SIZE, 5) << " at most:\n" << report.str() << std::flush;
+}
+
+void testBatching() {
+    // Frames known ahead in batches of TLC_BATCH_MAX_FRAMES, packed or aligned to USB packets, against a write per frame
+    const int frames = 2000, rtt_us = 1000, batch = TLC_BATCH_MAX_FRAMES;
+    struct Mode {
+        const char* name;
+        int batch;
+        bool align;
+    } modes[] = {{"a write per frame", 0, false}, {"batches", batch, false}, {"aligned batches", batch, true}};
+    std::ostringstream report;
+    for (const Mode& mode : modes) {
+        LinkRun ack = runLink(rtt_us, false, mode.batch, mode.align, frames);
+        LinkRun credits = runLink(rtt_us, true, mode.batch, mode.align, frames);
+        report << "\t" << mode.name << ": " << ack.fps << " frames/s" << (ack.ok ? "" : " FAILED") << ", with credits " << credits.fps << (credits.ok ? "" : " FAILED");
+        report << ", " << ack.writes << " writes and " << ack.packets << " USB packets per frame\n";
+    }
+    clog << "Batching, round trip " << rtt_us << " us:\n" << report.str() << std::flush;
+
+    // The system calls and host time per frame through a pseudo-terminal, to a PtyBoard
+    PtyBoard board("/tmp/benchmark-batch", 50);
+    board.start();
+    double us[2], calls[2];
+    bool ok = true;
+    {
+        BasicTLCdriver<PtyTransport> driver("/tmp/benchmark-batch");
+        std::vector<GSFrame> ahead(batch);
+        for (int batched = 0; batched < 2; batched++) {
+            unsigned long calls_start = readWriteCalls();
+            auto timer_start = std::chrono::steady_clock::now();
+            for (int n = 0; n < frames; n += batch) {
+                for (int i = 0; i < batch; i++) {
+                    ahead[i].setAll((uint16_t)(n + i));
+                }
+                if (batched) {
+                    driver.submitFrames(ahead.data(), batch);
+                } else {
+                    for (const GSFrame& frame : ahead) {
+                        driver.updateFrame(frame);
+                    }
+                }
+            }
+            us[batched] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - timer_start).count() / frames;
+            calls[batched] = (double)(readWriteCalls() - calls_start) / frames;
+        }
+    }
+    board.stop();
+    ok = board.board().frames() == 2UL * frames && board.board().frame()[0] == frames - 1;
+    clog << "Batching, pseudo-terminal: a write per frame " << us[0] << " us and " << calls[0] << " read/write calls, batches ";
+    clog << us[1] << " us and " << calls[1] << " calls per frame" << (ok ? "" : " FAILED") << endl;
+}
+
+void testTimestamps() {
+    // ClockSync against a Teensy whose micros() wraps during the run and runs 20 ppm fast,
+    // with random delays on the way there and back, a command every millisecond
+    std::mt19937 random(45);
+    std::exponential_distribution<double> delay(1.0 / 100);
+    const double drift = 20e-6, start_offset = 4294967296.0 - 5e6;  // Wraps after 5 seconds
+    ClockSync clock;
+    double max_error = 0, max_uncertainty = 0;
+    bool ok = true;
+    for (int n = 0; n < 20000; n++) {
+        double sent = 1e3 * n;
+        double start = sent + 20 + delay(random), end = start + 300, ack = end + 20 + delay(random);
+        auto device = [&](double host) { return host * (1 + drift) + start_offset; };
+        int64_t device_start = clock.unwrap((uint32_t)(int64_t)device(start));
+        int64_t device_end = device_start + (int64_t)(device(end) - device(start));
+        clock.addSample(sent, ack, device_start, device_end);
+        if (n >= 64) {
+            double error = std::abs(clock.offsetUs() - (device(ack) - ack));
+            max_error = std::max(max_error, error);
+            max_uncertainty = std::max(max_uncertainty, clock.uncertaintyUs());
+            // Within the bounds, give or take the drift over the window and the rounding to whole microseconds
+            ok = ok && error <= clock.uncertaintyUs() + 64e3 * drift + 2;
+        }
+    }
+    clog << "Clock sync over a wrap of micros(), 20 ppm drift: error up to " << max_error << " us, uncertainty up to " << max_uncertainty << " us";
+    clog << (ok ? "" : " FAILED") << endl;
+
+    // Where the frame time goes, through a pseudo-terminal to a PtyBoard
+    PtyBoard board("/tmp/benchmark-timestamps", 50);
+    board.start();
+    BasicTLCdriver<PtyTransport>::LatencyStats latency;
+    BasicTLCdriver<PtyTransport>::FrameStats frames;
+    {
+        BasicTLCdriver<PtyTransport> driver("/tmp/benchmark-timestamps");
+        ok = driver.setTimestamps(true);
+        driver.resetStats();
+        GSFrame frame;
+        for (int n = 0; n < 1000; n++) {
+            frame.setAll((uint16_t)n);
+            driver.updateFrame(frame);
+        }
+        latency = driver.latency();
+        frames = driver.stats();
+
+        // The sketch only sends timestamps without flow control: the driver turns down the combination
+        std::ostringstream errors;
+        std::streambuf* cerr_buffer = std::cerr.rdbuf(errors.rdbuf());
+        ok = ok && driver.setFlowControl(true) == 0;
+        driver.updateFrame(frame);
+        ok = ok && driver.latency().frames == latency.frames + 1;
+        std::cerr.rdbuf(cerr_buffer);
+    }
+    board.stop();
+    // The board's clock against the host's, read once its thread is stopped; the reboot of the driver restarted it
+    double truth = board.board().micros() - std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    double error = latency.clock_offset_us - truth;
+    ok = ok && latency.frames == 1000 && std::abs(error) <= latency.clock_uncertainty_us + 2;
+    clog << "Latency, pseudo-terminal, " << frames.mean_us << " us per frame: host " << latency.host_us << " us, USB " << latency.usb_us;
+    clog << " us, receive " << latency.receive_us << " us, shift " << latency.shift_us << " us, latch " << latency.latch_us;
+    clog << " us, feedback " << latency.feedback_us << " us; clock offset off by " << error << " us, within " << latency.clock_uncertainty_us << " us";
+    clog << (ok ? "" : " FAILED") << endl;
+}
+
+// A caller at 240 FPS on a simulated link with a 1 ms round trip that goes bad from 2 s to 6 s:
+// a write in 10 lost, an answer in 20 corrupted and 3 ms more of round trip, then clear again until 10 s
+struct FaultyLinkRun {
+    unsigned long shown[3];   // Frames the board showed, before, during and after the bad link
+    unsigned long missed[3];  // Deadlines of the caller missed
+    double blocked_ms[3];     // Time in updateFrame()
+    double recovery_ms;       // From the link clearing to the full frame rate
+    LinkHealth::Report health;
+    bool ok;  // The last frame made it to the board
+};
+
+FaultyLinkRun runFaultyLink(bool adaptive) {
+    BasicTLCdriver<SimulatedLinkTransport> driver("1000");
+    driver.setAdaptiveRate(adaptive);
+    SimulatedLinkTransport& link = driver.transport();
+    const double period_us = 1e6 / 240, phase_end_us[3] = {2e6, 6e6, 10e6};
+    FaultyLinkRun run = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, -1, LinkHealth::Report(), false};
+    double start = link.elapsedUs(), deadline = start;
+    unsigned long shown = link.board().frames();
+    GSFrame frame;
+    uint16_t value = 0;
+    int phase = 0;
+    while (1) {
+        // Paced like FramePacer, in simulated time
+        deadline += period_us;
+        if (link.elapsedUs() >= deadline) {
+            run.missed[phase]++;
+            deadline = std::max(deadline, link.elapsedUs() - period_us);
+        } else {
+            link.advance(deadline);
+        }
+        double t = deadline - start;
+        if (t >= phase_end_us[phase]) {
+            run.shown[phase] = link.board().frames() - shown;
+            shown = link.board().frames();
+            if (++phase == 3) {
+                break;
+            }
+            link.setFaults(phase == 1 ? 0.1 : 0, phase == 1 ? 0.05 : 0, phase == 1 ? 3000 : 0);
+        }
+        frame.setAll(++value);
+        double before = link.elapsedUs();
+        driver.updateFrame(frame);
+        run.blocked_ms[phase] += (link.elapsedUs() - before) / 1000;
+        if (phase == 2 && run.recovery_ms < 0 && !driver.health().degraded()) {
+            run.recovery_ms = (t - phase_end_us[1]) / 1000;
+        }
+    }
+    driver.flush();
+    run.health = driver.health().report();
+    run.ok = link.board().frame()[0] == value;
+    return run;
+}
+
+void testLinkHealth() {
+    std::ostringstream report;
+    // The errors of the bad link go to cerr, one per failed command
+    std::ostringstream errors;
+    std::streambuf* cerr_buffer = std::cerr.rdbuf(errors.rdbuf());
+    for (int adaptive = 0; adaptive < 2; adaptive++) {
+        FaultyLinkRun run = runFaultyLink(adaptive);
+        const LinkHealth::Report& h = run.health;
+        report << "\t" << (adaptive ? "adaptive rate" : "full rate") << ": shown " << run.shown[0] << "/" << run.shown[1] << "/" << run.shown[2];
+        report << " frames, " << run.missed[0] << "/" << run.missed[1] << "/" << run.missed[2] << " deadlines missed, blocked ";
+        report << run.blocked_ms[0] << "/" << run.blocked_ms[1] << "/" << run.blocked_ms[2] << " ms";
+        if (adaptive) {
+            report << ", full rate " << run.recovery_ms << " ms after the link cleared";
+        }
+        report << (run.ok && (!adaptive || run.recovery_ms >= 0) ? "" : " FAILED") << "\n";
+        report << "\t\t" << h.acks << " acks, RTT p50 " << h.rtt_p50_us << " us p99 " << h.rtt_p99_us << " us max " << h.rtt_max_us << " us, ";
+        report << h.timeouts << " timeouts, " << h.wrong_feedback << " wrong feedback, " << h.resyncs << " resyncs (" << h.discarded_bytes << " bytes), ";
+        report << h.held_back << " frames held back\n";
+    }
+    std::cerr.rdbuf(cerr_buffer);
+    clog << "Link health, 240 FPS, before/during/after 4 s of a bad link:\n" << report.str() << std::flush;
+}
+
+void testReconnect() {
+    // A glitch of the USB cable in a 240 FPS stream: the port goes away for 20 ms, the sketch keeps running.
+    // The longest time between two frames is how long the stream goes dark
+    const char* link = "/tmp/benchmark-reconnect";
+    PtyBoard board(link, 300);
+    board.start();
+    std::ostringstream errors;  // Those of the failing port
+    std::streambuf* cerr_buffer = std::cerr.rdbuf(errors.rdbuf());
+    double dark_ms = 0;
+    unsigned long reconnects;
+    int error;
+    const int frames = 480;
+    {
+        BasicTLCdriver<PtyTransport> driver(link);
+        driver.setAutoReconnect(true);
+        driver.setGlobalBrightness(100);
+        FramePacer pacer(240);
+        GSFrame frame;
+        auto last = std::chrono::steady_clock::now();
+        for (int n = 0; n < frames; n++) {
+            pacer.wait();
+            if (n == frames / 4) {
+                board.disconnect(20);
+            }
+            frame.setAll((uint16_t)n);
+            driver.updateFrame(frame);
+            auto now = std::chrono::steady_clock::now();
+            dark_ms = std::max(dark_ms, std::chrono::duration<double, std::milli>(now - last).count());
+            last = now;
+        }
+        reconnects = driver.reconnects();
+        error = driver.error();
+    }
+    board.stop();
+    std::cerr.rdbuf(cerr_buffer);
+    bool ok = error == TLC_OK && reconnects == 1 && board.disconnects() == 1 && board.reboots() == 0 &&
+              board.board().frame()[0] == frames - 1 && board.board().brightness()[0] == 100;
+    clog << "Reconnect, 20 ms without the port at 240 FPS: dark for " << dark_ms << " ms at most, without a reboot" << (ok ? "" : " FAILED") << endl;
+}
+
+// From the constructor to the first frame on a simulated board that takes 300 ms to reboot, like the Teensy
+struct StartupRun {
+    double first_frame_ms;
+    int error;
+    BasicTLCdriver<PtyTransport>::Capabilities capabilities;
+    int fastest;  // Credits of setFastestMode()
+    unsigned long frames_before;  // Shown by the board before the run
+};
+
+StartupRun runStartup(PtyBoard& board, const char* link, int submitted) {
+    StartupRun run;
+    run.frames_before = board.board().frames();
+    board.start();
+    auto timer_start = std::chrono::steady_clock::now();
+    {
+        BasicTLCdriver<PtyTransport> driver(link);
+        GSFrame frame;
+        frame.setAll(1000);
+        driver.updateFrame(frame);
+        run.first_frame_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - timer_start).count();
+        run.capabilities = driver.capabilities();
+        std::vector<GSFrame> frames(submitted, frame);
+        driver.submitFrames(frames.data(), frames.size());
+        run.fastest = driver.setFastestMode();
+        // Left behind for the next host
+        driver.setGlobalBrightness(100);
+        driver.flush();
+        run.error = driver.error();
+    }
+    board.stop();
+    return run;
+}
+
+void testStartup() {
+    const char* link = "/tmp/benchmark-startup";
+    PtyBoard board(link, 300);
+    StartupRun first = runStartup(board, link, 0);
+    // A second host finds the sketch with flow control on and dimmed: the handshake puts it back as after setup()
+    bool left = board.board().flowControlEnabled() && board.board().brightness()[0] == 100;
+    StartupRun second = runStartup(board, link, 0);
+    bool ok = left && first.error == TLC_OK && second.error == TLC_OK && board.reboots() == 0 && first.capabilities.protocol_version == TLC_PROTOCOL_VERSION &&
+              first.capabilities.features == TLC_FEATURES_ALL && first.capabilities.tlc_count == TLC_COUNT && first.fastest == TLC_CREDIT_DEPTH &&
+              board.board().brightness()[0] == 100 && board.board().frame()[0] == 1000;
+
+    // A sketch older than the handshake is rebooted, after the handshake times out
+    PtyBoard older(link, 300);
+    older.board().setHello(false);
+    StartupRun rebooted = runStartup(older, link, 0);
+    ok = ok && rebooted.error == TLC_OK && older.reboots() == 1 && rebooted.capabilities.protocol_version == 0 && older.board().frame()[0] == 1000;
+
+    // Without batches and flow control, the driver sends a frame at a time
+    PtyBoard basic(link, 300);
+    basic.board().setHello(true, TLC_FEATURES_ALL & ~(TLC_FEATURE_BATCH | TLC_FEATURE_FLOW_CONTROL));
+    StartupRun fallback = runStartup(basic, link, 5);
+    ok = ok && fallback.error == TLC_OK && basic.reboots() == 0 && fallback.fastest == 0 && basic.board().frames() == 1 + 5 && !basic.board().flowControlEnabled();
+
+    clog << "Startup to the first frame: " << first.first_frame_ms << " ms, again " << second.first_frame_ms << " ms with the handshake, ";
+    clog << rebooted.first_frame_ms << " ms rebooting an older sketch" << (ok ? "" : " FAILED") << endl;
+}
+
+void testDithering() {
+    // Every 16-bit value, 144 at a time, over 257 frames: the kernel against plain division, and the average against the value,
+    // over the first 16 frames and over all of them
+    const int frames = FRAME8_STEP, window = 16;
+    double worst = 0, window_worst = 0;
+    bool same = true;
+    uint16_t values[TLC_FRAME_VALUE_COUNT];
+    uint8_t dithered[TLC_FRAME_VALUE_COUNT];
+    for (int first = 0; first < 65536; first += TLC_FRAME_VALUE_COUNT) {
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            values[i] = (uint16_t)std::min(first + i, 65535);
+        }
+        TemporalDither dither;
+        int32_t error[TLC_FRAME_VALUE_COUNT] = {0};
+        long sums[TLC_FRAME_VALUE_COUNT] = {0};
+        for (int n = 0; n < frames; n++) {
+            dither.quantize(values, dithered);
+            for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+                int32_t wanted = values[i] + error[i];
+                int32_t step = (wanted + FRAME8_STEP / 2) / FRAME8_STEP;
+                error[i] = wanted - step * FRAME8_STEP;
+                same = same && dithered[i] == step;
+                sums[i] += dithered[i] * FRAME8_STEP;
+                if (n == window - 1) {
+                    window_worst = std::max(window_worst, std::abs((double)sums[i] / window - values[i]));
+                }
+            }
+        }
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            worst = std::max(worst, std::abs((double)sums[i] / frames - values[i]));
+        }
+    }
+
+    // Through the driver and the emulated sketch: the frames it showed, on average, against the driver's _gsData
+    GSFrame shadows;
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        (&shadows.gs[0][0][0])[i] = (uint16_t)(i * 7 + (i % 3) * 20000);  // A ramp within the first 4 steps, and higher
+    }
+    BasicTLCdriver<LoopbackTransport> driver("loopback");
+    bool enabled = driver.setDithering(true);
+    long sums[TLC_FRAME_VALUE_COUNT] = {0};
+    for (int n = 0; n < frames; n++) {
+        driver.updateFrame(shadows);
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            sums[i] += driver.transport().board().frame()[i];
+        }
+    }
+    double shown_worst = 0, rounded_worst = 0;
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        uint16_t target = (&shadows.gs[0][0][0])[i];
+        shown_worst = std::max(shown_worst, std::abs((double)sums[i] / frames - target));
+        rounded_worst = std::max(rounded_worst, (double)std::abs(target - (target + FRAME8_STEP / 2) / FRAME8_STEP * FRAME8_STEP));
+    }
+    bool ok = enabled && same && worst <= FRAME8_STEP / 2 / (double)frames && window_worst <= FRAME8_STEP / 2 / (double)window &&
+              shown_worst <= FRAME8_STEP / 2 / (double)frames &&
+              driver.transport().board().frames() == (unsigned long)frames;
+
+    const int rounds = 1000000;
+    auto timer_start = std::chrono::steady_clock::now();
+    TemporalDither dither;
+    for (int n = 0; n < rounds; n++) {
+        dither.quantize(&shadows.gs[0][0][0], dithered);
+        shadows.gs[0][0][0] ^= dithered[n % TLC_FRAME_VALUE_COUNT];  // Keep the loop from being taken apart
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - timer_start).count() / rounds;
+    const int bytes16 = 2 + 2 * TLC_FRAME_VALUE_COUNT, bytes8 = 2 + FRAME8_PAYLOAD_SIZE;
+    clog << "Temporal dithering (" << DITHER_KERNEL << "), " << ns << " ns per frame: averages of " << window << "/" << frames << " frames off by up to ";
+    clog << window_worst << "/" << worst << " LSB for every 16-bit value, " << shown_worst << " LSB through the driver, against ";
+    clog << rounded_worst << " LSB rounded to 8 bits; ";
+    clog << bytes8 << " instead of " << bytes16 << " bytes per frame, up to " << linkLimit(bytes8, (bytes8 + TLC_USB_PACKET_SIZE - 1) / TLC_USB_PACKET_SIZE);
+    clog << " instead of " << linkLimit(bytes16, (bytes16 + TLC_USB_PACKET_SIZE - 1) / TLC_USB_PACKET_SIZE) << " frames/s on USB full speed" << (ok ? "" : " FAILED") << endl;
+}
+
+// A 240 FPS caller on a simulated link with a 1 ms round trip, for 10 s: a still picture with noise of 0.1%,
+// and every second a fade of 100 ms, 1% a frame
+struct GateRun {
+    unsigned long packets;  // Of the link
+    unsigned long shown;            // Frames the board showed
+    double longest_gap_ms;          // Between two frames shown
+    ChangeGate::Report gate;
+    bool ok;  // The board never showed a frame that looked different from the caller's
+};
+
+GateRun runChangeGate(bool gated) {
+    BasicTLCdriver<SimulatedLinkTransport> driver("1000");
+    driver.setChangeGate(gated);
+    SimulatedLinkTransport& link = driver.transport();
+    ChangeGate check;
+    check.configure();
+    const double period_us = 1e6 / 240;
+    GateRun run = {0, 0, 0, ChangeGate::Report(), true};
+    unsigned long packets = link.packets(), shown = link.board().frames();
+    double start = link.elapsedUs(), last_shown = start;
+    uint32_t random = 12345;
+    GSFrame frame;
+    uint16_t* values = &frame.gs[0][0][0];
+    for (int n = 0; n < 2400; n++) {
+        link.advance(start + n * period_us);
+        double level = 1 + 0.01 * std::min(n % 240, 24);
+        for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+            random = random * 1664525 + 1013904223;
+            double noise = 1 + 0.001 * ((random >> 8) / 8388608.0 - 1);
+            values[i] = (uint16_t)std::lround(std::min(65535.0, (i * 457 % 50000) * level * noise));
+        }
+        driver.updateFrame(frame);
+        if (link.board().frames() != shown) {
+            run.longest_gap_ms = std::max(run.longest_gap_ms, (link.elapsedUs() - last_shown) / 1000);
+            last_shown = link.elapsedUs();
+            shown = link.board().frames();
+        }
+        run.ok = run.ok && !check.visible(link.board().frame(), values);
+    }
+    run.packets = link.packets() - packets;
+    run.shown = link.board().frames();
+    run.gate = driver.changeGate().report();
+    return run;
+}
+
+void testChangeGate() {
+    // For every lower value, the smallest higher one the gate takes for a change, found by bisection:
+    // the value below it must be within the threshold, and the gate's tolerance is compared with the exact one
+    ChangeGate gate;
+    gate.configure();
+    uint16_t a[TLC_FRAME_VALUE_COUNT] = {0}, b[TLC_FRAME_VALUE_COUNT] = {0};
+    bool never_missed = true;
+    double tolerance_sum = 0, exact_sum = 0;
+    for (int lower = 0; lower < 65535; lower++) {
+        a[0] = (uint16_t)lower;
+        int low = lower, high = 65536;  // low is invisible, high visible (65536: nothing is)
+        while (high - low > 1) {
+            b[0] = (uint16_t)((low + high) / 2);
+            (gate.visible(a, b) ? high : low) = (low + high) / 2;
+        }
+        double from = ChangeGate::lightToPQ(lower / 65535.0 * 1000);
+        never_missed = never_missed && ChangeGate::lightToPQ(low / 65535.0 * 1000) - from <= CHANGE_GATE_THRESHOLD;
+        int exact_low = lower, exact_high = 65536;
+        while (exact_high - exact_low > 1) {
+            int middle = (exact_low + exact_high) / 2;
+            (ChangeGate::lightToPQ(middle / 65535.0 * 1000) - from <= CHANGE_GATE_THRESHOLD ? exact_low : exact_high) = middle;
+        }
+        tolerance_sum += low - lower;
+        exact_sum += exact_low - lower;
+    }
+
+    // A frame with changes below the threshold in every zone, read to the end
+    const int rounds = 1000000;
+    for (int i = 0; i < TLC_FRAME_VALUE_COUNT; i++) {
+        a[i] = (uint16_t)(i * 457);
+        b[i] = (uint16_t)(a[i] + a[i] / 2000);
+    }
+    unsigned long visible = 0;
+    auto timer_start = std::chrono::steady_clock::now();
+    for (int n = 0; n < rounds; n++) {
+        visible += gate.visible(a, b);
+        b[n % TLC_FRAME_VALUE_COUNT] ^= (uint16_t)visible;  // Keep the loop from being taken apart
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - timer_start).count() / rounds;
+
+    // The saved frames left to a burst: on a degraded link, after a quiet time, then at one frame a call
+    // The frames skipped leave their turns to a burst: on a degraded link, a caller at 4 frames an interval
+    // skips 10 ms of frames, then sends a burst, then keeps going at one turn an interval.
+    // Without the skips, a quiet time leaves no turns: the spacing stays strict
+    LinkHealth health, quiet;
+    health.timeout(0);
+    quiet.timeout(0);
+    const double step_us = health.intervalUs() / 4;
+    health.admit(0);
+    quiet.admit(0);
+    for (int n = 1; n <= 40; n++) {
+        health.skip(n * step_us);
+    }
+    int burst = 0, quiet_burst = 0;
+    while (health.admit(41 * step_us)) {
+        burst++;
+    }
+    while (quiet.admit(41 * step_us)) {
+        quiet_burst++;
+    }
+    int paced = 0;
+    for (int n = 42; n <= 57; n++) {
+        paced += health.admit(n * step_us);
+    }
+
+    // A frame like the last one sent, after an effect or a batch changed the LEDs, must go out again
+    BasicTLCdriver<LoopbackTransport> driver("loopback");
+    driver.setChangeGate(true);
+    GSFrame frame, other;
+    frame.setAll(30000);
+    other.setAll(50000);
+    const auto& board = driver.transport().board();
+    bool resent = true;
+    for (int path = 0; path < 6; path++) {
+        driver.updateFrame(frame);
+        if (path == 0) {
+            driver.fillFrame(10000);
+        } else if (path == 1) {
+            driver.setZone(0, 0, 1, 1, 10000);
+        } else if (path == 2) {
+            driver.fadeAll(30000, 10000, 1);
+        } else if (path == 3) {
+            driver.setGradient(GRADIENT_AXIS_X, 0, 65535);
+        } else if (path == 4) {
+            driver.submitFrames(&other, 1, 0);
+        } else {
+            driver.submitFramesWire((const uint8_t*)other.gs, 1, 0);
+        }
+        unsigned long frames = board.frames();
+        driver.updateFrame(frame);
+        resent = resent && board.frames() > frames && std::memcmp(board.frame(), frame.gs, sizeof(frame.gs)) == 0;
+    }
+
+    GateRun full = runChangeGate(false), gated = runChangeGate(true);
+    bool ok = never_missed && resent && full.ok && gated.ok && ns < 1000 && burst == LINK_HEALTH_BURST_FRAMES && quiet_burst == 1 && paced == 4 &&
+              gated.longest_gap_ms <= CHANGE_GATE_KEEPALIVE_US / 1000 + 5;
+    clog << "Change gate, " << ns << " ns per frame: tolerance " << 100 * tolerance_sum / exact_sum << "% of the exact one on average, ";
+    clog << (never_missed ? "no change above the threshold missed" : "changes missed") << "; 240 FPS, still with 0.1% noise and a fade a second: ";
+    clog << gated.gate.skip_rate * 100 << "% skipped, " << gated.gate.keepalives << " keep-alives, longest gap " << gated.longest_gap_ms << " ms, ";
+    clog << gated.packets << " instead of " << full.packets << " USB packets, " << (resent ? "" : "not ") << "sent again after effects and batches; a burst of " << burst << " frames on a degraded link after skipped frames, " << quiet_burst << " after a quiet time";
+    clog << (ok ? "" : " FAILED") << endl;
+}
+
 int main() {
+    testInterpolationKernel();
+    testPacer();
+    testMailbox();
+    testBoundedQueue();
+    testConcurrentFrame();
+    testTrack();
+    testYuvKernels();
+    testSolver();
+    testFrameCache();
+    testTransports();
+    testBoards();
+    testFlowControl();
+    testBatching();
+    testTimestamps();
+    testLinkHealth();
+    testReconnect();
+    testStartup();
+    testDithering();
+    testChangeGate();
+
     TLCdriver TLCteensy(DEFAULT_SERIAL_PORT, 9600);
+    if (TLCteensy.error() != TLC_OK) {
+        return 1;
+    }
 
     // For debugging: get the internal array indices of an LED
     TLCteensy.print_index(1, 0);
 
+    // Compare the frame time jitter before and after switching to real-time mode
+    testBrightness(TLCteensy);
+    printJitter(TLCteensy);
+    TLCteensy.setRealtime();
+    testBrightness(TLCteensy);
+    printJitter(TLCteensy);
+
     while (1) {
         testBrightness(TLCteensy);
         testLEDs(TLCteensy);
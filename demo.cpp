@@ -30,6 +30,7 @@ SOFTWARE.
 
 #include "HDR-backlight-driver.hpp"
 
+using hdrbacklightdriverjli::FramePacer;
 using hdrbacklightdriverjli::TLCdriver;
 
 using std::clog;
@@ -69,15 +70,13 @@ void testLEDs(TLCdriver& TLCteensy) {
     // Timers
     auto timer_start = std::chrono::system_clock::now();
 
-    // auto time_step = std::chrono::microseconds(0);  // No limit on frame rate
-    auto time_step = std::chrono::microseconds((int)(1.0 / 60 * 1e6));  // Limit the frame rate to 60 FPS
+    // FramePacer pacer(0);  // No limit on frame rate
+    FramePacer pacer(60);  // Limit the frame rate to 60 FPS
 
     for (int x = 0; x < SCREEN_SIZE_X; x++) {
         for (int y = 0; y < SCREEN_SIZE_Y; y++) {
-            // Delay time_step microseconds
-            auto temp_start = std::chrono::system_clock::now();
-            while (std::chrono::system_clock::now() - temp_start < time_step)
-                ;
+            // Sleep until the next frame
+            pacer.wait();
 
             TLCteensy.setAllLED(0);
             TLCteensy.setLED(x, y, 0xFFFF);
@@ -89,11 +88,61 @@ void testLEDs(TLCdriver& TLCteensy) {
     clog << (1 + SCREEN_SIZE_X * SCREEN_SIZE_Y) / wall_time_elapsed.count() << " frames per sec." << endl;
 }
 
+void testInterpolation(TLCdriver& TLCteensy) {
+    // Send 30 keyframes per second, and let the Teensy fill in the frames in between at 240 FPS
+    FramePacer pacer(30);
+    TLCteensy.setInterpolation(true, std::chrono::duration_cast<std::chrono::microseconds>(pacer.period()).count(), (uint32_t)(1.0 / 240 * 1e6));
+
+    int step = 0x100 * 8;  // Much coarser than testBrightness(), but still a smooth fade
+    for (int bright = 0; bright <= 0xFFFF; bright += step) {
+        pacer.wait();
+        TLCteensy.setAllLED(bright);
+        TLCteensy.updateFrame();
+    }
+
+    TLCteensy.setInterpolation(false);
+}
+
+void testEffects(TLCdriver& TLCteensy) {
+    // The same single-LED chase as testLEDs(), but with procedural effects:
+    // 4 + 22 bytes per step ('F', 'L' and 'Z', 'N' with their payloads) instead of a full 290-byte frame
+    for (int x = 0; x < SCREEN_SIZE_X; x++) {
+        for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+            TLCteensy.fillFrame(0);
+            TLCteensy.setZone(x, y, x, y, 0xFFFF);
+        }
+    }
+
+    // Sweep a gradient across the screen, then fade out over 120 refresh intervals
+    for (int bright = 0; bright <= 0xFFFF; bright += 0x100) {
+        TLCteensy.setGradient(GRADIENT_AXIS_Y, 0, bright);
+    }
+    TLCteensy.fadeAll(0xFFFF, 0, 120);
+}
+
+void testGlobalBrightness(TLCdriver& TLCteensy) {
+    // Dim the whole panel through the TLC5955 global brightness control,
+    // keeping the full grayscale range for the image
+    TLCteensy.setGradient(GRADIENT_AXIS_Y, 0, 0xFFFF);
+    for (int bright = 127; bright >= 0; bright--) {
+        TLCteensy.setGlobalBrightness(bright);
+    }
+    for (int bright = 0; bright <= 127; bright++) {
+        TLCteensy.setGlobalBrightness(bright);
+    }
+}
+
 int main() {
     TLCdriver TLCteensy(DEFAULT_SERIAL_PORT, 9600);
+    if (TLCteensy.error() != TLC_OK) {
+        return 1;
+    }
 
     while (1) {
         testBrightness(TLCteensy);
         testLEDs(TLCteensy);
+        testInterpolation(TLCteensy);
+        testEffects(TLCteensy);
+        testGlobalBrightness(TLCteensy);
     }
 }
@@ -0,0 +1,484 @@
+/*
+-----------------------Live Pipeline--------------------------------
+Drives the backlight from live video piped to stdin.
+Each step runs on its own thread: read, colour conversion, zone reduction,
+temporal filter and transmit. Bounded lock-free queues connect them; when a stage
+falls behind, its input queue drops the oldest frame, so that the LEDs follow
+the newest picture (or with --backpressure, the earlier stages wait).
+Every second it reports the latency of every stage and the depth of every queue.
+
+Usage: livepipeline --size <width>x<height> [options] < frames
+    --format gray|yuv420p|yuv422p|yuv444p|yuv420p10le|p010le|v210|rgb24  (yuv420p)
+    --transfer sdr|pq|hlg    Transfer function (sdr); pq and hlg need a 10-bit format, --peak <nits> (1000)
+                             10-bit formats are converted and reduced in one pass (HDR-backlight-yuv.hpp),
+                             which the convert stage does, and the reduce stage passes the frames on
+    --fps <fps>             Frame rate of the input, for the temporal filter (60)
+    --subsample <n>         Convert every n-th row and column (4); 10-bit formats read every n-th row
+                            and all the columns
+    --mix <0..1>            Zone mean (0) to zone peak (1), 0.5 by default
+    --release <s>           Temporal filter release time constant (0.1)
+    --port <port>           Serial port of the Teensy
+    --backpressure          Wait for the next stage instead of dropping frames
+    --credits               Credit-based flow control: the transmit stage only waits for the Teensy
+                            when it has as many frames in flight as it can buffer, instead of after each one
+    --gate                  Skip the frames that look the same as the last one sent (ChangeGate), for --peak <nits>
+    --cache <MB>            Keep the finished frames of this many MB of pictures, by a hash of the picture;
+                            a picture seen before skips convert, reduce and filter (0, off). For looping content
+    --cache-file <path>     Load the cache from path at startup and save it there at exit
+e.g. ffmpeg -i <source> -f rawvideo -pix_fmt yuv420p - | livepipeline --size 3840x2160 --fps 120
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>  // For wall clock, since c++11
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>  // std::max
+#include <csignal>    // SIGINT, SIGTERM
+#include <cstring>    // strcmp()
+#include <mutex>
+#include <sstream>
+#include <cerrno>  // errno
+
+#include <unistd.h>  // read()
+#include <poll.h>    // poll()
+
+#include "HDR-backlight-cache.hpp"
+#include "HDR-backlight-driver.hpp"
+#include "HDR-backlight-video.hpp"
+#include "HDR-backlight-yuv.hpp"
+
+using hdrbacklightdriverjli::BoundedQueue;
+using hdrbacklightdriverjli::ChangeGate;
+using hdrbacklightdriverjli::FrameCache;
+using hdrbacklightdriverjli::frameToWire;
+using hdrbacklightdriverjli::GSFrame;
+using hdrbacklightdriverjli::hashFrame;
+using hdrbacklightdriverjli::LumaToLinear;
+using hdrbacklightdriverjli::TemporalFilter;
+using hdrbacklightdriverjli::TLCdriver;
+using hdrbacklightdriverjli::wireToFrame;
+using hdrbacklightdriverjli::YuvToLight;
+
+using std::cerr;
+using std::clog;
+using std::endl;
+
+typedef std::chrono::steady_clock Clock;
+
+// The stages, in order; each stamps the frame when it is done with it
+enum Stage { READ, CONVERT, REDUCE, FILTER, TRANSMIT, STAGE_COUNT };
+const char* const STAGE_NAMES[STAGE_COUNT] = {"read", "convert", "reduce", "filter", "transmit"};
+
+struct LiveFrame {
+    std::vector<uint8_t> raw;      // As read from stdin
+    std::vector<uint16_t> light;   // Linear light of the subsampled picture
+    GSFrame zones;
+    uint64_t key;    // Hash of the picture, with --cache
+    bool cached;     // zones and wire come from the cache, the stages in between pass the frame on
+    uint8_t wire[FRAME_CACHE_BYTES];
+    Clock::time_point done[STAGE_COUNT];
+};
+
+typedef BoundedQueue<LiveFrame*> FrameQueue;
+
+// Input queue of every stage after READ, two frames each, so that no stage works far behind the newest picture;
+// and the frames not in use
+FrameQueue convert_queue(2), reduce_queue(2), filter_queue(2), transmit_queue(2);
+FrameQueue* const queues[STAGE_COUNT] = {nullptr, &convert_queue, &reduce_queue, &filter_queue, &transmit_queue};
+FrameQueue free_frames(16);
+std::atomic<bool> stage_finished[STAGE_COUNT];
+std::atomic<unsigned long> dropped{0};
+bool backpressure = false;
+volatile std::sig_atomic_t stop = 0;
+
+void onSignal(int) {
+    stop = 1;
+}
+
+// Hand a frame to the next stage
+void forward(Stage next, LiveFrame* frame) {
+    if (!backpressure) {
+        dropped += queues[next]->pushDropOldest(frame, [](LiveFrame* oldest) { free_frames.push(oldest); });
+        return;
+    }
+    while (!queues[next]->push(frame) && !stop) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+// Wait for an item; false once the queue is empty and the stage before has finished
+bool take(FrameQueue& queue, Stage previous, LiveFrame*& frame) {
+    for (int attempt = 0;; attempt++) {
+        if (queue.pop(frame)) {
+            return true;
+        }
+        if (stage_finished[previous] || stop) {
+            return queue.pop(frame);
+        }
+        // Yield first, in case the producer is about to push; then sleep, so that idle stages leave the cores alone
+        if (attempt < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+}
+
+struct Format {
+    std::string name;
+    size_t frame_size;
+    int bytes_per_sample;
+    bool rgb;
+    bool yuv10;  // Converted and reduced in one pass
+};
+
+bool parseFormat(const std::string& name, int width, int height, Format& format) {
+    size_t pixels = (size_t)width * height;
+    size_t chroma420 = 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    format = {name, 0, 1, false, false};
+    if (name == "gray") {
+        format.frame_size = pixels;
+    } else if (name == "yuv420p") {
+        format.frame_size = pixels + chroma420;
+    } else if (name == "yuv422p") {
+        format.frame_size = pixels + 2 * (size_t)((width + 1) / 2) * height;
+    } else if (name == "yuv444p") {
+        format.frame_size = 3 * pixels;
+    } else if (name == "yuv420p10le") {
+        format.frame_size = 2 * (pixels + chroma420);
+        format.bytes_per_sample = 2;
+        format.yuv10 = true;
+    } else if (name == "p010le") {
+        format.frame_size = 2 * (pixels + (size_t)width * ((height + 1) / 2));
+        format.bytes_per_sample = 2;
+        format.yuv10 = true;
+    } else if (name == "v210") {
+        format.frame_size = (size_t)(width + 47) / 48 * 128 * height;
+        format.bytes_per_sample = 2;
+        format.yuv10 = true;
+    } else if (name == "rgb24") {
+        format.frame_size = 3 * pixels;
+        format.rgb = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// False at the end of the input, or once stop is set: the signal may go to another thread,
+// and a read() interrupted by it is restarted, so stdin is polled and stop checked in between
+bool readFully(uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&input, 1, 100);
+        if (stop) {
+            return false;
+        }
+        if (ready == 0 || (ready == -1 && errno == EINTR)) {
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, buffer, size);
+        if (n <= 0) {
+            return false;
+        }
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+struct StageStats {
+    double sum_ms = 0, max_ms = 0;
+};
+
+int main(int argc, char** argv) {
+    int width = 0, height = 0, subsample = 4;
+    std::string format_name = "yuv420p";
+    const char* port = DEFAULT_SERIAL_PORT;
+    double fps = 60, release_s = 0.1, peak_nits = 1000;
+    int transfer = TRANSFER_SDR;
+    float mix = 0.5f;
+    double cache_mb = 0;
+    const char* cache_path = nullptr;
+    bool flow_control = false;
+    bool gate = false;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--size") && has_value) {
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        } else if (!strcmp(argv[i], "--format") && has_value) {
+            format_name = argv[++i];
+        } else if (!strcmp(argv[i], "--transfer") && has_value) {
+            i++;
+            transfer = !strcmp(argv[i], "pq") ? TRANSFER_PQ : !strcmp(argv[i], "hlg") ? TRANSFER_HLG : TRANSFER_SDR;
+        } else if (!strcmp(argv[i], "--peak") && has_value) {
+            peak_nits = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--fps") && has_value) {
+            fps = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--subsample") && has_value) {
+            subsample = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--mix") && has_value) {
+            mix = (float)atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--release") && has_value) {
+            release_s = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--port") && has_value) {
+            port = argv[++i];
+        } else if (!strcmp(argv[i], "--backpressure")) {
+            backpressure = true;
+        } else if (!strcmp(argv[i], "--credits")) {
+            flow_control = true;
+        } else if (!strcmp(argv[i], "--gate")) {
+            gate = true;
+        } else if (!strcmp(argv[i], "--cache") && has_value) {
+            cache_mb = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--cache-file") && has_value) {
+            cache_path = argv[++i];
+        } else {
+            width = 0;
+            break;
+        }
+    }
+    Format format;
+    if (width <= 0 || height <= 0 || !parseFormat(format_name, width, height, format) || (transfer != TRANSFER_SDR && !format.yuv10)) {
+        cerr << "Usage: livepipeline --size WxH [--format F] [--transfer T] [--peak nits] [--fps F] [--subsample N] [--mix M] [--release s] [--port P] [--backpressure] [--credits] [--gate] [--cache MB] [--cache-file path]" << endl;
+        return 1;
+    }
+    const int light_width = (width + subsample - 1) / subsample;
+    const int light_height = (height + subsample - 1) / subsample;
+
+    // Limited range for YUV, full range for RGB, both with the BT.1886 curve
+    const LumaToLinear to_linear(format.bytes_per_sample == 2 ? 10 : 8, format.rgb, TRANSFER_SDR);
+    const LumaToLinear light_table(16, true, TRANSFER_LINEAR);
+    const YuvToLight to_light(transfer, peak_nits);
+
+    std::vector<LiveFrame> frames(free_frames.capacity());
+    for (LiveFrame& frame : frames) {
+        frame.raw.resize(format.frame_size);
+        frame.light.resize((size_t)light_width * light_height);
+        free_frames.push(&frame);
+    }
+
+    // The frames depend on the settings as much as on the picture
+    std::ostringstream settings_stream;
+    settings_stream << width << "x" << height << " " << format.name << " " << transfer << " " << peak_nits << " " << subsample << " " << mix << " "
+             << fps << " " << release_s;
+    const std::string settings = settings_stream.str();
+    const uint64_t cache_seed = hashFrame(settings.data(), settings.size());
+    FrameCache cache(cache_mb > 0 ? (size_t)(cache_mb * 1024 * 1024) : 0);
+    std::mutex cache_mutex;  // Looked up by the convert stage, filled by the transmit stage
+    const bool use_cache = cache.capacity() > 0;
+    if (use_cache && cache_path != nullptr && access(cache_path, F_OK) == 0 && cache.load(cache_path)) {
+        clog << "Loaded " << cache.size() << " frames from " << cache_path << endl;
+    }
+
+    TLCdriver TLCteensy(port, 9600);
+    if (TLCteensy.error() != TLC_OK) {
+        return 1;
+    }
+    TLCteensy.setAutoReconnect(true);
+    if (flow_control) {
+        TLCteensy.setFlowControl(true);
+    }
+    if (gate) {
+        TLCteensy.setChangeGate(true, CHANGE_GATE_THRESHOLD, peak_nits);
+    }
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    std::thread reader([&] {
+        while (!stop) {
+            LiveFrame* frame;
+            while (!free_frames.pop(frame)) {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            if (!readFully(frame->raw.data(), frame->raw.size())) {
+                break;
+            }
+            frame->done[READ] = Clock::now();
+            forward(CONVERT, frame);
+        }
+        stage_finished[READ] = true;
+    });
+
+    std::thread converter([&] {
+        LiveFrame* frame;
+        const int bytes = format.bytes_per_sample;
+        while (take(*queues[CONVERT], READ, frame)) {
+            frame->cached = false;
+            if (use_cache) {
+                frame->key = hashFrame(frame->raw.data(), frame->raw.size(), cache_seed);
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                const uint8_t* wire = cache.find(frame->key);
+                if (wire != nullptr) {
+                    std::memcpy(frame->wire, wire, FRAME_CACHE_BYTES);
+                    frame->cached = true;
+                }
+            }
+            if (frame->cached) {
+                wireToFrame(frame->wire, frame->zones);
+                frame->done[CONVERT] = Clock::now();
+                forward(REDUCE, frame);
+                continue;
+            }
+            if (format.yuv10) {
+                const uint8_t* raw = frame->raw.data();
+                const size_t chroma_stride = (size_t)(width + 1) / 2 * 2;
+                const uint8_t* cb = raw + (size_t)width * height * 2;
+                if (format.name == "yuv420p10le") {
+                    reduceZonesYuv420p10(raw, (size_t)width * 2, cb, chroma_stride, cb + chroma_stride * ((height + 1) / 2), chroma_stride,
+                                         width, height, to_light, subsample, mix, frame->zones);
+                } else if (format.name == "p010le") {
+                    reduceZonesP010(raw, (size_t)width * 2, cb, (size_t)width * 2, width, height, to_light, subsample, mix, frame->zones);
+                } else {
+                    reduceZonesV210(raw, (size_t)(width + 47) / 48 * 128, width, height, to_light, subsample, mix, frame->zones);
+                }
+                frame->done[CONVERT] = Clock::now();
+                forward(REDUCE, frame);
+                continue;
+            }
+            uint16_t* light = frame->light.data();
+            for (int row = 0; row < height; row += subsample) {
+                const uint8_t* line = frame->raw.data() + (size_t)row * width * (format.rgb ? 3 : bytes);
+                for (int column = 0; column < width; column += subsample) {
+                    float value;
+                    if (format.rgb) {
+                        const uint8_t* pixel = line + 3 * column;
+                        value = 0.2126f * to_linear[pixel[0]] + 0.7152f * to_linear[pixel[1]] + 0.0722f * to_linear[pixel[2]];
+                    } else {
+                        value = to_linear[bytes == 1 ? line[column] : (uint16_t)(line[2 * column] | line[2 * column + 1] << 8)];
+                    }
+                    *light++ = (uint16_t)(value * 0xFFFF + 0.5f);
+                }
+            }
+            frame->done[CONVERT] = Clock::now();
+            forward(REDUCE, frame);
+        }
+        stage_finished[CONVERT] = true;
+    });
+
+    std::thread reducer([&] {
+        LiveFrame* frame;
+        while (take(*queues[REDUCE], CONVERT, frame)) {
+            if (!format.yuv10 && !frame->cached) {
+                reduceZones((const uint8_t*)frame->light.data(), light_width, light_height, light_width * 2, 2, light_table, 1, mix,
+                            frame->zones);
+            }
+            frame->done[REDUCE] = Clock::now();
+            forward(FILTER, frame);
+        }
+        stage_finished[REDUCE] = true;
+    });
+
+    std::thread filterer([&] {
+        TemporalFilter filter(fps, 0, release_s);
+        LiveFrame* frame;
+        while (take(*queues[FILTER], REDUCE, frame)) {
+            if (frame->cached) {
+                filter.prime(frame->zones);  // So that the next frame computed is filtered from this one
+            } else {
+                filter.apply(frame->zones);
+            }
+            frame->done[FILTER] = Clock::now();
+            forward(TRANSMIT, frame);
+        }
+        stage_finished[FILTER] = true;
+    });
+
+    // Transmit on this thread, and report
+    StageStats stats[STAGE_COUNT];  // Time from the previous stage, [READ]: from read to latch
+    size_t depth_sum[STAGE_COUNT] = {0}, depth_max[STAGE_COUNT] = {0}, depth_samples = 0;
+    unsigned long shown = 0, report_shown = 0, report_dropped = 0;
+    auto report_time = Clock::now();
+    LiveFrame* frame;
+    while (take(*queues[TRANSMIT], FILTER, frame)) {
+        if (!use_cache) {
+            TLCteensy.updateFrame(frame->zones);
+        } else if (frame->cached) {
+            TLCteensy.updateFrameWire(frame->wire);
+        } else {
+            frameToWire(frame->zones, frame->wire);
+            TLCteensy.updateFrameWire(frame->wire);
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            cache.insert(frame->key, frame->wire);
+        }
+        frame->done[TRANSMIT] = Clock::now();
+
+        for (int stage = READ; stage < STAGE_COUNT; stage++) {
+            auto from = stage == READ ? frame->done[READ] : frame->done[stage - 1];
+            auto to = stage == READ ? frame->done[TRANSMIT] : frame->done[stage];
+            double ms = std::chrono::duration<double, std::milli>(to - from).count();
+            stats[stage].sum_ms += ms;
+            stats[stage].max_ms = std::max(stats[stage].max_ms, ms);
+        }
+        for (int stage = CONVERT; stage < STAGE_COUNT; stage++) {
+            size_t depth = queues[stage]->size();
+            depth_sum[stage] += depth;
+            depth_max[stage] = std::max(depth_max[stage], depth);
+        }
+        depth_samples++;
+        shown++;
+        free_frames.push(frame);
+
+        auto now = Clock::now();
+        if (now - report_time >= std::chrono::seconds(1)) {
+            unsigned long count = shown - report_shown;
+            std::chrono::duration<double> elapsed = now - report_time;
+            clog << count / elapsed.count() << " frames per sec., " << dropped - report_dropped << " dropped, ";
+            clog << "read to latch " << stats[READ].sum_ms / count << " ms (max " << stats[READ].max_ms << ")" << endl;
+            if (use_cache) {
+                std::lock_guard<std::mutex> lock(cache_mutex);
+                FrameCache::CacheStats cache_stats = cache.stats();
+                clog << "\tcache: " << 100 * cache_stats.hit_rate << "% hits, " << cache.size() << " of " << cache.capacity() << " frames, "
+                     << cache_stats.evictions << " evicted" << endl;
+                cache.resetStats();
+            }
+            if (gate) {
+                ChangeGate::Report gate_report = TLCteensy.changeGate().report();
+                clog << "\tgate: " << 100 * gate_report.skip_rate << "% of the frames skipped, " << gate_report.keepalives << " keep-alives since the start" << endl;
+            }
+            for (int stage = CONVERT; stage < STAGE_COUNT; stage++) {
+                clog << "\t" << STAGE_NAMES[stage] << ": " << stats[stage].sum_ms / count << " ms (max " << stats[stage].max_ms << "), ";
+                clog << "queue " << (double)depth_sum[stage] / depth_samples << " (max " << depth_max[stage] << ")" << endl;
+            }
+            for (int stage = READ; stage < STAGE_COUNT; stage++) {
+                stats[stage] = StageStats();
+                depth_sum[stage] = depth_max[stage] = 0;
+            }
+            depth_samples = 0;
+            report_shown = shown;
+            report_dropped = dropped;
+            report_time = now;
+        }
+    }
+    stop = 1;
+    reader.join();
+    converter.join();
+    reducer.join();
+    filterer.join();
+    clog << shown << " frames shown, " << dropped << " dropped" << endl;
+    if (use_cache && cache_path != nullptr && cache.save(cache_path)) {
+        clog << "Saved " << cache.size() << " frames to " << cache_path << endl;
+    }
+}
@@ -0,0 +1,87 @@
+/*
+-----------------------Simulated Board--------------------------------
+A simulated Teensy 3.2 on a pseudo-terminal, for running the driver,
+the daemon and the tools without the hardware.
+It answers like the Teensy_TLC_Control sketch, and disappears for a while
+when asked to reboot, like the Teensy does on USB.
+
+Usage: simboard [port link, default /tmp/tlc-sim]
+Then open the port link in place of the Teensy's serial port.
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>  // For wall clock, since c++11
+#include <csignal>  // SIGINT, SIGTERM
+
+#include "HDR-backlight-sim.hpp"
+
+using hdrbacklightdriverjli::PtyBoard;
+using hdrbacklightdriverjli::TLCfirmwareEmulator;
+
+using std::cerr;
+using std::clog;
+using std::endl;
+
+volatile std::sig_atomic_t stop = 0;
+
+void onSignal(int) {
+    stop = 1;
+}
+
+int main(int argc, char** argv) {
+    const char* link = argc > 1 ? argv[1] : "/tmp/tlc-sim";
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    PtyBoard pty(link);
+    if (!pty.isOpen()) {
+        return 1;
+    }
+    clog << "Simulated board on " << pty.name() << ", linked from " << link << endl;
+
+    const TLCfirmwareEmulator& board = pty.board();
+    unsigned long last_frames = 0, last_reboots = 0;
+    auto report_time = std::chrono::steady_clock::now();
+    while (!stop) {
+        if (!pty.serve(100)) {
+            return 1;
+        }
+        if (pty.reboots() != last_reboots) {
+            clog << "Rebooted, now on " << pty.name() << endl;
+            last_reboots = pty.reboots();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - report_time >= std::chrono::seconds(1)) {
+            std::chrono::duration<double> elapsed = now - report_time;
+            if (board.frames() != last_frames) {
+                clog << (board.frames() - last_frames) / elapsed.count() << " frames per sec." << endl;
+            }
+            last_frames = board.frames();
+            report_time = now;
+        }
+    }
+
+    clog << board.frames() << " frames, " << board.commands() << " commands, ";
+    clog << board.discardedBytes() << " bytes discarded" << endl;
+}
@@ -0,0 +1,168 @@
+/*
+-----------------------Track Player--------------------------------
+Plays a precomputed backlight track (see HDR-backlight-track.hpp) on the backlight,
+at the track's frame rate. The track is memory-mapped, and its frames are sent
+as they are stored, so playing costs little more CPU than the serial writes.
+
+Usage: trackplayer <track> [--port /dev/ttyACM0] [--start seconds] [--loop] [--batch <n>]
+       trackplayer --convert <text dump> <track> [--fps 24]
+With --batch, n frames go out in each write, and the Teensy keeps time rather than the host.
+A text dump has one frame per line, SCREEN_SIZE_X * SCREEN_SIZE_Y brightness values
+in the order of setLED(x, y): x = 0, y = 0..15, then x = 1, and so on.
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <fstream>  // std::ifstream
+#include <sstream>  // std::istringstream
+#include <string>
+#include <cstring>  // strcmp(), std::memcpy
+#include <vector>   // std::vector
+#include <algorithm>  // std::max
+
+#include "HDR-backlight-driver.hpp"
+#include "HDR-backlight-track.hpp"
+
+using hdrbacklightdriverjli::FramePacer;
+using hdrbacklightdriverjli::GSFrame;
+using hdrbacklightdriverjli::TLCdriver;
+using hdrbacklightdriverjli::TrackReader;
+using hdrbacklightdriverjli::TrackWriter;
+
+using std::cerr;
+using std::clog;
+using std::endl;
+
+int convert(const char* dump_path, const char* track_path, double fps) {
+    std::ifstream dump(dump_path);
+    if (!dump) {
+        cerr << "trackplayer: couldn't open " << dump_path << endl;
+        return 1;
+    }
+    TrackWriter track(track_path, fps);
+    if (!track.isOpen()) {
+        return 1;
+    }
+    GSFrame frame;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(dump, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream values(line);
+        for (int x = 0; x < SCREEN_SIZE_X; x++) {
+            for (int y = 0; y < SCREEN_SIZE_Y; y++) {
+                long bright;
+                if (!(values >> bright) || bright < 0 || bright > 0xFFFF) {
+                    cerr << "trackplayer: line " << line_number << " needs " << SCREEN_SIZE_X * SCREEN_SIZE_Y << " values in [0, 65535]" << endl;
+                    return 1;
+                }
+                frame.set(x, y, (uint16_t)bright);
+            }
+        }
+        track.append(frame);
+    }
+    return track.close() ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && !strcmp(argv[1], "--convert")) {
+        double fps = argc >= 6 && !strcmp(argv[4], "--fps") ? atof(argv[5]) : 24;
+        return convert(argv[2], argv[3], fps);
+    }
+
+    const char* port = DEFAULT_SERIAL_PORT;
+    double start_seconds = 0;
+    bool loop = false;
+    int batch = 0;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = argv[++i];
+        } else if (!strcmp(argv[i], "--start") && i + 1 < argc) {
+            start_seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--loop")) {
+            loop = true;
+        } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            batch = std::max(1, atoi(argv[++i]));
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc < 2) {
+        cerr << "Usage: trackplayer <track> [--port P] [--start seconds] [--loop] [--batch N]" << endl;
+        cerr << "       trackplayer --convert <text dump> <track> [--fps F]" << endl;
+        return 1;
+    }
+
+    TrackReader track(argv[1]);
+    if (!track.isOpen()) {
+        return 1;
+    }
+    if (!track.seek((uint64_t)(start_seconds * track.fps()))) {
+        cerr << "trackplayer: the track is only " << track.frameCount() / track.fps() << " s long" << endl;
+        return 1;
+    }
+    clog << track.frameCount() << " frames at " << track.fps() << " FPS" << endl;
+
+    TLCdriver TLCteensy(port, 9600);
+    if (TLCteensy.error() != TLC_OK) {
+        return 1;
+    }
+    TLCteensy.setAutoReconnect(true);
+    FramePacer pacer(track.fps());
+    const uint32_t interval_us = (uint32_t)(1e6 / track.fps());
+    std::vector<uint8_t> ahead((size_t)batch * TRACK_FRAME_BYTES);
+    do {
+        if (batch > 0) {
+            // The Teensy answers once the frames are queued, and waits while its queue is full
+            int queued = 0;
+            while (const uint8_t* frame = track.next()) {
+                std::memcpy(&ahead[queued * TRACK_FRAME_BYTES], frame, TRACK_FRAME_BYTES);
+                if (++queued == batch) {
+                    TLCteensy.submitFramesWire(ahead.data(), queued, interval_us);
+                    queued = 0;
+                }
+            }
+            if (queued > 0) {
+                TLCteensy.submitFramesWire(ahead.data(), queued, interval_us);
+            }
+        } else {
+            while (const uint8_t* frame = track.next()) {
+                TLCteensy.updateFrameWire(frame);
+                pacer.wait();
+            }
+        }
+        if (track.position() < track.frameCount()) {
+            cerr << "trackplayer: frame " << track.position() << " is corrupt" << endl;
+            return 1;
+        }
+    } while (loop && track.seek(0));
+
+    TLCdriver::FrameStats stats = TLCteensy.stats();
+    if (batch > 0) {
+        clog << stats.frames << " batches played, submitFrames mean " << stats.mean_us << " us" << endl;
+    } else {
+        clog << stats.frames << " frames played, " << pacer.missed() << " late, updateFrame mean " << stats.mean_us << " us" << endl;
+    }
+}
@@ -0,0 +1,303 @@
+/*
+-----------------------Transcoder--------------------------------
+Converts video into a backlight track (see HDR-backlight-track.hpp) offline.
+Every picture is reduced to the light of each LED zone on several threads,
+then the frames are put back in order for the temporal filter and the track.
+
+Usage: transcoder <input.y4m | -> <output.hblt> [options]
+    --raw <width>x<height>  Raw planar frames instead of Y4M, with --bits (8) and --chroma (420)
+    --fps <fps>             Frame rate of raw input (24)
+    --transfer sdr|pq|hlg|linear  Transfer function (sdr), --peak <nits> for pq and hlg (1000)
+                            10-bit 4:2:0 PQ and HLG go through the full colour conversion (HDR-backlight-yuv.hpp),
+                            anything else through the luma alone
+    --mix <0..1>            Zone mean (0) to zone peak (1), 0.5 by default
+    --subsample <n>         Read every n-th row and column (1). The full colour conversion reads every n-th row
+                            and all the columns; --solver reads every sample
+    --attack <s> --release <s>  Temporal filter time constants (0 and 0.25)
+    --solver                Pick the LED levels with BacklightSolver (HDR-backlight-solver.hpp) instead of
+                            the zone mean/peak mix, from the peak light of the luma on the solver's grid
+    --threads <n>           Zone reduction threads (all the cores)
+'-' reads from stdin, e.g. ffmpeg -i movie.mkv -f yuv4mpegpipe -pix_fmt yuv420p10le - | transcoder - movie.hblt
+
+Copyright (c) 2017 Junteng (Jason) Li
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <chrono>  // For wall clock, since c++11
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>  // strcmp()
+
+#include "HDR-backlight-video.hpp"
+#include "HDR-backlight-yuv.hpp"
+#include "HDR-backlight-solver.hpp"
+#include "HDR-backlight-track.hpp"
+
+using hdrbacklightdriverjli::BacklightSolver;
+using hdrbacklightdriverjli::GSFrame;
+using hdrbacklightdriverjli::LumaToLinear;
+using hdrbacklightdriverjli::TemporalFilter;
+using hdrbacklightdriverjli::TrackWriter;
+using hdrbacklightdriverjli::VideoReader;
+using hdrbacklightdriverjli::YuvToLight;
+
+using std::cerr;
+using std::clog;
+using std::endl;
+
+// One picture in flight, from the reader through a worker to the writer
+struct Job {
+    uint64_t sequence;
+    std::vector<uint8_t> luma;
+    std::vector<uint8_t> chroma;  // Only for the full colour conversion
+    std::vector<float> targets;   // Only for the solver
+    GSFrame zones;
+};
+
+// Blocking queue of jobs; pop() returns nullptr once the queue is closed and empty
+class JobQueue {
+   public:
+    void push(Job* job) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _jobs.push_back(job);
+        _ready.notify_one();
+    }
+    Job* pop() {
+        std::unique_lock<std::mutex> guard(_lock);
+        _ready.wait(guard, [this] { return !_jobs.empty() || _closed; });
+        if (_jobs.empty()) {
+            return nullptr;
+        }
+        Job* job = _jobs.front();
+        _jobs.pop_front();
+        return job;
+    }
+    void close() {
+        std::lock_guard<std::mutex> guard(_lock);
+        _closed = true;
+        _ready.notify_all();
+    }
+
+   private:
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::deque<Job*> _jobs;
+    bool _closed = false;
+};
+
+// Reduced frames arrive in any order, and leave in sequence order for the temporal filter
+class ReorderStage {
+   public:
+    explicit ReorderStage(int producers) : _producers(producers) {}
+    void push(Job* job) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _waiting[job->sequence] = job;
+        _ready.notify_one();
+    }
+    void producerDone() {
+        std::lock_guard<std::mutex> guard(_lock);
+        _producers--;
+        _ready.notify_one();
+    }
+    // The next job in sequence, nullptr when every producer is done and nothing is left
+    Job* pop() {
+        std::unique_lock<std::mutex> guard(_lock);
+        _ready.wait(guard, [this] { return _waiting.count(_next) > 0 || (_producers == 0 && _waiting.empty()); });
+        auto it = _waiting.find(_next);
+        if (it == _waiting.end()) {
+            return nullptr;
+        }
+        Job* job = it->second;
+        _waiting.erase(it);
+        _next++;
+        return job;
+    }
+
+   private:
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::map<uint64_t, Job*> _waiting;
+    uint64_t _next = 0;
+    int _producers;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        cerr << "Usage: transcoder <input.y4m | -> <output.hblt> [--raw WxH] [--bits B] [--chroma C] [--fps F]" << endl;
+        cerr << "       [--transfer sdr|pq|hlg|linear] [--peak nits] [--mix M] [--subsample N] [--attack s] [--release s] [--threads N] [--solver]" << endl;
+        return 1;
+    }
+    int raw_width = 0, raw_height = 0, bits = 8, subsample = 1;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string chroma = "420";
+    int transfer = TRANSFER_SDR;
+    double fps = 24, peak_nits = 1000, attack_s = 0, release_s = 0.25;
+    float mix = 0.5f;
+    bool use_solver = false;
+    for (int i = 3; i < argc; i += 2) {
+        const char* option = argv[i];
+        if (!strcmp(option, "--solver")) {
+            use_solver = true;
+            i--;
+            continue;
+        }
+        if (i + 1 == argc) {
+            cerr << "transcoder: " << option << " needs a value" << endl;
+            return 1;
+        }
+        const char* value = argv[i + 1];
+        if (!strcmp(option, "--raw")) {
+            if (sscanf(value, "%dx%d", &raw_width, &raw_height) != 2 || raw_width <= 0 || raw_height <= 0) {
+                cerr << "transcoder: invalid value " << value << " for --raw, expected <width>x<height>" << endl;
+                return 1;
+            }
+        } else if (!strcmp(option, "--bits")) {
+            bits = atoi(value);
+        } else if (!strcmp(option, "--chroma")) {
+            chroma = value;
+        } else if (!strcmp(option, "--fps")) {
+            fps = atof(value);
+        } else if (!strcmp(option, "--transfer")) {
+            transfer = !strcmp(value, "pq") ? TRANSFER_PQ : !strcmp(value, "hlg") ? TRANSFER_HLG : !strcmp(value, "linear") ? TRANSFER_LINEAR : TRANSFER_SDR;
+        } else if (!strcmp(option, "--peak")) {
+            peak_nits = atof(value);
+        } else if (!strcmp(option, "--mix")) {
+            mix = (float)atof(value);
+        } else if (!strcmp(option, "--subsample")) {
+            subsample = atoi(value);
+        } else if (!strcmp(option, "--attack")) {
+            attack_s = atof(value);
+        } else if (!strcmp(option, "--release")) {
+            release_s = atof(value);
+        } else if (!strcmp(option, "--threads")) {
+            threads = std::max(1, atoi(value));
+        } else {
+            cerr << "transcoder: unknown option " << option << endl;
+            return 1;
+        }
+    }
+
+    FILE* input = strcmp(argv[1], "-") ? fopen(argv[1], "rb") : stdin;
+    if (input == nullptr) {
+        perror("transcoder: couldn't open the input\n\t");
+        return 1;
+    }
+    VideoReader video = raw_width > 0 ? VideoReader(input, raw_width, raw_height, bits, chroma) : VideoReader(input);
+    if (!video.isOpen()) {
+        return 1;
+    }
+    if (raw_width == 0) {
+        fps = video.fps();
+    }
+    LumaToLinear to_linear(video.bitDepth(), video.fullRange(), transfer, peak_nits);
+    BacklightSolver solver;
+    const bool full_colour = !use_solver && video.bitDepth() == 10 && video.chroma() == "420" && !video.fullRange() && (transfer == TRANSFER_PQ || transfer == TRANSFER_HLG);
+    YuvToLight to_light(transfer, peak_nits);
+    TrackWriter track(argv[2], fps);
+    if (!track.isOpen()) {
+        return 1;
+    }
+    clog << video.width() << "x" << video.height() << ", " << video.bitDepth() << " bits, " << fps << " FPS, ";
+    clog << threads << " threads, " << (use_solver ? "solver" : full_colour ? "full colour (" YUV_KERNEL ")" : "luma") << endl;
+
+    // A fixed set of jobs bounds the memory: the reader waits for a free one
+    std::vector<Job> jobs(2 * threads + 2);
+    JobQueue free_jobs, work;
+    for (Job& job : jobs) {
+        job.luma.resize(video.lumaSize());
+        job.chroma.resize(full_colour ? video.chromaSize() : 0);
+        job.targets.resize(use_solver ? solver.cellsX() * solver.cellsY() : 0);
+        free_jobs.push(&job);
+    }
+    ReorderStage reorder(threads);
+
+    auto timer_start = std::chrono::steady_clock::now();
+    std::thread reader([&] {
+        for (uint64_t sequence = 0;; sequence++) {
+            Job* job = free_jobs.pop();
+            if (job == nullptr || !video.readFrame(job->luma.data(), full_colour ? job->chroma.data() : nullptr)) {
+                break;
+            }
+            job->sequence = sequence;
+            work.push(job);
+        }
+        work.close();
+    });
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&] {
+            while (Job* job = work.pop()) {
+                if (use_solver) {
+                    peakCells(job->luma.data(), video.width(), video.height(), (size_t)video.width() * video.bytesPerSample(),
+                              video.bytesPerSample(), to_linear, solver.cellsX(), solver.cellsY(), job->targets.data());
+                    reorder.push(job);
+                    continue;
+                }
+                if (full_colour) {
+                    const size_t chroma_stride = (size_t)(video.width() + 1) / 2 * 2;  // Bytes
+                    const uint8_t* cb = job->chroma.data();
+                    const uint8_t* cr = cb + job->chroma.size() / 2;
+                    reduceZonesYuv420p10(job->luma.data(), (size_t)video.width() * 2, cb, chroma_stride, cr, chroma_stride, video.width(),
+                                         video.height(), to_light, subsample, mix, job->zones);
+                    reorder.push(job);
+                    continue;
+                }
+                reduceZones(job->luma.data(), video.width(), video.height(), (size_t)video.width() * video.bytesPerSample(),
+                            video.bytesPerSample(), to_linear, subsample, mix, job->zones);
+                reorder.push(job);
+            }
+            reorder.producerDone();
+        });
+    }
+
+    // The solver, warm-started from the previous frame, and the temporal filter need the frames in order,
+    // so they run here, one frame at a time
+    TemporalFilter filter(fps, attack_s, release_s);
+    uint64_t frames = 0;
+    while (Job* job = reorder.pop()) {
+        if (use_solver) {
+            solver.setTargets(job->targets.data());
+            solver.solve(job->zones);
+        }
+        filter.apply(job->zones);
+        track.append(job->zones);
+        free_jobs.push(job);
+        if (++frames % 1000 == 0) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - timer_start;
+            clog << frames << " frames, " << frames / elapsed.count() << " frames per sec." << endl;
+        }
+    }
+    free_jobs.close();  // The reader may be waiting for a job after the end of the input
+    reader.join();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - timer_start;
+    clog << frames << " frames in " << elapsed.count() << " s, " << frames / elapsed.count() << " frames per sec., ";
+    clog << frames / fps / elapsed.count() << "x real time" << endl;
+    return track.close() ? 0 : 1;
+}